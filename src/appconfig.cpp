@@ -75,6 +75,120 @@ void CAppConfig::readConfig()
 		throw std::runtime_error("the redirection URI was not found in the configuration file");
 
 	authorizationCode_ = root["authorization_code"].asString();
+
+	if (!!root["connection_pool_size"])
+		connectionPoolSize_ = root["connection_pool_size"].asUInt();
+	if (connectionPoolSize_ == 0)
+		throw std::runtime_error("the connection pool size must be at least 1");
+
+	if (!!root["transport"])
+		readTransportProfile(root["transport"]);
+
+	if (!!root["retry"])
+		readRetryProfile(root["retry"]);
+
+	if (!!root["scheduler"])
+		readSchedulerProfile(root["scheduler"]);
+
+	// Some connections have to be left for the lookups
+	if (schedulerProfile_.readSlots + schedulerProfile_.streamSlots + schedulerProfile_.backgroundSlots +
+	    schedulerProfile_.uploadSlots >= connectionPoolSize_)
+		throw std::runtime_error("the read, stream, background and upload slots must add up to less than the "
+					 "connection pool size");
+
+	if (!!root["content_cache"])
+		readContentCacheProfile(root["content_cache"]);
+	if (contentCacheProfile_.dir.empty())
+		contentCacheProfile_.dir = configDir_ + "/content";
+
+	if (!!root["hedging"])
+		readHedgeProfile(root["hedging"]);
+
+	// Lets the driver be pointed at a stand-in server
+	if (!!root["graph_url"])
+		graphUrl_ = root["graph_url"].asString();
+
+	if (!!root["download_url_lifetime"])
+		downloadUrlLifetime_ = root["download_url_lifetime"].asUInt();
+	if (downloadUrlLifetime_ < 60)
+		throw std::runtime_error("the download URL lifetime must be at least 60 seconds");
+
+	if (!!root["batch_window_ms"])
+		batchWindow_ = root["batch_window_ms"].asUInt();
+
+	if (!!root["cache_size"])
+		cacheSize_ = root["cache_size"].asUInt();
+	if (cacheSize_ == 0)
+		throw std::runtime_error("the cache must hold at least one item");
+
+	if (!!root["entry_timeout"])
+		entryTimeout_ = root["entry_timeout"].asUInt();
+
+	if (!!root["negative_timeout"])
+		negativeTimeout_ = root["negative_timeout"].asUInt();
+
+	if (!!root["max_staleness"])
+		maxStaleness_ = root["max_staleness"].asUInt();
+
+	if (!!root["delta_interval"])
+		deltaInterval_ = root["delta_interval"].asUInt();
+
+	if (!!root["snapshot_interval"])
+		snapshotInterval_ = root["snapshot_interval"].asUInt();
+
+	if (!!root["page_size"])
+		pageSize_ = root["page_size"].asUInt();
+	if (pageSize_ == 0)
+		throw std::runtime_error("the page size must be at least 1");
+
+	if (!!root["readahead_max_kb"])
+		readaheadMax_ = static_cast<size_t>(root["readahead_max_kb"].asUInt()) << 10;
+
+	if (!!root["stream_buffer_kb"])
+		streamBuffer_ = static_cast<size_t>(root["stream_buffer_kb"].asUInt()) << 10;
+
+	if (!!root["max_streams"])
+		maxStreams_ = root["max_streams"].asUInt();
+
+	if (!!root["download_segments"])
+		downloadSegments_ = root["download_segments"].asUInt();
+
+	if (!!root["segment_size_kb"])
+		segmentSize_ = static_cast<size_t>(root["segment_size_kb"].asUInt()) << 10;
+	if (segmentSize_ == 0)
+		throw std::runtime_error("the segment size must be at least 1 KB");
+}
+
+void CAppConfig::readTransportProfile(const Json::Value &node)
+{
+	if (!!node["connect_timeout"])
+		transportProfile_.connectTimeout = node["connect_timeout"].asInt();
+
+	if (!!node["low_speed_limit"])
+		transportProfile_.lowSpeedLimit = node["low_speed_limit"].asInt();
+
+	if (!!node["low_speed_time"])
+		transportProfile_.lowSpeedTime = node["low_speed_time"].asInt();
+
+	if (!!node["tcp_keepalive"])
+		transportProfile_.tcpKeepAlive = node["tcp_keepalive"].asBool();
+
+	if (!!node["tcp_keepidle"])
+		transportProfile_.tcpKeepIdle = node["tcp_keepidle"].asInt();
+
+	if (!!node["tcp_keepintvl"])
+		transportProfile_.tcpKeepInterval = node["tcp_keepintvl"].asInt();
+
+	if (!!node["tcp_nodelay"])
+		transportProfile_.tcpNoDelay = node["tcp_nodelay"].asBool();
+
+	if (!!node["accept_encoding"])
+		transportProfile_.acceptEncoding = node["accept_encoding"].asString();
+
+	if (!!node["buffer_size"])
+		transportProfile_.bufferSize = node["buffer_size"].asInt();
+	if (transportProfile_.bufferSize <= 0)
+		throw std::runtime_error("the transport buffer size must be positive");
 }
 
 void CAppConfig::readToken()
@@ -88,6 +202,8 @@ void CAppConfig::readToken()
 
 	f >> root;
 
+	std::lock_guard<std::mutex> lock(tokenMutex_);
+
 	tokenType_       = root["token_type"].asString();
 	tokenScope_      = root["scope"].asString();
 	tokenExpires_    = root["expires_in"].asString();
@@ -96,4 +212,90 @@ void CAppConfig::readToken()
 	refreshToken_    = root["refresh_token"].asString();
 }
 
+void CAppConfig::readRetryProfile(const Json::Value &node)
+{
+	if (!!node["max_retries"])
+		retryProfile_.maxRetries = node["max_retries"].asUInt();
+
+	if (!!node["base_delay_ms"])
+		retryProfile_.baseDelay = node["base_delay_ms"].asInt();
+
+	if (!!node["max_delay_ms"])
+		retryProfile_.maxDelay = node["max_delay_ms"].asInt();
+	if (retryProfile_.baseDelay <= 0 || retryProfile_.maxDelay < retryProfile_.baseDelay)
+		throw std::runtime_error("invalid retry delays");
+
+	if (!!node["request_rate"])
+		retryProfile_.requestRate = node["request_rate"].asDouble();
+
+	if (!!node["request_burst"])
+		retryProfile_.requestBurst = node["request_burst"].asDouble();
+	if (retryProfile_.requestRate <= 0 || retryProfile_.requestBurst < 1)
+		throw std::runtime_error("invalid request rate limits");
+
+	if (!!node["breaker_threshold"])
+		retryProfile_.breakerThreshold = node["breaker_threshold"].asUInt();
+
+	if (!!node["breaker_open_time"])
+		retryProfile_.breakerOpenTime = node["breaker_open_time"].asInt();
+}
+
+void CAppConfig::readSchedulerProfile(const Json::Value &node)
+{
+	if (!!node["interactive_slots"])
+		schedulerProfile_.interactiveSlots = node["interactive_slots"].asUInt();
+
+	if (!!node["read_slots"])
+		schedulerProfile_.readSlots = node["read_slots"].asUInt();
+
+	if (!!node["stream_slots"])
+		schedulerProfile_.streamSlots = node["stream_slots"].asUInt();
+
+	if (!!node["background_slots"])
+		schedulerProfile_.backgroundSlots = node["background_slots"].asUInt();
+
+	if (!!node["upload_slots"])
+		schedulerProfile_.uploadSlots = node["upload_slots"].asUInt();
+	if (schedulerProfile_.interactiveSlots == 0 || schedulerProfile_.readSlots == 0 ||
+	    schedulerProfile_.streamSlots == 0 || schedulerProfile_.backgroundSlots == 0 ||
+	    schedulerProfile_.uploadSlots == 0)
+		throw std::runtime_error("every class of requests needs at least one slot");
+
+	if (!!node["background_rate"])
+		schedulerProfile_.backgroundRate = node["background_rate"].asInt64();
+
+	if (!!node["upload_rate"])
+		schedulerProfile_.uploadRate = node["upload_rate"].asInt64();
+}
+
+void CAppConfig::readContentCacheProfile(const Json::Value &node)
+{
+	if (!!node["dir"])
+		contentCacheProfile_.dir = node["dir"].asString();
+
+	if (!!node["max_size_mb"])
+		contentCacheProfile_.maxSize = node["max_size_mb"].asUInt64() << 20;
+
+	if (!!node["block_size_kb"])
+		contentCacheProfile_.blockSize = static_cast<size_t>(node["block_size_kb"].asUInt()) << 10;
+	if (contentCacheProfile_.blockSize == 0)
+		throw std::runtime_error("the content cache block size must be at least 1 KiB");
+}
+
+void CAppConfig::readHedgeProfile(const Json::Value &node)
+{
+	if (!!node["percentile"])
+		hedgeProfile_.percentile = node["percentile"].asUInt();
+	if (hedgeProfile_.percentile >= 100)
+		throw std::runtime_error("the hedging percentile must be below 100");
+
+	if (!!node["max_percent"])
+		hedgeProfile_.maxPercent = node["max_percent"].asUInt();
+
+	if (!!node["min_samples"])
+		hedgeProfile_.minSamples = node["min_samples"].asUInt();
+	if (hedgeProfile_.minSamples == 0)
+		throw std::runtime_error("hedging needs at least one latency sample");
+}
+
 } // namespace OneDrive
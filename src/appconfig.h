@@ -3,11 +3,74 @@
 #ifndef __APPCONFIG_H_INCLUDED__
 #define __APPCONFIG_H_INCLUDED__
 
+#include <stddef.h>
+#include <stdint.h>
 #include <memory>
+#include <mutex>
 #include <string>
 
+namespace Json {
+class Value;
+}
+
 namespace OneDrive {
 
+// The transport settings applied to every cURL handle
+struct CTransportProfile {
+	long        connectTimeout{30};
+	// A transfer is aborted when slower than lowSpeedLimit bytes/s for lowSpeedTime seconds
+	long        lowSpeedLimit{1024};
+	long        lowSpeedTime{60};
+	bool        tcpKeepAlive{true};
+	long        tcpKeepIdle{60};
+	long        tcpKeepInterval{30};
+	bool        tcpNoDelay{true};
+	// Offered on metadata requests; empty means every encoding libcurl supports
+	std::string acceptEncoding;
+	long        bufferSize{256 * 1024};
+};
+
+// How failed and throttled requests are retried
+struct CRetryProfile {
+	unsigned int maxRetries{5};
+	long         baseDelay{500};    // ms
+	long         maxDelay{60000};   // ms
+	double       requestRate{50};   // requests per second
+	double       requestBurst{100};
+	unsigned int breakerThreshold{10};
+	long         breakerOpenTime{30}; // s
+};
+
+// How the connections are shared between the classes of requests. Each
+// class may hold at most that many connections at once; the caps are in
+// bytes/s over all the transfers of the class, 0 meaning unlimited, and
+// are split evenly between its slots.
+struct CSchedulerProfile {
+	unsigned int interactiveSlots{8};
+	unsigned int readSlots{6};
+	unsigned int streamSlots{4};
+	unsigned int backgroundSlots{2};
+	unsigned int uploadSlots{2};
+	long         backgroundRate{0};
+	long         uploadRate{0};
+};
+
+// When a ranged download is duplicated on another connection: once it has
+// been running longer than that percentile of the latencies measured for
+// its host, as long as the duplicates stay within that share of requests
+struct CHedgeProfile {
+	unsigned int percentile{0};  // 0 turns hedging off
+	unsigned int maxPercent{5};
+	unsigned int minSamples{32}; // latencies measured before a host is hedged
+};
+
+// Where and how much of the file contents is kept on disk across mounts
+struct CContentCacheProfile {
+	std::string dir;                   // empty means content in the config directory
+	uint64_t    maxSize{1024ULL << 20}; // bytes, 0 turns the cache off
+	size_t      blockSize{1 << 20};     // bytes
+};
+
 class CAppConfig
 {
 public:
@@ -64,31 +127,43 @@ public:
 
 	std::string tokenType() const
 	{
+		std::lock_guard<std::mutex> lock(tokenMutex_);
+
 		return tokenType_;
 	}
 
 	std::string tokenScope() const
 	{
+		std::lock_guard<std::mutex> lock(tokenMutex_);
+
 		return tokenScope_;
 	}
 
 	std::string tokenExpires() const
 	{
+		std::lock_guard<std::mutex> lock(tokenMutex_);
+
 		return tokenExpires_;
 	}
 
 	std::string tokenExtExpires() const
 	{
+		std::lock_guard<std::mutex> lock(tokenMutex_);
+
 		return tokenExtExpires_;
 	}
 
 	std::string token() const
 	{
+		std::lock_guard<std::mutex> lock(tokenMutex_);
+
 		return token_;
 	}
 
 	std::string refreshToken() const
 	{
+		std::lock_guard<std::mutex> lock(tokenMutex_);
+
 		return refreshToken_;
 	}
 
@@ -99,6 +174,111 @@ public:
 
 	void setConfigDir(const std::string &configDir);
 
+	unsigned int connectionPoolSize() const
+	{
+		return connectionPoolSize_;
+	}
+
+	const CTransportProfile & transportProfile() const
+	{
+		return transportProfile_;
+	}
+
+	const CRetryProfile & retryProfile() const
+	{
+		return retryProfile_;
+	}
+
+	const CSchedulerProfile & schedulerProfile() const
+	{
+		return schedulerProfile_;
+	}
+
+	const CContentCacheProfile & contentCacheProfile() const
+	{
+		return contentCacheProfile_;
+	}
+
+	const CHedgeProfile & hedgeProfile() const
+	{
+		return hedgeProfile_;
+	}
+
+	std::string graphUrl() const
+	{
+		return graphUrl_;
+	}
+
+	unsigned int downloadUrlLifetime() const
+	{
+		return downloadUrlLifetime_;
+	}
+
+	unsigned int batchWindow() const
+	{
+		return batchWindow_;
+	}
+
+	size_t cacheSize() const
+	{
+		return cacheSize_;
+	}
+
+	unsigned int entryTimeout() const
+	{
+		return entryTimeout_;
+	}
+
+	unsigned int negativeTimeout() const
+	{
+		return negativeTimeout_;
+	}
+
+	unsigned int maxStaleness() const
+	{
+		return maxStaleness_;
+	}
+
+	unsigned int deltaInterval() const
+	{
+		return deltaInterval_;
+	}
+
+	unsigned int snapshotInterval() const
+	{
+		return snapshotInterval_;
+	}
+
+	unsigned int pageSize() const
+	{
+		return pageSize_;
+	}
+
+	size_t readaheadMax() const
+	{
+		return readaheadMax_;
+	}
+
+	size_t streamBuffer() const
+	{
+		return streamBuffer_;
+	}
+
+	unsigned int maxStreams() const
+	{
+		return maxStreams_;
+	}
+
+	unsigned int downloadSegments() const
+	{
+		return downloadSegments_;
+	}
+
+	size_t segmentSize() const
+	{
+		return segmentSize_;
+	}
+
 private:
 	std::string authorityUrl_;
 	std::string authEndpoint_;
@@ -113,8 +293,53 @@ private:
 	std::string tokenExtExpires_;
 	std::string token_;
 	std::string refreshToken_;
+	mutable std::mutex tokenMutex_;
 
 	std::string configDir_;
+
+	unsigned int connectionPoolSize_{16};
+
+	CTransportProfile transportProfile_;
+	CRetryProfile     retryProfile_;
+	CSchedulerProfile schedulerProfile_;
+
+	CContentCacheProfile contentCacheProfile_;
+
+	CHedgeProfile hedgeProfile_;
+
+	std::string graphUrl_{"https://graph.microsoft.com/v1.0"};
+
+	unsigned int downloadUrlLifetime_{3600};
+
+	unsigned int batchWindow_{10};
+
+	size_t cacheSize_{65536};
+
+	unsigned int entryTimeout_{1};
+	unsigned int negativeTimeout_{10};
+	unsigned int maxStaleness_{300};
+
+	unsigned int deltaInterval_{10};
+	unsigned int snapshotInterval_{600};
+	unsigned int pageSize_{1000};
+
+	size_t readaheadMax_{16 << 20};
+
+	size_t       streamBuffer_{4 << 20};
+	unsigned int maxStreams_{2};
+
+	unsigned int downloadSegments_{4};
+	size_t       segmentSize_{8 << 20};
+
+	void readTransportProfile(const Json::Value &node);
+
+	void readRetryProfile(const Json::Value &node);
+
+	void readSchedulerProfile(const Json::Value &node);
+
+	void readContentCacheProfile(const Json::Value &node);
+
+	void readHedgeProfile(const Json::Value &node);
 };
 
 } // namespace OneDrive
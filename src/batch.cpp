@@ -0,0 +1,302 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <json/json.h>
+#include <sstream>
+#include <stdexcept>
+#include "appconfig.h"
+#include "batch.h"
+#include "graph.h"
+#include "log.h"
+
+namespace {
+
+long retryAfterFromJson(const Json::Value &headers)
+{
+	const Json::Value &value = headers["Retry-After"];
+
+	try {
+		if (value.isString())
+			return std::stol(value.asString());
+		if (value.isIntegral())
+			return value.asInt();
+	} catch (const std::exception &) {
+		// An HTTP date is not worth the trouble, the backoff will do
+	}
+
+	return -1;
+}
+
+std::string bodyFromJson(const Json::Value &body)
+{
+	if (body.isString())
+		return body.asString();
+
+	if (body.isNull())
+		return std::string();
+
+	Json::StreamWriterBuilder builder;
+
+	builder["indentation"] = "";
+
+	return Json::writeString(builder, body);
+}
+
+} // anonymous namespace
+
+namespace OneDrive {
+
+const size_t CBatcher::maxRequests;
+
+CBatcher::CBatcher(CGraph *graph, CRateLimiter *limiter): graph_{graph}, limiter_{limiter},
+	retryPolicy_{gConfig.retryProfile()}, window_{gConfig.batchWindow()}
+{
+	thread_ = std::thread(&CBatcher::run, this);
+}
+
+CBatcher::~CBatcher()
+{
+	stop();
+}
+
+void CBatcher::add(const std::string &method, const std::string &resource, Completion done)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (stop_)
+		throw std::runtime_error("the request batcher has been stopped");
+
+	enqueue(CRequest{method, resource, std::move(done), 0}, Clock::now());
+}
+
+void CBatcher::flush()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (pending_.empty())
+		return;
+
+	flush_ = true;
+
+	cond_.notify_one();
+}
+
+void CBatcher::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		stop_ = true;
+	}
+
+	cond_.notify_one();
+
+	if (thread_.joinable())
+		thread_.join();
+
+	std::exception_ptr error = std::make_exception_ptr(std::runtime_error("the request batcher has been stopped"));
+
+	std::deque<CRequest> pending;
+	std::multimap<Clock::time_point, CRequest> delayed;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		pending.swap(pending_);
+		delayed.swap(delayed_);
+	}
+
+	for (auto &&i : pending)
+		i.done(0, std::string(), error);
+
+	for (auto &&i : delayed)
+		i.second.done(0, std::string(), error);
+}
+
+void CBatcher::enqueue(CRequest request, Clock::time_point now)
+{
+	// The first request of a batch opens the window
+	if (pending_.empty()) {
+		deadline_ = now + window_;
+		cond_.notify_one();
+	}
+
+	pending_.push_back(std::move(request));
+
+	if (pending_.size() == maxRequests)
+		cond_.notify_one();
+}
+
+void CBatcher::run()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	while (!stop_) {
+		Clock::time_point now = Clock::now();
+
+		while (!delayed_.empty() && delayed_.begin()->first <= now) {
+			enqueue(std::move(delayed_.begin()->second), now);
+			delayed_.erase(delayed_.begin());
+		}
+
+		if (pending_.size() >= maxRequests || (!pending_.empty() && (flush_ || now >= deadline_))) {
+			std::shared_ptr<CBatch> batch(new CBatch());
+
+			while (!pending_.empty() && batch->size() < maxRequests) {
+				batch->push_back(std::move(pending_.front()));
+				pending_.pop_front();
+			}
+
+			if (pending_.empty())
+				flush_ = false;
+
+			lock.unlock();
+
+			send(batch);
+
+			lock.lock();
+			continue;
+		}
+
+		if (pending_.empty() && delayed_.empty()) {
+			cond_.wait(lock);
+			continue;
+		}
+
+		Clock::time_point wakeup = pending_.empty() ? delayed_.begin()->first : deadline_;
+
+		if (!delayed_.empty() && delayed_.begin()->first < wakeup)
+			wakeup = delayed_.begin()->first;
+
+		cond_.wait_until(lock, wakeup);
+	}
+}
+
+void CBatcher::send(std::shared_ptr<CBatch> batch)
+{
+	Json::Value root;
+
+	for (size_t i = 0; i < batch->size(); i++) {
+		Json::Value request;
+
+		request["id"]     = std::to_string(i);
+		request["method"] = (*batch)[i].method;
+		request["url"]    = (*batch)[i].resource;
+
+		root["requests"].append(request);
+	}
+
+	Json::StreamWriterBuilder builder;
+
+	builder["indentation"] = "";
+
+	std::string url = gConfig.graphUrl() + "/$batch";
+	std::string body = Json::writeString(builder, root);
+	std::shared_ptr<std::string> data(new std::string());
+
+	try {
+		graph_->submit([url, body, data](CCurl &curl) {
+			data->clear();
+
+			curl.prepareJsonPost(url, body, *data);
+		}, [this, batch, data](CCurl &, long respCode, std::exception_ptr error) {
+			if (!error) {
+				complete(batch, respCode, *data);
+				return;
+			}
+
+			for (auto &&i : *batch)
+				i.done(0, std::string(), error);
+		});
+	} catch (...) {
+		for (auto &&i : *batch)
+			i.done(0, std::string(), std::current_exception());
+	}
+}
+
+void CBatcher::complete(std::shared_ptr<CBatch> batch, long respCode, const std::string &data)
+{
+	std::vector<bool> answered(batch->size(), false);
+
+	try {
+		if (respCode != 200)
+			throw CHttpError("HTTP error while batching: ", respCode);
+
+		std::stringstream stream;
+
+		stream << data;
+
+		Json::Value root;
+
+		stream >> root;
+
+		const Json::Value &responses = root["responses"];
+
+		for (unsigned int i = 0; i < responses.size(); i++) {
+			const Json::Value &response = responses[i];
+
+			size_t id = std::stoul(response["id"].asString());
+
+			if (id >= batch->size() || answered[id])
+				continue;
+
+			answered[id] = true;
+
+			CRequest &request = (*batch)[id];
+
+			long status = response["status"].asInt();
+
+			bool throttled = CRetryPolicy::throttled(status);
+
+			// Each request of a batch is throttled and fails on its own
+			if ((throttled || CRetryPolicy::failed(CURLE_OK, status)) &&
+			    request.attempt < retryPolicy_.maxRetries()) {
+				long retryAfter = retryAfterFromJson(response["headers"]);
+
+				if (throttled)
+					limiter_->throttled(retryAfter);
+
+				std::chrono::milliseconds delay = retryPolicy_.backoff(request.attempt++, retryAfter);
+
+				LOG_WARN("batched request failed (HTTP " << status << "), retry " << request.attempt
+					 << " of " << retryPolicy_.maxRetries() << " in " << delay.count() << "ms");
+
+				retry(std::move(request), delay);
+				continue;
+			}
+
+			request.done(status, bodyFromJson(response["body"]), nullptr);
+		}
+	} catch (...) {
+		std::exception_ptr error = std::current_exception();
+
+		for (size_t i = 0; i < batch->size(); i++)
+			if (!answered[i])
+				(*batch)[i].done(0, std::string(), error);
+
+		return;
+	}
+
+	std::exception_ptr error = std::make_exception_ptr(std::runtime_error("missing from the batch response"));
+
+	for (size_t i = 0; i < batch->size(); i++)
+		if (!answered[i])
+			(*batch)[i].done(0, std::string(), error);
+}
+
+void CBatcher::retry(CRequest request, std::chrono::milliseconds delay)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	if (stop_) {
+		lock.unlock();
+
+		request.done(0, std::string(), std::make_exception_ptr(std::runtime_error("the request batcher has been stopped")));
+		return;
+	}
+
+	delayed_.emplace(Clock::now() + delay, std::move(request));
+
+	cond_.notify_one();
+}
+
+} // namespace OneDrive
@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef __BATCH_H_INCLUDED__
+#define __BATCH_H_INCLUDED__
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "retry.h"
+
+namespace OneDrive {
+
+class CGraph;
+
+// Coalesces independent metadata requests into JSON $batch calls. Requests
+// are held back for a short window so that the ones issued meanwhile by
+// other threads can share the call; a full batch leaves right away.
+class CBatcher
+{
+public:
+	// Receives the status and body of one request of a batch. Runs on the
+	// transfer engine thread.
+	typedef std::function<void(long status, std::string body, std::exception_ptr error)> Completion;
+
+	CBatcher(CGraph *graph, CRateLimiter *limiter);
+	~CBatcher();
+
+	CBatcher(const CBatcher &) = delete;
+	CBatcher & operator=(const CBatcher &) = delete;
+
+	// The resource is relative to the Graph endpoint. Throws once stopped.
+	void add(const std::string &method, const std::string &resource, Completion done);
+
+	// Sends the queued requests without waiting for the window to close
+	void flush();
+
+	// Fails the queued requests; no more are accepted afterwards. Batches
+	// already sent complete through the transfer engine.
+	void stop();
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	// The most requests Graph accepts in a single $batch call
+	static const size_t maxRequests = 20;
+
+	struct CRequest {
+		std::string  method;
+		std::string  resource;
+		Completion   done;
+		unsigned int attempt;
+	};
+
+	typedef std::vector<CRequest> CBatch;
+
+	CGraph                                     *graph_;
+	CRateLimiter                               *limiter_;
+	CRetryPolicy                               retryPolicy_;
+	std::chrono::milliseconds                  window_;
+	std::mutex                                 mutex_;
+	std::condition_variable                    cond_;
+	std::deque<CRequest>                       pending_;
+	std::multimap<Clock::time_point, CRequest> delayed_;
+	Clock::time_point                          deadline_;
+	bool                                       flush_{false};
+	bool                                       stop_{false};
+	std::thread                                thread_;
+
+	void enqueue(CRequest request, Clock::time_point now);
+
+	void run();
+
+	void send(std::shared_ptr<CBatch> batch);
+
+	void complete(std::shared_ptr<CBatch> batch, long respCode, const std::string &data);
+
+	void retry(CRequest request, std::chrono::milliseconds delay);
+};
+
+} // namespace OneDrive
+
+#endif // __BATCH_H_INCLUDED__
@@ -0,0 +1,524 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_set>
+#include <utility>
+#include "contentcache.h"
+#include "log.h"
+#include "utils.h"
+
+namespace {
+
+const char mapMagic[8] = {'O', 'D', 'F', 'S', 'C', 'C', 'H', '1'};
+
+const char mapSuffix[] = ".map";
+
+struct CMapHeader {
+	char     magic[8];
+	uint64_t fileSize;
+	uint64_t blockSize;
+	uint32_t idLength;
+	uint32_t cTagLength;
+};
+
+bool hasSuffix(const std::string &s, const std::string &suffix)
+{
+	return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool readAll(int fd, void *buf, size_t size, off_t offset)
+{
+	char *p = static_cast<char *>(buf);
+
+	while (size > 0) {
+		ssize_t n = pread(fd, p, size, offset);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			return false;
+
+		p      += n;
+		size   -= n;
+		offset += n;
+	}
+
+	return true;
+}
+
+bool writeAll(int fd, const void *buf, size_t size, off_t offset)
+{
+	const char *p = static_cast<const char *>(buf);
+
+	while (size > 0) {
+		ssize_t n = pwrite(fd, p, size, offset);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			return false;
+
+		p      += n;
+		size   -= n;
+		offset += n;
+	}
+
+	return true;
+}
+
+} // anonymous namespace
+
+namespace OneDrive {
+
+const unsigned int CContentCache::saveEvery;
+
+CContentCache::CContentCache(const CContentCacheProfile &profile): profile_{profile}
+{
+	if (!enabled())
+		return;
+
+	try {
+		load();
+	} catch (const std::exception &e) {
+		LOG_ERROR("the content cache is turned off: " << e.what());
+
+		profile_.maxSize = 0;
+	}
+}
+
+CContentCache::~CContentCache()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	// Least recently used first, so that the next mount finds them in the
+	// same order by modification time
+	for (auto i = lru_.rbegin(); i != lru_.rend(); ++i) {
+		CEntry &entry = entries_.at(*i);
+
+		if (entry.used || entry.unsaved > 0)
+			saveMap(*i, entry);
+	}
+}
+
+bool CContentCache::contains(const std::string &id, const std::string &cTag, size_t size, off_t offset)
+{
+	if (!enabled() || cTag.empty() || size == 0 || offset < 0)
+		return false;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto i = entries_.find(id);
+
+	if (i == entries_.end() || i->second.cTag != cTag || static_cast<uint64_t>(offset) + size > i->second.fileSize)
+		return false;
+
+	for (size_t block = offset / profile_.blockSize; block <= (offset + size - 1) / profile_.blockSize; block++)
+		if (!i->second.blocks[block])
+			return false;
+
+	return true;
+}
+
+bool CContentCache::read(const std::string &id, const std::string &cTag, void *buf, size_t size, off_t offset)
+{
+	if (!enabled() || cTag.empty() || size == 0 || offset < 0)
+		return false;
+
+	unsigned long generation;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		auto i = entries_.find(id);
+
+		if (i == entries_.end() || i->second.cTag != cTag)
+			return false;
+
+		CEntry &entry = i->second;
+
+		if (static_cast<uint64_t>(offset) + size > entry.fileSize)
+			return false;
+
+		for (size_t block = offset / profile_.blockSize; block <= (offset + size - 1) / profile_.blockSize; block++)
+			if (!entry.blocks[block])
+				return false;
+
+		touch(entry);
+
+		generation = entry.generation;
+	}
+
+	int fd = open(path(id).c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return false;
+
+	bool done = readAll(fd, buf, size, offset);
+
+	close(fd);
+
+	if (!done)
+		return false;
+
+	// The blocks might have been thrown away while they were read
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto i = entries_.find(id);
+
+	return i != entries_.end() && i->second.generation == generation;
+}
+
+void CContentCache::write(const std::string &id, const std::string &cTag, uint64_t fileSize, const void *data,
+			  size_t size, off_t offset)
+{
+	if (!enabled() || cTag.empty() || offset < 0 || offset % profile_.blockSize != 0)
+		return;
+
+	unsigned long generation;
+	size_t first = offset / profile_.blockSize;
+	size_t count = 0;
+	uint64_t bytes = 0;
+	int fd;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		CEntry &entry = entryOf(id, cTag, fileSize);
+
+		while (first + count < entry.blocks.size() && bytes + blockBytes(entry, first + count) <= size) {
+			bytes += blockBytes(entry, first + count);
+			count++;
+		}
+
+		// An item larger than the whole cache is not kept
+		if (count == 0 || entry.cached + bytes > profile_.maxSize)
+			return;
+
+		generation = entry.generation;
+
+		// Opened before the entry can be dropped, which unlinks the file:
+		// the blocks then land in that file rather than in the one its
+		// successor creates under the same name
+		fd = open(path(id).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+	}
+
+	if (fd < 0) {
+		LOG_WARN("failed to open the cached content of " << id << ": " << std::strerror(errno));
+		return;
+	}
+
+	struct stat st;
+
+	// Sparse, so that only the blocks written take up space
+	bool done = fstat(fd, &st) == 0 &&
+		    (static_cast<uint64_t>(st.st_size) == fileSize || ftruncate(fd, fileSize) == 0) &&
+		    writeAll(fd, data, bytes, offset);
+
+	close(fd);
+
+	if (!done) {
+		LOG_WARN("failed to cache the content of " << id << ": " << std::strerror(errno));
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto i = entries_.find(id);
+
+	if (i == entries_.end() || i->second.generation != generation)
+		return;
+
+	CEntry &entry = i->second;
+
+	for (size_t block = first; block < first + count; block++) {
+		if (entry.blocks[block])
+			continue;
+
+		entry.blocks[block] = true;
+		entry.cached += blockBytes(entry, block);
+		entry.unsaved++;
+
+		size_ += blockBytes(entry, block);
+	}
+
+	touch(entry);
+
+	if (entry.unsaved >= saveEvery || entry.cached == entry.fileSize)
+		saveMap(id, entry);
+
+	evict(id);
+}
+
+void CContentCache::remove(const std::string &id)
+{
+	if (!enabled())
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto i = entries_.find(id);
+
+	if (i != entries_.end())
+		drop(i);
+}
+
+void CContentCache::load()
+{
+	std::list<std::string> components;
+
+	stringSplit(profile_.dir, '/', components);
+
+	std::string dir;
+
+	for (auto &&component : components) {
+		if (component.empty())
+			continue;
+
+		dir += "/" + component;
+
+		if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST)
+			throw std::runtime_error("failed to create " + dir + ": " + std::strerror(errno));
+	}
+
+	DIR *d = opendir(profile_.dir.c_str());
+
+	if (!d)
+		throw std::runtime_error("failed to open " + profile_.dir + ": " + std::strerror(errno));
+
+	std::vector<std::string> names;
+
+	while (struct dirent *de = readdir(d))
+		if (de->d_name[0] != '.')
+			names.push_back(de->d_name);
+
+	closedir(d);
+
+	std::vector<std::pair<time_t, std::string>> used;
+
+	for (auto &&name : names) {
+		if (!hasSuffix(name, mapSuffix))
+			continue;
+
+		const std::string mapPath = profile_.dir + "/" + name;
+		std::string id;
+		CEntry entry{};
+		struct stat st;
+
+		if (!loadMap(mapPath, id, entry) || stat(mapPath.c_str(), &st) < 0 || entries_.count(id) > 0) {
+			std::remove(mapPath.c_str());
+			continue;
+		}
+
+		entry.generation = ++generations_;
+
+		size_ += entry.cached;
+
+		used.emplace_back(st.st_mtime, id);
+		entries_.emplace(id, std::move(entry));
+	}
+
+	std::sort(used.begin(), used.end());
+
+	for (auto &&i : used) {
+		lru_.push_front(i.second);
+		entries_.at(i.second).lru = lru_.begin();
+	}
+
+	std::unordered_set<std::string> known;
+
+	for (auto &&i : entries_)
+		known.insert(path(i.first));
+
+	// The data files without a usable map, and the maps left half written
+	for (auto &&name : names) {
+		const std::string filePath = profile_.dir + "/" + name;
+
+		if (!hasSuffix(name, mapSuffix) && known.count(filePath) == 0)
+			std::remove(filePath.c_str());
+	}
+
+	evict(std::string());
+
+	LOG_INFO("the content cache holds " << entries_.size() << " items, " << (size_ >> 20) << " MiB");
+}
+
+bool CContentCache::loadMap(const std::string &mapPath, std::string &id, CEntry &entry)
+{
+	std::ifstream f(mapPath, std::ios::binary);
+	CMapHeader header{};
+
+	if (!f.read(reinterpret_cast<char *>(&header), sizeof(header)))
+		return false;
+
+	if (memcmp(header.magic, mapMagic, sizeof(mapMagic)) != 0 || header.blockSize != profile_.blockSize ||
+	    header.idLength == 0 || header.idLength > 4096 || header.cTagLength == 0 || header.cTagLength > 4096)
+		return false;
+
+	id.resize(header.idLength);
+	entry.cTag.resize(header.cTagLength);
+
+	if (!f.read(&id[0], id.size()) || !f.read(&entry.cTag[0], entry.cTag.size()))
+		return false;
+
+	entry.fileSize = header.fileSize;
+	entry.blocks.resize((entry.fileSize + profile_.blockSize - 1) / profile_.blockSize);
+
+	std::vector<char> bitmap((entry.blocks.size() + 7) / 8);
+
+	if (!f.read(bitmap.data(), bitmap.size()))
+		return false;
+
+	struct stat st;
+
+	// The blocks must still be there
+	if (stat(path(id).c_str(), &st) < 0 || static_cast<uint64_t>(st.st_size) != entry.fileSize)
+		return false;
+
+	for (size_t block = 0; block < entry.blocks.size(); block++) {
+		if (bitmap[block / 8] & (1 << (block % 8))) {
+			entry.blocks[block] = true;
+			entry.cached += blockBytes(entry, block);
+		}
+	}
+
+	return true;
+}
+
+void CContentCache::saveMap(const std::string &id, const CEntry &entry)
+{
+	CMapHeader header{};
+
+	memcpy(header.magic, mapMagic, sizeof(mapMagic));
+
+	header.fileSize   = entry.fileSize;
+	header.blockSize  = profile_.blockSize;
+	header.idLength   = id.size();
+	header.cTagLength = entry.cTag.size();
+
+	std::vector<char> bitmap((entry.blocks.size() + 7) / 8);
+
+	for (size_t block = 0; block < entry.blocks.size(); block++)
+		if (entry.blocks[block])
+			bitmap[block / 8] |= 1 << (block % 8);
+
+	const std::string mapPath = path(id) + mapSuffix;
+	const std::string tmpPath = mapPath + ".tmp";
+
+	{
+		std::ofstream f(tmpPath, std::ios::binary | std::ios::trunc);
+
+		f.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		f.write(id.data(), id.size());
+		f.write(entry.cTag.data(), entry.cTag.size());
+		f.write(bitmap.data(), bitmap.size());
+
+		if (!f.flush()) {
+			LOG_WARN("failed to write " << tmpPath);
+			return;
+		}
+	}
+
+	if (std::rename(tmpPath.c_str(), mapPath.c_str()) < 0)
+		LOG_WARN("failed to replace " << mapPath << ": " << std::strerror(errno));
+}
+
+std::string CContentCache::path(const std::string &id) const
+{
+	static const char hex[] = "0123456789ABCDEF";
+	std::string name;
+
+	for (unsigned char c : id) {
+		if (isalnum(c) || c == '!' || c == '-' || c == '_') {
+			name += c;
+		} else {
+			name += '%';
+			name += hex[c >> 4];
+			name += hex[c & 15];
+		}
+	}
+
+	return profile_.dir + "/" + name;
+}
+
+CContentCache::CEntry & CContentCache::entryOf(const std::string &id, const std::string &cTag, uint64_t fileSize)
+{
+	auto i = entries_.find(id);
+
+	if (i != entries_.end()) {
+		if (i->second.cTag == cTag && i->second.fileSize == fileSize)
+			return i->second;
+
+		drop(i);
+	}
+
+	lru_.push_front(id);
+
+	CEntry &entry = entries_[id];
+
+	entry.cTag       = cTag;
+	entry.fileSize   = fileSize;
+	entry.blocks.resize((fileSize + profile_.blockSize - 1) / profile_.blockSize);
+	entry.cached     = 0;
+	entry.generation = ++generations_;
+	entry.unsaved    = 0;
+	entry.used       = true;
+	entry.lru        = lru_.begin();
+
+	return entry;
+}
+
+void CContentCache::drop(Entries::iterator i)
+{
+	// The map goes first, so that it never lists blocks which are gone
+	std::remove((path(i->first) + mapSuffix).c_str());
+	std::remove(path(i->first).c_str());
+
+	size_ -= i->second.cached;
+
+	lru_.erase(i->second.lru);
+	entries_.erase(i);
+}
+
+void CContentCache::touch(CEntry &entry)
+{
+	entry.used = true;
+
+	lru_.splice(lru_.begin(), lru_, entry.lru);
+}
+
+void CContentCache::evict(const std::string &keep)
+{
+	while (size_ > profile_.maxSize && !lru_.empty()) {
+		auto i = entries_.find(lru_.back());
+
+		if (i->first == keep) {
+			if (lru_.size() == 1)
+				break;
+
+			// Not the oldest anymore, and the next one is looked at
+			touch(i->second);
+			continue;
+		}
+
+		drop(i);
+	}
+}
+
+uint64_t CContentCache::blockBytes(const CEntry &entry, size_t block) const
+{
+	return std::min<uint64_t>(profile_.blockSize, entry.fileSize - static_cast<uint64_t>(block) * profile_.blockSize);
+}
+
+} // namespace OneDrive
@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef __CONTENTCACHE_H_INCLUDED__
+#define __CONTENTCACHE_H_INCLUDED__
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "appconfig.h"
+
+namespace OneDrive {
+
+// Keeps the file contents read so far on disk, so that reading them again,
+// during this mount or a later one, downloads nothing. Each item has a
+// sparse file holding the blocks fetched so far and a map telling which
+// ones those are and the cTag of the content they belong to; a read with
+// another cTag throws the blocks away. To stay within the size limit,
+// whole items are dropped, least recently used first.
+class CContentCache
+{
+public:
+	explicit CContentCache(const CContentCacheProfile &profile);
+
+	~CContentCache();
+
+	CContentCache(const CContentCache &) = delete;
+	CContentCache & operator=(const CContentCache &) = delete;
+
+	bool enabled() const
+	{
+		return profile_.maxSize > 0;
+	}
+
+	size_t blockSize() const
+	{
+		return profile_.blockSize;
+	}
+
+	// Whether all of a byte range is cached for that content
+	bool contains(const std::string &id, const std::string &cTag, size_t size, off_t offset);
+
+	// Copies a byte range out if all of it is cached for that content
+	bool read(const std::string &id, const std::string &cTag, void *buf, size_t size, off_t offset);
+
+	// Stores a byte range starting at a block boundary. Only the whole
+	// blocks in it are kept, the last one of the file included.
+	void write(const std::string &id, const std::string &cTag, uint64_t fileSize, const void *data, size_t size,
+		   off_t offset);
+
+	void remove(const std::string &id);
+
+private:
+	struct CEntry {
+		std::string                      cTag;
+		uint64_t                         fileSize;
+		std::vector<bool>                blocks;
+		uint64_t                         cached;     // bytes
+		unsigned long                    generation; // tells a dropped entry from its successor
+		unsigned int                     unsaved;    // blocks added since the map was saved
+		bool                             used;       // during this mount
+		std::list<std::string>::iterator lru;
+	};
+
+	typedef std::unordered_map<std::string, CEntry> Entries;
+
+	// The maps of the items being filled are saved every that many blocks;
+	// the blocks added since are fetched again after a crash
+	static const unsigned int saveEvery = 64;
+
+	CContentCacheProfile   profile_;
+	std::mutex             mutex_;
+	Entries                entries_;
+	std::list<std::string> lru_; // most recently used first
+	uint64_t               size_{};
+	unsigned long          generations_{};
+
+	// Picks up what previous mounts left in the cache directory
+	void load();
+
+	bool loadMap(const std::string &path, std::string &id, CEntry &entry);
+
+	void saveMap(const std::string &id, const CEntry &entry);
+
+	// The data file of the item; its map is next to it
+	std::string path(const std::string &id) const;
+
+	// The entry of the item, emptied first if it holds other content
+	CEntry & entryOf(const std::string &id, const std::string &cTag, uint64_t fileSize);
+
+	void drop(Entries::iterator i);
+
+	void touch(CEntry &entry);
+
+	// Drops the least recently used items other than the one given until
+	// the cache fits
+	void evict(const std::string &keep);
+
+	uint64_t blockBytes(const CEntry &entry, size_t block) const;
+};
+
+} // namespace OneDrive
+
+#endif // __CONTENTCACHE_H_INCLUDED__
@@ -1,8 +1,10 @@
 // SPDX-License-Identifier: GPL-2.0
 
+#include <atomic>
 #include <cstring>
 #include <memory>
 #include <stdexcept>
+#include "appconfig.h"
 #include "curl.h"
 
 namespace {
@@ -26,11 +28,67 @@ private:
 	CCurlGlobal & operator=(const CCurlGlobal &) = delete;
 } globalCurl;
 
-struct DownloadBuffer {
-	void *buf;
-	size_t size;
-	size_t pos;
-};
+// DNS lookups and TLS sessions are shared by all the handles in the process.
+// Connections are not: libcurl does not support sharing them between
+// threads, and the transfers driven by the same multi handle already reuse
+// each other's connections.
+class CCurlShare
+{
+public:
+	CCurlShare()
+	{
+		share_ = curl_share_init();
+		if (!share_)
+			throw std::runtime_error("failed to obtain a cURL share handle");
+
+		setopt(CURLSHOPT_LOCKFUNC, lockCallback);
+		setopt(CURLSHOPT_UNLOCKFUNC, unlockCallback);
+		setopt(CURLSHOPT_USERDATA, this);
+		setopt(CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		setopt(CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	}
+
+	~CCurlShare()
+	{
+		curl_share_cleanup(share_);
+	}
+
+	CURLSH *handle() const
+	{
+		return share_;
+	}
+
+private:
+	CCurlShare(const CCurlShare &) = delete;
+	CCurlShare & operator=(const CCurlShare &) = delete;
+
+	template <typename Arg>
+	void setopt(CURLSHoption option, Arg arg)
+	{
+		CURLSHcode err = curl_share_setopt(share_, option, arg);
+
+		if (err != CURLSHE_OK)
+			throw std::runtime_error(std::string("curl_share_setopt() has failed: ") + curl_share_strerror(err));
+	}
+
+	static void lockCallback(CURL *, curl_lock_data data, curl_lock_access, void *userData)
+	{
+		static_cast<CCurlShare *>(userData)->locks_[data].lock();
+	}
+
+	static void unlockCallback(CURL *, curl_lock_data data, void *userData)
+	{
+		static_cast<CCurlShare *>(userData)->locks_[data].unlock();
+	}
+
+	CURLSH    *share_{};
+	std::mutex locks_[CURL_LOCK_DATA_LAST];
+} globalShare;
+
+std::atomic<unsigned long> statTransfers{};
+std::atomic<unsigned long> statConnects{};
+std::atomic<unsigned long> statHandshakes{};
+std::atomic<unsigned long> statMultiplexed{};
 
 } // anonymous namespace
 
@@ -41,6 +99,13 @@ CCurl::CCurl()
 	handle_ = curl_easy_init();
 	if (!handle_)
 		throw std::runtime_error("failed to obtain a cURL handle");
+
+	try {
+		setDefaults();
+	} catch (...) {
+		curl_easy_cleanup(handle_);
+		throw;
+	}
 }
 
 CCurl::~CCurl()
@@ -72,223 +137,351 @@ void CCurl::setopt(CURLoption option, void *arg)
 		throw std::runtime_error(std::string("curl_easy_setopt() has failed: ") + curl_easy_strerror(err));
 }
 
-std::string CCurl::get(const std::string &url, const std::list<std::string> &headers, long &respCode)
+void CCurl::setoptLarge(CURLoption option, curl_off_t arg)
 {
-	struct curl_slist *slist = nullptr;
-
-	for (auto &&h : headers)
-		slist = curl_slist_append(slist, h.c_str());
+	CURLcode err = curl_easy_setopt(handle_, option, arg);
 
-	std::unique_ptr<struct curl_slist, decltype(&curl_slist_free_all)> sp(slist, &curl_slist_free_all);
+	if (err != CURLE_OK)
+		throw std::runtime_error(std::string("curl_easy_setopt() has failed: ") + curl_easy_strerror(err));
+}
 
-	setopt(CURLOPT_HTTPHEADER, slist);
+// The options set once for the lifetime of the handle
+void CCurl::setDefaults()
+{
+	const CTransportProfile &profile = gConfig.transportProfile();
 
-	std::string buf;
-	setopt(CURLOPT_WRITEDATA, static_cast<void *>(&buf));
-	setopt(CURLOPT_WRITEFUNCTION, reinterpret_cast<void *>(writeCallback));
+	setopt(CURLOPT_SHARE, static_cast<void *>(globalShare.handle()));
 
-	setopt(CURLOPT_HTTPGET, 1);
-	setopt(CURLOPT_URL, url);
+	// Prefer HTTP/2 over TLS and wait for a connection that can be
+	// multiplexed instead of opening a new one
+	setopt(CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+	setopt(CURLOPT_PIPEWAIT, 1);
 
 	setopt(CURLOPT_SSL_VERIFYPEER, 1);
 	setopt(CURLOPT_SSL_VERIFYHOST, 2);
-	setopt(CURLOPT_TIMEOUT, 10);
-	setopt(CURLOPT_CONNECTTIMEOUT, 30);
 	setopt(CURLOPT_FOLLOWLOCATION, 1);
 
-	respCode = perform();
+	// Stalled transfers are detected by their throughput rather than by a
+	// wall-clock limit, which would abort large reads on slow links
+	setopt(CURLOPT_CONNECTTIMEOUT, profile.connectTimeout);
+	setopt(CURLOPT_LOW_SPEED_LIMIT, profile.lowSpeedLimit);
+	setopt(CURLOPT_LOW_SPEED_TIME, profile.lowSpeedTime);
 
-	return buf;
+	setopt(CURLOPT_TCP_KEEPALIVE, profile.tcpKeepAlive ? 1 : 0);
+	setopt(CURLOPT_TCP_KEEPIDLE, profile.tcpKeepIdle);
+	setopt(CURLOPT_TCP_KEEPINTVL, profile.tcpKeepInterval);
+	setopt(CURLOPT_TCP_NODELAY, profile.tcpNoDelay ? 1 : 0);
+
+	setopt(CURLOPT_BUFFERSIZE, profile.bufferSize);
+
+	setopt(CURLOPT_WRITEFUNCTION, reinterpret_cast<void *>(discardCallback));
 }
 
-size_t CCurl::get(const std::string &url, const std::list<std::string> &headers,
-		  void *buf, size_t size, long &respCode)
+// Put back the options a transfer may have changed
+void CCurl::resetRequest()
 {
-	struct curl_slist *slist = nullptr;
+	setopt(CURLOPT_HTTPGET, 1);
+	setopt(CURLOPT_CUSTOMREQUEST, static_cast<void *>(nullptr));
+	setopt(CURLOPT_HTTPHEADER, static_cast<void *>(nullptr));
+	setopt(CURLOPT_ACCEPT_ENCODING, static_cast<void *>(nullptr));
+	setopt(CURLOPT_RANGE, static_cast<void *>(nullptr));
+	setopt(CURLOPT_WRITEDATA, static_cast<void *>(nullptr));
+	setopt(CURLOPT_WRITEFUNCTION, reinterpret_cast<void *>(discardCallback));
+
+	sink_ = nullptr;
+	file_ = nullptr;
+
+	if (abort_) {
+		setopt(CURLOPT_NOPROGRESS, 1);
+		abort_.reset();
+	}
 
-	for (auto &&h : headers)
-		slist = curl_slist_append(slist, h.c_str());
+	setMaxSpeed(0, 0);
+}
 
-	std::unique_ptr<struct curl_slist, decltype(&curl_slist_free_all)> sp(slist, &curl_slist_free_all);
+void CCurl::setMaxSpeed(curl_off_t recv, curl_off_t send)
+{
+	setoptLarge(CURLOPT_MAX_RECV_SPEED_LARGE, recv);
+	setoptLarge(CURLOPT_MAX_SEND_SPEED_LARGE, send);
+}
 
-	setopt(CURLOPT_HTTPHEADER, slist);
+const CCurl::RequestTemplate CCurl::getTemplate_      = { nullptr,  nullptr,                    false };
+const CCurl::RequestTemplate CCurl::jsonGetTemplate_  = { nullptr,  nullptr,                    true  };
+const CCurl::RequestTemplate CCurl::postTemplate_     = { nullptr,  nullptr,                    true  };
+const CCurl::RequestTemplate CCurl::jsonPostTemplate_ = { nullptr,  "application/json",         true  };
+const CCurl::RequestTemplate CCurl::deleteTemplate_   = { "DELETE", nullptr,                    false };
+const CCurl::RequestTemplate CCurl::patchTemplate_    = { "PATCH",  "application/json",         false };
+const CCurl::RequestTemplate CCurl::putTemplate_      = { "PUT",    "application/octet-stream", false };
 
-	DownloadBuffer db{};
-	db.buf = buf;
-	db.size = size;
+void CCurl::setAuthorization(const std::shared_ptr<const std::string> &authorization)
+{
+	if (authorization == authorization_)
+		return;
 
-	setopt(CURLOPT_WRITEDATA, static_cast<void *>(&db));
-	setopt(CURLOPT_WRITEFUNCTION, reinterpret_cast<void *>(writeBufferCallback));
+	authorization_ = authorization;
 
-	setopt(CURLOPT_HTTPGET, 1);
-	setopt(CURLOPT_URL, url);
+	headers_.clear();
+}
 
-	setopt(CURLOPT_SSL_VERIFYPEER, 1);
-	setopt(CURLOPT_SSL_VERIFYHOST, 2);
-	setopt(CURLOPT_TIMEOUT, 10);
-	setopt(CURLOPT_CONNECTTIMEOUT, 30);
-	setopt(CURLOPT_FOLLOWLOCATION, 1);
+struct curl_slist *CCurl::headers(const char *contentType)
+{
+	std::string key(contentType ? contentType : "");
 
-	respCode = perform();
+	auto i = headers_.find(key);
+
+	if (i != headers_.end())
+		return i->second.get();
+
+	struct curl_slist *slist = nullptr;
+
+	if (authorization_)
+		slist = curl_slist_append(slist, authorization_->c_str());
 
-	return db.pos;
+	if (contentType)
+		slist = curl_slist_append(slist, ("Content-Type: " + key).c_str());
+
+	headers_.emplace(key, HeaderList(slist, &curl_slist_free_all));
+
+	return slist;
 }
 
-std::string CCurl::post(const std::string &url, const std::list<std::string> &headers, const std::string &body,
-			long &respCode)
+// Only the URL differs between two requests built from the same template
+void CCurl::prepare(const RequestTemplate &request, const std::string &url)
 {
-	struct curl_slist *slist = nullptr;
+	setopt(CURLOPT_HTTPHEADER, static_cast<void *>(headers(request.contentType)));
 
-	for (auto &&h : headers)
-		slist = curl_slist_append(slist, h.c_str());
+	if (request.method)
+		setopt(CURLOPT_CUSTOMREQUEST, request.method);
 
-	std::unique_ptr<struct curl_slist, decltype(&curl_slist_free_all)> sp(slist, &curl_slist_free_all);
+	if (request.compressed)
+		setopt(CURLOPT_ACCEPT_ENCODING, gConfig.transportProfile().acceptEncoding);
 
-	setopt(CURLOPT_HTTPHEADER, slist);
+	setopt(CURLOPT_URL, url);
+}
 
+void CCurl::setBody(const std::string &body)
+{
 	setopt(CURLOPT_POSTFIELDSIZE, body.length());
 	setopt(CURLOPT_COPYPOSTFIELDS, body.c_str());
+}
+
+void CCurl::prepareGet(const std::string &url, std::string &buf)
+{
+	prepare(jsonGetTemplate_, url);
 
-	std::string buf;
 	setopt(CURLOPT_WRITEDATA, static_cast<void *>(&buf));
 	setopt(CURLOPT_WRITEFUNCTION, reinterpret_cast<void *>(writeCallback));
+}
 
-	setopt(CURLOPT_URL, url);
+void CCurl::prepareGet(const std::string &url, void *buf, size_t size, off_t offset)
+{
+	prepare(getTemplate_, url);
 
-	setopt(CURLOPT_SSL_VERIFYPEER, 1);
-	setopt(CURLOPT_SSL_VERIFYHOST, 2);
-	setopt(CURLOPT_TIMEOUT, 10);
-	setopt(CURLOPT_CONNECTTIMEOUT, 30);
-	setopt(CURLOPT_FOLLOWLOCATION, 1);
+	setopt(CURLOPT_RANGE, std::to_string(offset) + "-" + std::to_string(offset + size - 1));
 
-	respCode = perform();
+	db_.buf = buf;
+	db_.size = size;
+	db_.pos = 0;
 
-	return buf;
+	setopt(CURLOPT_WRITEDATA, static_cast<void *>(&db_));
+	setopt(CURLOPT_WRITEFUNCTION, reinterpret_cast<void *>(writeBufferCallback));
 }
 
-void CCurl::download(const std::string &url, const std::list<std::string> &headers, std::ofstream &file,
-		     long &respCode)
+void CCurl::prepareStream(const std::string &url, off_t offset, Sink sink)
 {
-	struct curl_slist *slist = nullptr;
+	prepare(getTemplate_, url);
+
+	setopt(CURLOPT_RANGE, std::to_string(offset) + "-");
 
-	for (auto &&h : headers)
-		slist = curl_slist_append(slist, h.c_str());
+	sink_ = std::move(sink);
 
-	std::unique_ptr<struct curl_slist, decltype(&curl_slist_free_all)> sp(slist, &curl_slist_free_all);
+	setopt(CURLOPT_WRITEDATA, static_cast<void *>(this));
+	setopt(CURLOPT_WRITEFUNCTION, reinterpret_cast<void *>(streamCallback));
+}
 
-	setopt(CURLOPT_HTTPHEADER, slist);
+void CCurl::setAbort(std::shared_ptr<const std::atomic<bool>> abort)
+{
+	abort_ = std::move(abort);
 
-	setopt(CURLOPT_WRITEDATA, static_cast<void *>(&file));
-	setopt(CURLOPT_WRITEFUNCTION, reinterpret_cast<void *>(downloadCallback));
+	setopt(CURLOPT_XFERINFODATA, static_cast<void *>(this));
+	setopt(CURLOPT_XFERINFOFUNCTION, reinterpret_cast<void *>(abortCallback));
+	setopt(CURLOPT_NOPROGRESS, 0L);
+}
 
-	setopt(CURLOPT_HTTPGET, 1);
-	setopt(CURLOPT_URL, url);
+void CCurl::preparePost(const std::string &url, const std::string &body, std::string &buf)
+{
+	prepare(postTemplate_, url);
 
-	setopt(CURLOPT_SSL_VERIFYPEER, 1);
-	setopt(CURLOPT_SSL_VERIFYHOST, 2);
-	setopt(CURLOPT_TIMEOUT, 10);
-	setopt(CURLOPT_CONNECTTIMEOUT, 30);
-	setopt(CURLOPT_FOLLOWLOCATION, 1);
+	setBody(body);
 
-	respCode = perform();
+	setopt(CURLOPT_WRITEDATA, static_cast<void *>(&buf));
+	setopt(CURLOPT_WRITEFUNCTION, reinterpret_cast<void *>(writeCallback));
 }
 
-void CCurl::deleteRequest(const std::string &url, const std::list<std::string> &headers,
-			  long &respCode)
+void CCurl::prepareJsonPost(const std::string &url, const std::string &body, std::string &buf)
 {
-	struct curl_slist *slist = nullptr;
+	prepare(jsonPostTemplate_, url);
 
-	for (auto &&h : headers)
-		slist = curl_slist_append(slist, h.c_str());
+	setBody(body);
 
-	std::unique_ptr<struct curl_slist, decltype(&curl_slist_free_all)> sp(slist, &curl_slist_free_all);
+	setopt(CURLOPT_WRITEDATA, static_cast<void *>(&buf));
+	setopt(CURLOPT_WRITEFUNCTION, reinterpret_cast<void *>(writeCallback));
+}
 
-	setopt(CURLOPT_HTTPHEADER, slist);
+void CCurl::prepareDownload(const std::string &url, std::ofstream &file)
+{
+	prepare(getTemplate_, url);
 
-	setopt(CURLOPT_CUSTOMREQUEST, "DELETE");
-	setopt(CURLOPT_URL, url);
+	file_ = &file;
 
-	setopt(CURLOPT_SSL_VERIFYPEER, 1);
-	setopt(CURLOPT_SSL_VERIFYHOST, 2);
-	setopt(CURLOPT_TIMEOUT, 10);
-	setopt(CURLOPT_CONNECTTIMEOUT, 30);
-	setopt(CURLOPT_FOLLOWLOCATION, 1);
+	setopt(CURLOPT_WRITEDATA, static_cast<void *>(this));
+	setopt(CURLOPT_WRITEFUNCTION, reinterpret_cast<void *>(downloadCallback));
+}
 
-	respCode = perform();
+void CCurl::prepareDelete(const std::string &url)
+{
+	prepare(deleteTemplate_, url);
 }
 
-void CCurl::patchRequest(const std::string &url, const std::list<std::string> &headers,
-			 const std::string &body, long &respCode)
+void CCurl::preparePatch(const std::string &url, const std::string &body)
 {
-	struct curl_slist *slist = nullptr;
+	prepare(patchTemplate_, url);
 
-	for (auto &&h : headers)
-		slist = curl_slist_append(slist, h.c_str());
+	setBody(body);
+}
 
-	std::unique_ptr<struct curl_slist, decltype(&curl_slist_free_all)> sp(slist, &curl_slist_free_all);
+void CCurl::preparePut(const std::string &url, const std::string &body)
+{
+	prepare(putTemplate_, url);
 
-	setopt(CURLOPT_HTTPHEADER, slist);
+	setBody(body);
+}
 
-	setopt(CURLOPT_POSTFIELDSIZE, body.length());
-	setopt(CURLOPT_COPYPOSTFIELDS, body.c_str());
+std::string CCurl::get(const std::string &url, long &respCode)
+{
+	std::string buf;
 
-	setopt(CURLOPT_CUSTOMREQUEST, "PATCH");
-	setopt(CURLOPT_URL, url);
+	prepareGet(url, buf);
 
-	setopt(CURLOPT_SSL_VERIFYPEER, 1);
-	setopt(CURLOPT_SSL_VERIFYHOST, 2);
-	setopt(CURLOPT_TIMEOUT, 10);
-	setopt(CURLOPT_CONNECTTIMEOUT, 30);
-	setopt(CURLOPT_FOLLOWLOCATION, 1);
-	setopt(CURLOPT_VERBOSE, 1);
+	respCode = perform();
+
+	return buf;
+}
+
+size_t CCurl::get(const std::string &url, void *buf, size_t size, off_t offset, long &respCode)
+{
+	prepareGet(url, buf, size, offset);
 
 	respCode = perform();
+
+	return db_.pos;
 }
 
-void CCurl::putRequest(const std::string &url, const std::list<std::string> &headers,
-		       const std::string &body, long &respCode)
+std::string CCurl::post(const std::string &url, const std::string &body, long &respCode)
 {
-	struct curl_slist *slist = nullptr;
+	std::string buf;
 
-	for (auto &&h : headers)
-		slist = curl_slist_append(slist, h.c_str());
+	preparePost(url, body, buf);
 
-	std::unique_ptr<struct curl_slist, decltype(&curl_slist_free_all)> sp(slist, &curl_slist_free_all);
+	respCode = perform();
 
-	setopt(CURLOPT_HTTPHEADER, slist);
+	return buf;
+}
 
-	setopt(CURLOPT_POSTFIELDSIZE, body.length());
-	setopt(CURLOPT_COPYPOSTFIELDS, body.c_str());
+void CCurl::download(const std::string &url, std::ofstream &file, long &respCode)
+{
+	prepareDownload(url, file);
 
-	setopt(CURLOPT_CUSTOMREQUEST, "PUT");
-	setopt(CURLOPT_URL, url);
+	respCode = perform();
+}
 
-	setopt(CURLOPT_SSL_VERIFYPEER, 1);
-	setopt(CURLOPT_SSL_VERIFYHOST, 2);
-	setopt(CURLOPT_TIMEOUT, 10);
-	setopt(CURLOPT_CONNECTTIMEOUT, 30);
-	setopt(CURLOPT_FOLLOWLOCATION, 1);
-	setopt(CURLOPT_VERBOSE, 1);
+void CCurl::deleteRequest(const std::string &url, long &respCode)
+{
+	prepareDelete(url);
+
+	respCode = perform();
+}
+
+void CCurl::patchRequest(const std::string &url, const std::string &body, long &respCode)
+{
+	preparePatch(url, body);
+
+	respCode = perform();
+}
+
+void CCurl::putRequest(const std::string &url, const std::string &body, long &respCode)
+{
+	preparePut(url, body);
 
 	respCode = perform();
 }
 
 long CCurl::perform()
 {
-	CURLcode err = curl_easy_perform(handle_);
-	if (err != CURLE_OK)
-		throw std::runtime_error(std::string("curl_easy_perform() has failed: ") + curl_easy_strerror(err));
+	return complete(curl_easy_perform(handle_));
+}
 
+long CCurl::complete(CURLcode err)
+{
 	long respCode = 0;
-	err = curl_easy_getinfo(handle_, CURLINFO_RESPONSE_CODE, &respCode);
-	if (err != CURLE_OK)
-		throw std::runtime_error(std::string("curl_easy_getinfo() has failed: ") + curl_easy_strerror(err));
 
-	curl_easy_reset(handle_);
+	if (err == CURLE_OK)
+		err = curl_easy_getinfo(handle_, CURLINFO_RESPONSE_CODE, &respCode);
+
+	collectStats();
+
+	resetRequest();
+
+	if (err != CURLE_OK)
+		throw std::runtime_error(std::string("the transfer has failed: ") + curl_easy_strerror(err));
 
 	return respCode;
 }
 
+long CCurl::retryAfter() const
+{
+	curl_off_t retryAfter = 0;
+
+	if (curl_easy_getinfo(handle_, CURLINFO_RETRY_AFTER, &retryAfter) != CURLE_OK)
+		return 0;
+
+	return static_cast<long>(retryAfter);
+}
+
+void CCurl::collectStats()
+{
+	long connects = 0;
+	curl_off_t appConnectTime = 0;
+	long httpVersion = 0;
+
+	statTransfers++;
+
+	if (curl_easy_getinfo(handle_, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK && connects > 0) {
+		statConnects += connects;
+
+		// A TLS handshake took place if the new connection spent time on it
+		if (curl_easy_getinfo(handle_, CURLINFO_APPCONNECT_TIME_T, &appConnectTime) == CURLE_OK &&
+		    appConnectTime > 0)
+			statHandshakes++;
+	}
+
+	if (curl_easy_getinfo(handle_, CURLINFO_HTTP_VERSION, &httpVersion) == CURLE_OK &&
+	    httpVersion == CURL_HTTP_VERSION_2_0)
+		statMultiplexed++;
+}
+
+CTransportStats CCurl::stats()
+{
+	CTransportStats stats{};
+
+	stats.transfers   = statTransfers;
+	stats.connects    = statConnects;
+	stats.handshakes  = statHandshakes;
+	stats.multiplexed = statMultiplexed;
+
+	return stats;
+}
+
 size_t CCurl::writeCallback(char *ptr, size_t size, size_t nmemb, void *userData)
 {
 	if (!userData)
@@ -305,6 +498,37 @@ size_t CCurl::writeCallback(char *ptr, size_t size, size_t nmemb, void *userData
 	return size * nmemb;
 }
 
+size_t CCurl::discardCallback(char * /*ptr*/, size_t size, size_t nmemb, void * /*userData*/)
+{
+	return size * nmemb;
+}
+
+size_t CCurl::streamCallback(char *ptr, size_t size, size_t nmemb, void *userData)
+{
+	if (!userData)
+		return 0;
+
+	CCurl *curl = static_cast<CCurl *>(userData);
+	long respCode = 0;
+
+	if (curl_easy_getinfo(curl->handle_, CURLINFO_RESPONSE_CODE, &respCode) != CURLE_OK || respCode != 206)
+		return size * nmemb;
+
+	try {
+		return curl->sink_(ptr, size * nmemb);
+	} catch (...) {
+		return 0;
+	}
+}
+
+int CCurl::abortCallback(void *userData, curl_off_t /*dltotal*/, curl_off_t /*dlnow*/, curl_off_t /*ultotal*/,
+			 curl_off_t /*ulnow*/)
+{
+	CCurl *curl = static_cast<CCurl *>(userData);
+
+	return curl && curl->abort_ && curl->abort_->load() ? 1 : 0;
+}
+
 size_t CCurl::writeBufferCallback(char *ptr, size_t size, size_t nmemb, void *userData)
 {
 	if (!userData)
@@ -326,10 +550,19 @@ size_t CCurl::downloadCallback(char *ptr, size_t size, size_t nmemb, void *userD
 	if (!userData)
 		return 0;
 
-	std::ofstream *file = static_cast<std::ofstream *>(userData);
+	CCurl *curl = static_cast<CCurl *>(userData);
+	long respCode = 0;
+
+	if (!curl->file_)
+		return 0;
+
+	// An error page is not content
+	if (curl_easy_getinfo(curl->handle_, CURLINFO_RESPONSE_CODE, &respCode) != CURLE_OK ||
+	    (respCode != 200 && respCode != 206))
+		return size * nmemb;
 
 	try {
-		file->write(ptr, size * nmemb);
+		curl->file_->write(ptr, size * nmemb);
 	} catch (...) {
 		return 0;
 	}
@@ -380,4 +613,37 @@ std::string CCurl::formEncode(const std::list<std::pair<std::string, std::string
 	return p;
 }
 
+CCurlPool::CHandle CCurlPool::acquire()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	cond_.wait(lock, [this] { return !idle_.empty() || created_ < size_; });
+
+	if (idle_.empty()) {
+		// Handles are created lazily, up to the size of the pool
+		std::unique_ptr<CCurl> curl(new CCurl());
+
+		created_++;
+
+		return CHandle(*this, std::move(curl));
+	}
+
+	std::unique_ptr<CCurl> curl(std::move(idle_.front()));
+
+	idle_.pop_front();
+
+	return CHandle(*this, std::move(curl));
+}
+
+void CCurlPool::release(std::unique_ptr<CCurl> curl)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		idle_.emplace_back(std::move(curl));
+	}
+
+	cond_.notify_one();
+}
+
 } // namespace OneDrive
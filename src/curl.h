@@ -4,15 +4,29 @@
 #define __CURL_H_INCLUDED__
 
 #include <stddef.h>
+#include <sys/types.h>
 #include <curl/curl.h>
+#include <atomic>
+#include <condition_variable>
 #include <fstream>
+#include <functional>
 #include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
 
 namespace OneDrive {
 
+// Process-wide transport counters, used to verify connection reuse
+struct CTransportStats {
+	unsigned long transfers;
+	unsigned long connects;
+	unsigned long handshakes;
+	unsigned long multiplexed;
+};
+
 class CCurl
 {
 public:
@@ -22,26 +36,79 @@ public:
 	CCurl(const CCurl &) = delete;
 	CCurl & operator=(const CCurl &) = delete;
 
-	std::string get(const std::string &url, const std::list<std::string> &headers,
-			long &respCode);
+	// Takes the body of a streamed response as it arrives, following the
+	// contract of a libcurl write callback: it returns size when it took
+	// the data, CURL_WRITEFUNC_PAUSE to have it handed again once the
+	// transfer is unpaused, or 0 to abort the transfer
+	typedef std::function<size_t(const char *data, size_t size)> Sink;
+
+	// The authorization header sent along every request issued by this
+	// handle. The header lists built from it are cached until it changes.
+	void setAuthorization(const std::shared_ptr<const std::string> &authorization);
+
+	std::string get(const std::string &url, long &respCode);
+
+	size_t get(const std::string &url, void *buf, size_t size, off_t offset, long &respCode);
+
+	std::string post(const std::string &url, const std::string &body, long &respCode);
+
+	void download(const std::string &url, std::ofstream &file, long &respCode);
+
+	void deleteRequest(const std::string &url, long &respCode);
+
+	void patchRequest(const std::string &url, const std::string &body, long &respCode);
+
+	void putRequest(const std::string &url, const std::string &body, long &respCode);
+
+	// The prepare*() methods configure the handle for a transfer without
+	// running it, so that it can be driven by CCurlMulti. complete() must be
+	// called once the transfer is over.
+	void prepareGet(const std::string &url, std::string &buf);
+
+	void prepareGet(const std::string &url, void *buf, size_t size, off_t offset);
+
+	// Asks for everything from the offset on, handing it to the sink. Only
+	// a partial content response is passed on; the body of any other is
+	// dropped and left for the caller to report by its response code.
+	void prepareStream(const std::string &url, off_t offset, Sink sink);
+
+	// Aborts the transfer once the flag is raised, within a second or so.
+	// Applies to the request being prepared.
+	void setAbort(std::shared_ptr<const std::atomic<bool>> abort);
 
-	size_t get(const std::string &url, const std::list<std::string> &headers,
-		   void *buf, size_t size, long &respCode);
+	void preparePost(const std::string &url, const std::string &body, std::string &buf);
 
-	std::string post(const std::string &url, const std::list<std::string> &headers,
-			 const std::string &body, long &respCode);
+	void prepareJsonPost(const std::string &url, const std::string &body, std::string &buf);
 
-	void download(const std::string &url, const std::list<std::string> &headers,
-		      std::ofstream &file, long &respCode);
+	// Only the body of a successful response is written to the file
+	void prepareDownload(const std::string &url, std::ofstream &file);
 
-	void deleteRequest(const std::string &url, const std::list<std::string> &headers,
-			   long &respCode);
+	void prepareDelete(const std::string &url);
 
-	void patchRequest(const std::string &url, const std::list<std::string> &headers,
-			  const std::string &body, long &respCode);
+	void preparePatch(const std::string &url, const std::string &body);
 
-	void putRequest(const std::string &url, const std::list<std::string> &headers,
-			const std::string &body, long &respCode);
+	void preparePut(const std::string &url, const std::string &body);
+
+	// Caps the speed of the next transfer, in bytes/s; 0 means unlimited
+	void setMaxSpeed(curl_off_t recv, curl_off_t send);
+
+	long complete(CURLcode err);
+
+	// The delay in seconds requested by the server through Retry-After, if any
+	long retryAfter() const;
+
+	// The number of bytes stored by the last transfer into a caller buffer
+	size_t received() const
+	{
+		return db_.pos;
+	}
+
+	CURL *handle() const
+	{
+		return handle_;
+	}
+
+	static CTransportStats stats();
 
 	std::string escape(const std::string &str);
 
@@ -51,10 +118,48 @@ public:
 	std::string formEncode(const std::list<std::pair<std::string, std::string>> &params);
 
 private:
+	struct DownloadBuffer {
+		void *buf;
+		size_t size;
+		size_t pos;
+	};
+
+	// The invariant part of a kind of request
+	struct RequestTemplate {
+		const char *method;      // custom request method, if any
+		const char *contentType; // type of the request body, if any
+		bool        compressed;  // accept compressed responses
+	};
+
+	typedef std::unique_ptr<struct curl_slist, decltype(&curl_slist_free_all)> HeaderList;
+
+	static const RequestTemplate getTemplate_;
+	static const RequestTemplate jsonGetTemplate_;
+	static const RequestTemplate postTemplate_;
+	static const RequestTemplate jsonPostTemplate_;
+	static const RequestTemplate deleteTemplate_;
+	static const RequestTemplate patchTemplate_;
+	static const RequestTemplate putTemplate_;
+
 	void setopt(CURLoption option, long arg);
 	void setopt(CURLoption option, const std::string &arg);
 	void setopt(CURLoption option, void *arg);
 
+	// For the _LARGE options, which take a curl_off_t
+	void setoptLarge(CURLoption option, curl_off_t arg);
+
+	void setDefaults();
+
+	void resetRequest();
+
+	void prepare(const RequestTemplate &request, const std::string &url);
+
+	void setBody(const std::string &body);
+
+	struct curl_slist *headers(const char *contentType);
+
+	void collectStats();
+
 	long perform();
 
 	static size_t writeCallback(char *ptr, size_t size, size_t nmemb, void *userdata);
@@ -63,7 +168,89 @@ private:
 
 	static size_t downloadCallback(char *ptr, size_t size, size_t nmemb, void *userdata);
 
+	static size_t discardCallback(char *ptr, size_t size, size_t nmemb, void *userdata);
+
+	static size_t streamCallback(char *ptr, size_t size, size_t nmemb, void *userdata);
+
+	static int abortCallback(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal,
+				 curl_off_t ulnow);
+
 	CURL *handle_{};
+
+	std::shared_ptr<const std::string>       authorization_;
+	std::map<std::string, HeaderList>        headers_;
+	DownloadBuffer                           db_{};
+	Sink                                     sink_;
+	std::ofstream                            *file_{};
+	std::shared_ptr<const std::atomic<bool>> abort_;
+};
+
+// A bounded set of CCurl handles shared by the threads issuing requests.
+// acquire() blocks while all the handles are checked out.
+class CCurlPool
+{
+public:
+	class CHandle
+	{
+	public:
+		CHandle(CCurlPool &pool, std::unique_ptr<CCurl> curl): pool_{&pool}, curl_{std::move(curl)}
+		{
+		}
+
+		CHandle(CHandle &&handle): pool_{handle.pool_}, curl_{std::move(handle.curl_)}
+		{
+		}
+
+		~CHandle()
+		{
+			if (curl_)
+				pool_->release(std::move(curl_));
+		}
+
+		CHandle(const CHandle &) = delete;
+		CHandle & operator=(const CHandle &) = delete;
+
+		CCurl *operator->() const
+		{
+			return curl_.get();
+		}
+
+		CCurl & operator*() const
+		{
+			return *curl_;
+		}
+
+	private:
+		CCurlPool             *pool_;
+		std::unique_ptr<CCurl> curl_;
+	};
+
+	explicit CCurlPool(size_t size): size_{size}
+	{
+	}
+
+	~CCurlPool()
+	{
+	}
+
+	CCurlPool(const CCurlPool &) = delete;
+	CCurlPool & operator=(const CCurlPool &) = delete;
+
+	CHandle acquire();
+
+	size_t size() const
+	{
+		return size_;
+	}
+
+private:
+	void release(std::unique_ptr<CCurl> curl);
+
+	std::mutex                        mutex_;
+	std::condition_variable           cond_;
+	std::list<std::unique_ptr<CCurl>> idle_;
+	size_t                            size_;
+	size_t                            created_{};
 };
 
 } // namespace OneDrive
@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <algorithm>
+#include <stdexcept>
+#include "curlmulti.h"
+#include "log.h"
+
+namespace OneDrive {
+
+CCurlMulti::CCurlMulti()
+{
+	multi_ = curl_multi_init();
+	if (!multi_)
+		throw std::runtime_error("failed to obtain a cURL multi handle");
+
+	// Many concurrent requests to the same host ride a single HTTP/2 connection
+	CURLMcode err = curl_multi_setopt(multi_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+	if (err != CURLM_OK)
+		LOG_WARN("HTTP/2 multiplexing is not available: " << curl_multi_strerror(err));
+
+	thread_ = std::thread(&CCurlMulti::run, this);
+}
+
+CCurlMulti::~CCurlMulti()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		stop_ = true;
+	}
+
+	curl_multi_wakeup(multi_);
+
+	thread_.join();
+
+	// Whatever is still queued or in flight is aborted
+	for (auto &&i : pending_)
+		active_.emplace(i.first->handle(), std::move(i.second));
+
+	pending_.clear();
+
+	while (!active_.empty())
+		finish(active_.begin()->first, CURLE_ABORTED_BY_CALLBACK);
+
+	// Nothing can wait for the timers any longer
+	for (;;) {
+		std::function<void()> fn;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			if (timers_.empty())
+				break;
+
+			fn = std::move(timers_.begin()->second);
+			timers_.erase(timers_.begin());
+		}
+
+		runTimer(fn);
+	}
+
+	logStats();
+
+	curl_multi_cleanup(multi_);
+}
+
+void CCurlMulti::add(CCurl &curl, Completion done)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (stop_)
+			throw std::runtime_error("the transfer engine is shutting down");
+
+		pending_.emplace_back(std::make_pair(&curl, std::move(done)));
+	}
+
+	curl_multi_wakeup(multi_);
+}
+
+void CCurlMulti::schedule(std::chrono::steady_clock::time_point when, std::function<void()> fn)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (stop_)
+			throw std::runtime_error("the transfer engine is shutting down");
+
+		timers_.emplace(when, std::move(fn));
+	}
+
+	curl_multi_wakeup(multi_);
+}
+
+void CCurlMulti::runTimer(std::function<void()> &fn)
+{
+	try {
+		fn();
+	} catch (const std::exception &e) {
+		LOG_ERROR("a timer has failed: " << e.what());
+	} catch (...) {
+		LOG_ERROR("a timer has failed: unknown exception");
+	}
+}
+
+std::chrono::milliseconds CCurlMulti::runTimers()
+{
+	for (;;) {
+		std::function<void()> fn;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			if (timers_.empty())
+				return std::chrono::milliseconds(1000);
+
+			auto now = std::chrono::steady_clock::now();
+			auto next = timers_.begin();
+
+			if (next->first > now)
+				return std::min(std::chrono::milliseconds(1000),
+						std::chrono::duration_cast<std::chrono::milliseconds>(next->first - now) +
+						std::chrono::milliseconds(1));
+
+			fn = std::move(next->second);
+			timers_.erase(next);
+		}
+
+		runTimer(fn);
+	}
+}
+
+void CCurlMulti::run()
+{
+	for (;;) {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			if (stop_)
+				break;
+		}
+
+		std::chrono::milliseconds timeout = runTimers();
+
+		start();
+
+		int running = 0;
+
+		CURLMcode err = curl_multi_perform(multi_, &running);
+		if (err != CURLM_OK)
+			LOG_ERROR("curl_multi_perform() has failed: " << curl_multi_strerror(err));
+
+		CURLMsg *msg;
+		int left = 0;
+
+		while ((msg = curl_multi_info_read(multi_, &left)))
+			if (msg->msg == CURLMSG_DONE)
+				finish(msg->easy_handle, msg->data.result);
+
+		err = curl_multi_poll(multi_, nullptr, 0, static_cast<int>(timeout.count()), nullptr);
+		if (err != CURLM_OK)
+			LOG_ERROR("curl_multi_poll() has failed: " << curl_multi_strerror(err));
+
+		auto now = std::chrono::steady_clock::now();
+
+		if (now - lastStatsTime_ >= std::chrono::seconds(60)) {
+			logStats();
+			lastStatsTime_ = now;
+		}
+	}
+}
+
+void CCurlMulti::logStats()
+{
+	CTransportStats stats = CCurl::stats();
+
+	if (stats.transfers == lastStats_.transfers)
+		return;
+
+	LOG_INFO("transport: " << stats.transfers << " transfers, " << stats.connects << " new connections, "
+		 << stats.handshakes << " TLS handshakes, " << stats.multiplexed << " over HTTP/2");
+
+	lastStats_ = stats;
+}
+
+void CCurlMulti::start()
+{
+	std::list<std::pair<CCurl *, Completion>> pending;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		pending.swap(pending_);
+	}
+
+	for (auto &&i : pending) {
+		CURL *handle = i.first->handle();
+
+		active_.emplace(handle, std::move(i.second));
+
+		CURLMcode err = curl_multi_add_handle(multi_, handle);
+		if (err != CURLM_OK) {
+			LOG_ERROR("curl_multi_add_handle() has failed: " << curl_multi_strerror(err));
+			finish(handle, CURLE_FAILED_INIT);
+		}
+	}
+}
+
+void CCurlMulti::finish(CURL *handle, CURLcode err)
+{
+	auto i = active_.find(handle);
+
+	if (i == active_.end())
+		return;
+
+	Completion done(std::move(i->second));
+
+	active_.erase(i);
+
+	curl_multi_remove_handle(multi_, handle);
+
+	try {
+		done(err);
+	} catch (const std::exception &e) {
+		LOG_ERROR("a transfer completion has failed: " << e.what());
+	} catch (...) {
+		LOG_ERROR("a transfer completion has failed: unknown exception");
+	}
+}
+
+} // namespace OneDrive
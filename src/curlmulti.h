@@ -0,0 +1,74 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef __CURLMULTI_H_INCLUDED__
+#define __CURLMULTI_H_INCLUDED__
+
+#include <curl/curl.h>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include "curl.h"
+
+namespace OneDrive {
+
+// An event loop built on a cURL multi handle. A single I/O thread drives
+// all the transfers handed over via add().
+class CCurlMulti
+{
+public:
+	// Invoked on the I/O thread once a transfer is over. It must not block
+	// as it would stall every other transfer in flight.
+	typedef std::function<void(CURLcode err)> Completion;
+
+	CCurlMulti();
+	~CCurlMulti();
+
+	CCurlMulti(const CCurlMulti &) = delete;
+	CCurlMulti & operator=(const CCurlMulti &) = delete;
+
+	// The handle must have been configured with one of the CCurl::prepare*()
+	// methods and must stay alive until the completion is invoked
+	void add(CCurl &curl, Completion done);
+
+	// Runs fn on the I/O thread once the deadline has passed. Timers still
+	// pending at shutdown are run early.
+	void schedule(std::chrono::steady_clock::time_point when, std::function<void()> fn);
+
+private:
+	void run();
+
+	void start();
+
+	void finish(CURL *handle, CURLcode err);
+
+	// Runs the expired timers and returns the time left until the next one
+	std::chrono::milliseconds runTimers();
+
+	static void runTimer(std::function<void()> &fn);
+
+	// Reports the connection reuse counters, at most once a minute
+	void logStats();
+
+	CURLM *multi_{};
+
+	std::mutex                               mutex_;
+	std::list<std::pair<CCurl *, Completion>> pending_;
+	bool                                     stop_{};
+
+	std::multimap<std::chrono::steady_clock::time_point, std::function<void()>> timers_;
+
+	// Only touched by the I/O thread
+	std::map<CURL *, Completion>          active_;
+	CTransportStats                       lastStats_{};
+	std::chrono::steady_clock::time_point lastStatsTime_{std::chrono::steady_clock::now()};
+
+	std::thread thread_;
+};
+
+} // namespace OneDrive
+
+#endif // __CURLMULTI_H_INCLUDED__
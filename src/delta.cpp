@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <json/json.h>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "appconfig.h"
+#include "delta.h"
+#include "log.h"
+
+namespace {
+
+Json::Value parse(const std::string &data)
+{
+	std::stringstream stream;
+
+	stream << data;
+
+	Json::Value root;
+
+	stream >> root;
+
+	return root;
+}
+
+} // anonymous namespace
+
+namespace OneDrive {
+
+void CDeltaSync::start(unsigned int interval, const std::string &deltaLink)
+{
+	interval_ = std::chrono::seconds(interval);
+
+	if (deltaLink.empty())
+		load();
+	else
+		deltaLink_ = deltaLink;
+
+	thread_ = std::thread(&CDeltaSync::run, this);
+}
+
+void CDeltaSync::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		stop_ = true;
+	}
+
+	cond_.notify_one();
+
+	if (thread_.joinable())
+		thread_.join();
+}
+
+void CDeltaSync::run()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	while (!stop_) {
+		lock.unlock();
+
+		try {
+			poll();
+		} catch (const CHttpError &e) {
+			if (e.respCode() == 410) {
+				LOG_WARN("the delta link has expired, dropping the cached metadata");
+
+				deltaLink_.clear();
+				std::remove((gConfig.configDir() + "/delta.json").c_str());
+
+				reset_();
+			} else {
+				LOG_ERROR("failed to fetch the drive changes: " << e.what());
+			}
+		} catch (const std::exception &e) {
+			LOG_ERROR("failed to fetch the drive changes: " << e.what());
+		}
+
+		lock.lock();
+
+		cond_.wait_for(lock, interval_, [this] { return stop_; });
+	}
+}
+
+void CDeltaSync::poll()
+{
+	time_t started = std::time(nullptr);
+
+	// Without a saved position only the changes from now on are of interest,
+	// the rest of the drive is looked up as needed
+	std::string resource = deltaLink_.empty() ? "/me/drive/root/delta?token=latest" : CGraph::resourceOf(deltaLink_);
+
+	if (deltaLink_.empty())
+		since_ = started;
+
+	for (;;) {
+		Json::Value root = parse(graph_->request(resource, CScheduler::PRIORITY_BACKGROUND));
+
+		if (root["value"].size() > 0)
+			apply_(root["value"]);
+
+		if (!!root["@odata.nextLink"]) {
+			resource = CGraph::resourceOf(root["@odata.nextLink"].asString());
+			continue;
+		}
+
+		if (!root["@odata.deltaLink"])
+			throw std::runtime_error("the delta response carries no link");
+
+		std::string deltaLink = root["@odata.deltaLink"].asString();
+
+		if (deltaLink != deltaLink_) {
+			deltaLink_ = deltaLink;
+
+			persist();
+		}
+
+		synced_(since_, started, deltaLink_);
+		return;
+	}
+}
+
+void CDeltaSync::load()
+{
+	std::ifstream f(gConfig.configDir() + "/delta.json");
+
+	if (!f)
+		return;
+
+	try {
+		Json::Value root;
+
+		f >> root;
+
+		deltaLink_ = root["deltaLink"].asString();
+	} catch (const std::exception &e) {
+		LOG_WARN("ignoring the saved delta link: " << e.what());
+	}
+}
+
+void CDeltaSync::persist()
+{
+	const std::string path = gConfig.configDir() + "/delta.json";
+	const std::string tmpPath = path + ".tmp";
+
+	Json::Value root;
+
+	root["deltaLink"] = deltaLink_;
+
+	try {
+		{
+			std::ofstream f(tmpPath, std::ios::binary | std::ios::trunc);
+
+			if (!f)
+				throw std::runtime_error("failed to save the delta link");
+
+			f << root;
+
+			if (!f.flush())
+				throw std::runtime_error("failed to save the delta link");
+		}
+
+		if (std::rename(tmpPath.c_str(), path.c_str()) < 0)
+			throw std::runtime_error("failed to save the delta link");
+	} catch (const std::exception &e) {
+		// Only costs a longer catch up after a restart
+		LOG_WARN(e.what());
+	}
+}
+
+} // namespace OneDrive
@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef __DELTA_H_INCLUDED__
+#define __DELTA_H_INCLUDED__
+
+#include <ctime>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "graph.h"
+
+namespace Json {
+class Value;
+}
+
+namespace OneDrive {
+
+// Keeps the cached metadata in step with the drive by polling the delta
+// query on a background thread. Only the changes cross the network. The
+// link to the next change set is saved in delta.json, so a restart picks up
+// where the previous run left off.
+class CDeltaSync
+{
+public:
+	// Receives one page of changed items
+	typedef std::function<void(const Json::Value &items)> Apply;
+
+	// The server has lost track of our position, nothing cached can be
+	// trusted any longer
+	typedef std::function<void()> Reset;
+
+	// Every change made before the given time has been applied, the link
+	// leads to the changes that follow. Changes made before since may have
+	// been missed, if the polling started from the latest position rather
+	// than a saved one.
+	typedef std::function<void(time_t since, time_t time, const std::string &deltaLink)> Synced;
+
+	CDeltaSync(CGraph *graph, Apply apply, Reset reset, Synced synced): graph_{graph},
+		apply_{std::move(apply)}, reset_{std::move(reset)}, synced_{std::move(synced)}
+	{
+	}
+
+	~CDeltaSync()
+	{
+		stop();
+	}
+
+	CDeltaSync(const CDeltaSync &) = delete;
+	CDeltaSync & operator=(const CDeltaSync &) = delete;
+
+	// Starts polling every interval seconds from the given position, or
+	// from the saved one if none is given
+	void start(unsigned int interval, const std::string &deltaLink = std::string());
+
+	void stop();
+
+private:
+	void run();
+
+	// Fetches and applies the change set since the last one
+	void poll();
+
+	void load();
+
+	void persist();
+
+	CGraph *graph_;
+	Apply   apply_;
+	Reset   reset_;
+	Synced  synced_;
+
+	// Only touched by the polling thread
+	std::string deltaLink_;
+	time_t      since_{}; // when the changes started being followed, 0 if from a saved position
+
+	std::chrono::seconds    interval_{};
+	std::mutex              mutex_;
+	std::condition_variable cond_;
+	bool                    stop_{};
+	std::thread             thread_;
+};
+
+} // namespace OneDrive
+
+#endif // __DELTA_H_INCLUDED__
@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <json/json.h>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include "appconfig.h"
+#include "downloadurls.h"
+#include "log.h"
+
+namespace {
+
+// Upper bound on the number of remembered URLs
+const size_t maxUrls = 4096;
+
+std::string resourceOf(const std::string &itemId)
+{
+	return "/me/drive/items/" + itemId + "?$select=id,@microsoft.graph.downloadUrl";
+}
+
+std::string urlFromJson(const std::string &data)
+{
+	std::stringstream stream;
+
+	stream << data;
+
+	Json::Value root;
+
+	stream >> root;
+
+	std::string url = root["@microsoft.graph.downloadUrl"].asString();
+
+	if (url.empty())
+		throw std::runtime_error("the item has no download URL");
+
+	return url;
+}
+
+// Renewing at three quarters of the lifetime leaves plenty of room for the
+// renewal itself; past the expiry margin a URL is not handed out anymore
+std::chrono::seconds renewAfter()
+{
+	return std::chrono::seconds(gConfig.downloadUrlLifetime() * 3 / 4);
+}
+
+std::chrono::seconds expireAfter()
+{
+	return std::chrono::seconds(gConfig.downloadUrlLifetime() - 30);
+}
+
+} // anonymous namespace
+
+namespace OneDrive {
+
+void CDownloadUrls::update(const std::string &itemId, const std::string &url)
+{
+	if (url.empty())
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	store(itemId, url, Clock::now());
+}
+
+std::string CDownloadUrls::url(const std::string &itemId)
+{
+	Clock::time_point now = Clock::now();
+
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+
+		auto i = urls_.find(itemId);
+
+		if (i != urls_.end() && now - i->second.issued < expireAfter()) {
+			std::string url = i->second.url;
+
+			if (now - i->second.issued >= renewAfter() && !i->second.renewing) {
+				i->second.renewing = true;
+
+				lock.unlock();
+
+				renew(itemId);
+			}
+
+			return url;
+		}
+	}
+
+	std::string url = fetch(itemId);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	store(itemId, url, now);
+
+	return url;
+}
+
+void CDownloadUrls::reject(const std::string &itemId, const std::string &url)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto i = urls_.find(itemId);
+
+	// Somebody might have renewed it in the meantime
+	if (i != urls_.end() && i->second.url == url)
+		urls_.erase(i);
+}
+
+std::string CDownloadUrls::fetch(const std::string &itemId)
+{
+	// Opening a file from several processes at once asks for one URL
+	return fetches_.run(itemId, [this, &itemId]() { return urlFromJson(graph_->request(resourceOf(itemId))); });
+}
+
+void CDownloadUrls::renew(const std::string &itemId)
+{
+	Clock::time_point requested = Clock::now();
+
+	auto done = [this, itemId, requested](std::string data, std::exception_ptr error) {
+		std::string url;
+
+		try {
+			if (error)
+				std::rethrow_exception(error);
+
+			url = urlFromJson(data);
+		} catch (const std::exception &e) {
+			LOG_WARN("failed to renew the download URL of " << itemId << ": " << e.what());
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (!url.empty()) {
+			store(itemId, url, requested);
+			return;
+		}
+
+		// The current URL remains in use until it expires or is rejected
+		auto i = urls_.find(itemId);
+
+		if (i != urls_.end())
+			i->second.renewing = false;
+	};
+
+	try {
+		graph_->requestAsync(resourceOf(itemId), done, CScheduler::PRIORITY_BACKGROUND);
+	} catch (...) {
+		done(std::string(), std::current_exception());
+	}
+}
+
+void CDownloadUrls::store(const std::string &itemId, const std::string &url, Clock::time_point issued)
+{
+	auto i = urls_.find(itemId);
+
+	if (i != urls_.end()) {
+		// Do not replace a URL handed out after this one was requested
+		if (i->second.issued <= issued) {
+			i->second.url    = url;
+			i->second.issued = issued;
+		}
+
+		i->second.renewing = false;
+		return;
+	}
+
+	if (urls_.size() >= maxUrls) {
+		Clock::time_point now = Clock::now();
+
+		for (auto j = urls_.begin(); j != urls_.end();) {
+			if (now - j->second.issued >= expireAfter() && !j->second.renewing)
+				j = urls_.erase(j);
+			else
+				++j;
+		}
+
+		if (urls_.size() >= maxUrls)
+			urls_.erase(std::min_element(urls_.begin(), urls_.end(),
+				[](const std::pair<const std::string, CEntry> &a, const std::pair<const std::string, CEntry> &b) {
+					return a.second.issued < b.second.issued;
+				}));
+	}
+
+	urls_.emplace(itemId, CEntry{url, issued, false});
+}
+
+} // namespace OneDrive
@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef __DOWNLOADURLS_H_INCLUDED__
+#define __DOWNLOADURLS_H_INCLUDED__
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "graph.h"
+#include "singleflight.h"
+
+namespace OneDrive {
+
+// Keeps the pre-authenticated download URL of each item together with the
+// time it was handed out, so reads can go straight to the content servers
+// and only come back to the Graph endpoint when a URL is about to expire
+class CDownloadUrls
+{
+public:
+	explicit CDownloadUrls(CGraph *graph): graph_(graph)
+	{
+	}
+
+	~CDownloadUrls()
+	{
+	}
+
+	CDownloadUrls(const CDownloadUrls &) = delete;
+	CDownloadUrls & operator=(const CDownloadUrls &) = delete;
+
+	// Remembers a URL which came along with an item listing
+	void update(const std::string &itemId, const std::string &url);
+
+	// Returns a usable URL for the item. Fetches a new one when there is
+	// none left, and renews it in the background once it is getting old.
+	std::string url(const std::string &itemId);
+
+	// Drops a URL which the content servers no longer accept
+	void reject(const std::string &itemId, const std::string &url);
+
+	// Whether the content servers turned a URL down because it has expired
+	static bool expired(long respCode)
+	{
+		return respCode == 401 || respCode == 403 || respCode == 410;
+	}
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct CEntry {
+		std::string       url;
+		Clock::time_point issued;
+		bool              renewing;
+	};
+
+	CGraph                                  *graph_;
+	std::mutex                              mutex_;
+	std::unordered_map<std::string, CEntry> urls_;
+	CSingleFlight<std::string>              fetches_;
+
+	std::string fetch(const std::string &itemId);
+
+	void renew(const std::string &itemId);
+
+	void store(const std::string &itemId, const std::string &url, Clock::time_point issued);
+};
+
+} // namespace OneDrive
+
+#endif // __DOWNLOADURLS_H_INCLUDED__
@@ -0,0 +1,145 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef __DRIVEITEM_H_INCLUDED__
+#define __DRIVEITEM_H_INCLUDED__
+
+#include <ctime>
+#include <string>
+
+namespace OneDrive {
+
+class CDriveItem
+{
+public:
+	enum DriveItemType {
+		DRIVE_ITEM_FOLDER,
+		DRIVE_ITEM_FILE,
+		DRIVE_ITEM_UNKNOWN
+	};
+
+	CDriveItem()
+	{
+	}
+
+	CDriveItem(const std::string &id, const std::string &name, const std::string &size,
+		   const std::string &createTime, const std::string &modifiedTime,
+		   const std::string &url, DriveItemType type):
+			id_{id}, name_{name}, size_{size}, createTime_{createTime}, modifiedTime_{modifiedTime},
+			url_{url}, type_{type}
+	{
+	}
+
+	CDriveItem(const CDriveItem &driveItem): id_{driveItem.id_}, name_{driveItem.name_},
+		size_{driveItem.size_}, createTime_{driveItem.createTime_}, modifiedTime_{driveItem.modifiedTime_},
+		url_{driveItem.url_}, type_{driveItem.type_}, hash_{driveItem.hash_}, cTag_{driveItem.cTag_},
+		cacheTime_{driveItem.cacheTime_}
+	{
+	}
+
+	CDriveItem & operator=(const CDriveItem &driveItem)
+	{
+		id_           = driveItem.id_;
+		name_         = driveItem.name_;
+		size_         = driveItem.size_;
+		createTime_   = driveItem.createTime_;
+		modifiedTime_ = driveItem.modifiedTime_;
+		url_          = driveItem.url_;
+		type_         = driveItem.type_;
+		hash_         = driveItem.hash_;
+		cTag_         = driveItem.cTag_;
+		cacheTime_    = driveItem.cacheTime_;
+
+		return *this;
+	}
+
+	~CDriveItem()
+	{
+	}
+
+	std::string id() const
+	{
+		return id_;
+	}
+
+	std::string name() const
+	{
+		return name_;
+	}
+
+	std::string size() const
+	{
+		return size_;
+	}
+
+	std::string createTime() const
+	{
+		return createTime_;
+	}
+
+	std::string modifiedTime() const
+	{
+		return modifiedTime_;
+	}
+
+	std::string url() const
+	{
+		return url_;
+	}
+
+	DriveItemType type() const
+	{
+		return type_;
+	}
+
+	void setDriveItemType(DriveItemType type)
+	{
+		type_ = type;
+	}
+
+	std::string hash() const
+	{
+		return hash_;
+	}
+
+	void setHash(const std::string &hash)
+	{
+		hash_ = hash;
+	}
+
+	// Changes whenever the content does, and only then
+	std::string cTag() const
+	{
+		return cTag_;
+	}
+
+	void setCTag(const std::string &cTag)
+	{
+		cTag_ = cTag;
+	}
+
+	time_t cacheTime() const
+	{
+		return cacheTime_;
+	}
+
+	void setCacheTime(time_t cacheTime)
+	{
+		cacheTime_ = cacheTime;
+	}
+
+private:
+	std::string   id_;
+	std::string   name_;
+	std::string   size_;
+	std::string   createTime_;
+	std::string   modifiedTime_;
+	std::string   url_;
+	DriveItemType type_{DRIVE_ITEM_UNKNOWN};
+	std::string   hash_;
+	std::string   cTag_;
+	time_t        cacheTime_;
+};
+
+} // namespace OneDrive
+
+#endif // __DRIVEITEM_H_INCLUDED__
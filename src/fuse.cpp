@@ -2,7 +2,12 @@
 
 #include <unistd.h>
 #include <sys/types.h>
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
 #include "fuse.h"
 #include "log.h"
 
@@ -10,26 +15,66 @@ namespace {
 
 const char userHashAttr[] = "user.hash.sha1";
 
+// What readdir reports for the items the kernel has not looked up yet
+const ino_t unknownIno = 0xffffffff;
+
+// The offsets "." and ".." take before those of the children
+const off_t dotEntries = 2;
+
+// Adds "." and ".." from the offset on, the way readdirplus has them if plus;
+// neither counts as a lookup. Returns false if the buffer filled up first.
+bool addDotEntries(fuse_req_t req, fuse_ino_t ino, off_t offset, bool plus, std::vector<char> &buf, size_t &used)
+{
+	static const char *const names[dotEntries] = {".", ".."};
+
+	for (off_t n = offset; n < dotEntries; n++) {
+		struct fuse_entry_param entry;
+
+		std::memset(&entry, 0, sizeof(entry));
+
+		// The parent is not kept track of, the kernel knows it anyway
+		entry.attr.st_ino = n == 0 ? ino : unknownIno;
+		entry.attr.st_mode = S_IFDIR;
+
+		size_t entrySize = plus ?
+			fuse_add_direntry_plus(req, buf.data() + used, buf.size() - used, names[n], &entry, n + 1) :
+			fuse_add_direntry(req, buf.data() + used, buf.size() - used, names[n], &entry.attr, n + 1);
+
+		if (entrySize > buf.size() - used)
+			return false;
+
+		used += entrySize;
+	}
+
+	return true;
+}
+
 } // anonymouse namespace
 
 namespace OneDrive {
 
 CFuse::CFuse()
 {
-	fuseOps_.init      = fuseInit;
-	fuseOps_.destroy   = fuseDestroy;
-	fuseOps_.getattr   = fuseGetAttr;
-	fuseOps_.open      = fuseOpen;
-	fuseOps_.read      = fuseRead;
-	fuseOps_.release   = fuseRelease;
-	fuseOps_.readdir   = fuseReadDir;
-	fuseOps_.listxattr = fuseListXAttr;
-	fuseOps_.getxattr  = fuseGetXAttr;
-	fuseOps_.statfs    = fuseStatFs;
-	fuseOps_.unlink    = fuseUnlink;
-	fuseOps_.rmdir     = fuseRmDir;
-	fuseOps_.ftruncate = fuseFtruncate;
-	fuseOps_.mkdir     = fuseMkDir;
+	fuseOps_.init         = fuseInit;
+	fuseOps_.destroy      = fuseDestroy;
+	fuseOps_.lookup       = fuseLookup;
+	fuseOps_.forget       = fuseForget;
+	fuseOps_.forget_multi = fuseForgetMulti;
+	fuseOps_.getattr      = fuseGetAttr;
+	fuseOps_.setattr      = fuseSetAttr;
+	fuseOps_.open         = fuseOpen;
+	fuseOps_.read         = fuseRead;
+	fuseOps_.release      = fuseRelease;
+	fuseOps_.opendir      = fuseOpenDir;
+	fuseOps_.readdir      = fuseReadDir;
+	fuseOps_.readdirplus  = fuseReadDirPlus;
+	fuseOps_.releasedir   = fuseReleaseDir;
+	fuseOps_.listxattr    = fuseListXAttr;
+	fuseOps_.getxattr     = fuseGetXAttr;
+	fuseOps_.statfs       = fuseStatFs;
+	fuseOps_.unlink       = fuseUnlink;
+	fuseOps_.rmdir        = fuseRmDir;
+	fuseOps_.mkdir        = fuseMkDir;
 }
 
 CFuse::~CFuse()
@@ -39,425 +84,601 @@ CFuse::~CFuse()
 int CFuse::init(int argc, const char *argv[])
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, const_cast<char **>(argv));
+	struct fuse_cmdline_opts opts{};
+	int ret = -1;
+
+	if (fuse_parse_cmdline(&args, &opts) != 0)
+		return -1;
+
+	if (opts.show_help) {
+		std::cout << "usage: " << argv[0] << " [options] <mountpoint>" << std::endl << std::endl;
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		ret = 0;
+	} else if (opts.show_version) {
+		fuse_lowlevel_version();
+		ret = 0;
+	} else if (!opts.mountpoint) {
+		std::cerr << "usage: " << argv[0] << " [options] <mountpoint>" << std::endl;
+	} else {
+		struct fuse_session *session = fuse_session_new(&args, &fuseOps_, sizeof(fuseOps_), this);
+
+		if (session) {
+			if (fuse_set_signal_handlers(session) == 0) {
+				if (fuse_session_mount(session, opts.mountpoint) == 0) {
+					fuse_daemonize(opts.foreground);
+
+					if (opts.singlethread)
+						ret = fuse_session_loop(session);
+					else
+						ret = fuse_session_loop_mt(session, opts.clone_fd);
+
+					fuse_session_unmount(session);
+				}
+
+				fuse_remove_signal_handlers(session);
+			}
 
-	int ret = fuse_main(args.argc, args.argv, &fuseOps_, nullptr);
+			fuse_session_destroy(session);
+		}
+	}
 
-	return ret;
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+
+	return ret < 0 ? -1 : 0;
 }
 
-void *CFuse::fuseInit(struct fuse_conn_info * /*conn*/)
+void CFuse::CDirHandle::entries(size_t from, std::vector<CDriveItem> &driveItems)
 {
-	COneDrive *oneDrive;
+	std::lock_guard<std::mutex> lock(mutex_);
 
-	try {
-		oneDrive = new COneDrive();
-	} catch (const std::exception &e) {
-		LOG_ERROR("failed to create a COneDrive instance: " << e.what());
-		oneDrive = nullptr;
-	} catch (...) {
-		LOG_ERROR("failed to create a COneDrive instance: unknown exception");
-		oneDrive = nullptr;
+	while (entries_.size() <= from && !over_) {
+		std::list<CDriveItem> page;
+
+		if (!listing_->next(page)) {
+			over_ = true;
+			break;
+		}
+
+		entries_.insert(entries_.end(), page.begin(), page.end());
 	}
 
-	return oneDrive;
+	if (entries_.size() > from)
+		driveItems.assign(entries_.begin() + from, entries_.end());
 }
 
-void CFuse::fuseDestroy(void *ptr)
+CDriveItem CFuse::itemOf(fuse_ino_t ino)
 {
-	delete static_cast<COneDrive *>(ptr);
-}
+	if (ino == CInodeTable::rootIno) {
+		CDriveItem driveItem = oneDrive_->itemFromPath("/");
 
-int CFuse::fuseGetAttr(const char *path, struct stat *st)
-{
-	int err = 0;
-	COneDrive *oneDrive = static_cast<COneDrive *>(fuse_get_context()->private_data);
+		inodes_.setRootId(driveItem.id());
 
-	if (!oneDrive)
-		return -EIO;
+		return driveItem;
+	}
 
-	try {
-		CDriveItem driveItem = oneDrive->itemFromPath(path);
+	std::string id = inodes_.id(ino);
 
-		if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
-			return -ENOENT;
-
-		std::memset(st, 0, sizeof(*st));
-
-		st->st_uid = getuid();
-		st->st_gid = getgid();
-		st->st_nlink = 1;
-		if (driveItem.type() == CDriveItem::DRIVE_ITEM_FOLDER) {
-			st->st_size = 4096;
-			st->st_mode = S_IFDIR | S_IXUSR | S_IRUSR | S_IWUSR | S_IXGRP | S_IRGRP | S_IXOTH | S_IROTH;
-		} else if (driveItem.type() == CDriveItem::DRIVE_ITEM_FILE) {
-			st->st_size = std::stoull(driveItem.size());
-			st->st_mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
-		}
-		oneDrive->driveItemTime(driveItem.createTime(), st->st_ctim);
-		oneDrive->driveItemTime(driveItem.modifiedTime(), st->st_mtim);
-		st->st_atim = st->st_mtim;
-	} catch (const std::exception &e) {
-		LOG_ERROR("an exception was caught: " << e.what());
-		err = -EIO;
-	} catch (...) {
-		LOG_ERROR("an unknown exception was caught");
-		err = -EIO;
+	if (id.empty())
+		return CDriveItem();
+
+	return oneDrive_->itemFromId(id);
+}
+
+void CFuse::fillStat(const CDriveItem &driveItem, fuse_ino_t ino, struct stat *st)
+{
+	std::memset(st, 0, sizeof(*st));
+
+	st->st_ino = ino;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_nlink = 1;
+	if (driveItem.type() == CDriveItem::DRIVE_ITEM_FOLDER) {
+		st->st_size = 4096;
+		st->st_mode = S_IFDIR | S_IXUSR | S_IRUSR | S_IWUSR | S_IXGRP | S_IRGRP | S_IXOTH | S_IROTH;
+	} else if (driveItem.type() == CDriveItem::DRIVE_ITEM_FILE) {
+		st->st_size = std::stoull(driveItem.size());
+		st->st_mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
 	}
+	oneDrive_->driveItemTime(driveItem.createTime(), st->st_ctim);
+	oneDrive_->driveItemTime(driveItem.modifiedTime(), st->st_mtim);
+	st->st_atim = st->st_mtim;
+}
 
-	return err;
+void CFuse::fillEntry(const CDriveItem &driveItem, struct fuse_entry_param *entry)
+{
+	std::memset(entry, 0, sizeof(*entry));
+
+	// The attributes are filled in first, as they may throw and the lookup
+	// must not be counted then
+	fillStat(driveItem, 0, &entry->attr);
+
+	entry->ino = inodes_.lookup(driveItem.id());
+	entry->attr.st_ino = entry->ino;
+	entry->attr_timeout = gConfig.entryTimeout();
+	entry->entry_timeout = gConfig.entryTimeout();
 }
 
-int CFuse::fuseOpen(const char *path, struct fuse_file_info * /*fileInfo*/)
+template <typename Operation>
+void CFuse::dispatch(fuse_req_t req, Operation operation)
 {
-	int err = 0;
-	COneDrive *oneDrive = static_cast<COneDrive *>(fuse_get_context()->private_data);
+	int err;
+	CFuse *fuse = static_cast<CFuse *>(fuse_req_userdata(req));
 
-	if (!oneDrive)
-		return -EIO;
+	if (!fuse->oneDrive_) {
+		fuse_reply_err(req, EIO);
+		return;
+	}
 
 	try {
-		CDriveItem driveItem = oneDrive->itemFromPath(path);
-
-		if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
-			return -ENOENT;
+		err = operation(fuse);
 	} catch (const std::exception &e) {
 		LOG_ERROR("an exception was caught: " << e.what());
-		err = -ENOENT;
+		err = EIO;
 	} catch (...) {
 		LOG_ERROR("an unknown exception was caught");
-		err = -ENOENT;
+		err = EIO;
 	}
 
-	return err;
+	if (err)
+		fuse_reply_err(req, err);
 }
 
-int CFuse::fuseRelease(const char * /*path*/, struct fuse_file_info * /*fileInfo*/)
+int CFuse::replyXAttr(fuse_req_t req, const std::string &data, size_t size)
 {
+	if (size == 0)
+		fuse_reply_xattr(req, data.size());
+	else if (size < data.size())
+		return ERANGE;
+	else
+		fuse_reply_buf(req, data.data(), data.size());
+
 	return 0;
 }
 
-int CFuse::fuseReadDir(const char *path, void *buf, fuse_fill_dir_t fillDir,
-		       off_t /*offset*/, struct fuse_file_info * /*fileInfo*/)
+void CFuse::fuseInit(void *userdata, struct fuse_conn_info *conn)
 {
-	int err = 0;
-	COneDrive *oneDrive = static_cast<COneDrive *>(fuse_get_context()->private_data);
+	CFuse *fuse = static_cast<CFuse *>(userdata);
 
-	if (!oneDrive)
-		return -EIO;
+	// Lets ls -l get the names and the attributes in one go
+	if (conn->capable & FUSE_CAP_READDIRPLUS)
+		conn->want |= FUSE_CAP_READDIRPLUS;
 
 	try {
-		CDriveItem driveItem = oneDrive->itemFromPath(path);
+		fuse->oneDrive_ = new COneDrive();
+	} catch (const std::exception &e) {
+		LOG_ERROR("failed to create a COneDrive instance: " << e.what());
+	} catch (...) {
+		LOG_ERROR("failed to create a COneDrive instance: unknown exception");
+	}
+}
 
-		if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
-			return -ENOENT;
+void CFuse::fuseDestroy(void *userdata)
+{
+	CFuse *fuse = static_cast<CFuse *>(userdata);
 
-		std::list<CDriveItem> driveItems;
+	delete fuse->oneDrive_;
 
-		oneDrive->listChildren(driveItem, driveItems);
+	fuse->oneDrive_ = nullptr;
+}
 
-		for (auto &&i : driveItems) {
-			struct stat st{};
+void CFuse::fuseLookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	dispatch(req, [&](CFuse *fuse) {
+		CDriveItem parentItem = fuse->itemOf(parent);
 
-			st.st_uid = getuid();
-			st.st_gid = getgid();
-			st.st_nlink = 1;
-			if (i.type() == CDriveItem::DRIVE_ITEM_FOLDER) {
-				st.st_size = 4096;
-				st.st_mode = S_IFDIR | S_IXUSR | S_IRUSR | S_IWUSR | S_IXGRP | S_IRGRP | S_IXOTH | S_IROTH;
-			} else if (i.type() == CDriveItem::DRIVE_ITEM_FILE) {
-				st.st_size = std::stoull(i.size());
-				st.st_mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
-			}
-			oneDrive->driveItemTime(i.createTime(), st.st_ctim);
-			oneDrive->driveItemTime(i.modifiedTime(), st.st_mtim);
-			st.st_atim = st.st_mtim;
+		if (parentItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
+			return ENOENT;
 
-			std::string fpath(path);
-			if (fpath == "/")
-				oneDrive->cacheLocked(fpath + i.name(), i);
-			else
-				oneDrive->cacheLocked(fpath + "/" + i.name(), i);
+		if (parentItem.type() != CDriveItem::DRIVE_ITEM_FOLDER)
+			return ENOTDIR;
 
-			if (fillDir(buf, i.name().c_str(), &st, 0))
-				break;
+		CDriveItem driveItem = fuse->oneDrive_->childItem(parentItem, name);
+		struct fuse_entry_param entry{};
+
+		if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN) {
+			// Spares the daemon the lookups of the missing name for a while
+			entry.ino = 0;
+			entry.entry_timeout = gConfig.negativeTimeout();
+		} else {
+			fuse->fillEntry(driveItem, &entry);
 		}
-	} catch (const std::exception &e) {
-		LOG_ERROR("an exception was caught: " << e.what());
-		err = -EIO;
-	} catch (...) {
-		LOG_ERROR("an unknown exception was caught");
-		err = -EIO;
-	}
 
-	return err;
+		fuse_reply_entry(req, &entry);
+
+		return 0;
+	});
 }
 
-int CFuse::fuseListXAttr(const char *path, char *buf, size_t size)
+void CFuse::fuseForget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
 {
-	int err = 0;
-	COneDrive *oneDrive = static_cast<COneDrive *>(fuse_get_context()->private_data);
+	CFuse *fuse = static_cast<CFuse *>(fuse_req_userdata(req));
 
-	if (!oneDrive)
-		return -EIO;
+	fuse->inodes_.forget(ino, nlookup);
 
-	try {
-		CDriveItem driveItem = oneDrive->itemFromPath(path);
+	fuse_reply_none(req);
+}
+
+void CFuse::fuseForgetMulti(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	CFuse *fuse = static_cast<CFuse *>(fuse_req_userdata(req));
+
+	for (size_t i = 0; i < count; i++)
+		fuse->inodes_.forget(forgets[i].ino, forgets[i].nlookup);
+
+	fuse_reply_none(req);
+}
+
+void CFuse::fuseGetAttr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * /*fileInfo*/)
+{
+	dispatch(req, [&](CFuse *fuse) {
+		CDriveItem driveItem = fuse->itemOf(ino);
 
 		if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
-			return -ENOENT;
+			return ENOENT;
 
-		if (driveItem.type() != CDriveItem::DRIVE_ITEM_FILE)
-			return 0;
-
-		if (driveItem.hash().empty())
-			return 0;
-
-		if (!buf)
-			err = sizeof(userHashAttr);
-		else if (size < sizeof(userHashAttr))
-			err = -ERANGE;
-		else {
-			memcpy(buf, userHashAttr, sizeof(userHashAttr));
-			err = sizeof(userHashAttr);
-		}
-	} catch (const std::exception &e) {
-		LOG_ERROR("an exception was caught: " << e.what());
-		err = -EIO;
-	} catch (...) {
-		LOG_ERROR("an unknown exception was caught");
-		err = -EIO;
-	}
+		struct stat st;
+
+		fuse->fillStat(driveItem, ino, &st);
 
-	return err;
+		fuse_reply_attr(req, &st, gConfig.entryTimeout());
+
+		return 0;
+	});
 }
 
-int CFuse::fuseGetXAttr(const char *path, const char *name, char *buf, size_t size)
+void CFuse::fuseSetAttr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int toSet,
+			struct fuse_file_info * /*fileInfo*/)
 {
-	int err = 0;
-	COneDrive *oneDrive = static_cast<COneDrive *>(fuse_get_context()->private_data);
+	dispatch(req, [&](CFuse *fuse) {
+		// Only truncating is supported
+		if (!(toSet & FUSE_SET_ATTR_SIZE))
+			return ENOSYS;
 
-	if (!oneDrive)
-		return -EIO;
+		CDriveItem driveItem = fuse->itemOf(ino);
 
-	try {
-		if (strcmp(name, userHashAttr))
-			return -ENODATA;
+		if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
+			return ENOENT;
+
+		if (driveItem.type() != CDriveItem::DRIVE_ITEM_FILE)
+			return EISDIR;
+
+		fuse->oneDrive_->truncateItem(driveItem, attr->st_size);
+
+		driveItem = fuse->oneDrive_->itemFromId(driveItem.id());
+
+		if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
+			return ENOENT;
+
+		struct stat st;
+
+		fuse->fillStat(driveItem, ino, &st);
+
+		fuse_reply_attr(req, &st, gConfig.entryTimeout());
 
-		CDriveItem driveItem = oneDrive->itemFromPath(path);
+		return 0;
+	});
+}
+
+void CFuse::fuseOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fileInfo)
+{
+	dispatch(req, [&](CFuse *fuse) {
+		CDriveItem driveItem = fuse->itemOf(ino);
 
 		if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
-			return -ENOENT;
+			return ENOENT;
 
 		if (driveItem.type() != CDriveItem::DRIVE_ITEM_FILE)
-			return 0;
+			return EISDIR;
 
-		if (driveItem.hash().empty())
-			return 0;
+		CFileHandle *fileHandle = new CFileHandle{fuse->oneDrive_->open(driveItem)};
 
-		if (!buf)
-			err = driveItem.hash().length();
-		else
-			err = snprintf(buf, size, "%s", driveItem.hash().c_str());
-	} catch (const std::exception &e) {
-		LOG_ERROR("an exception was caught: " << e.what());
-		err = -EIO;
-	} catch (...) {
-		LOG_ERROR("an unknown exception was caught");
-		err = -EIO;
-	}
+		fileInfo->fh = reinterpret_cast<uint64_t>(fileHandle);
+
+		// Interrupted, there will be no release
+		if (fuse_reply_open(req, fileInfo) != 0)
+			delete fileHandle;
 
-	return err;
+		return 0;
+	});
 }
 
-int CFuse::fuseStatFs(const char *path, struct statvfs *st)
+void CFuse::fuseRead(fuse_req_t req, fuse_ino_t /*ino*/, size_t size, off_t offset,
+		     struct fuse_file_info *fileInfo)
 {
-	int err = 0;
-	COneDrive *oneDrive = static_cast<COneDrive *>(fuse_get_context()->private_data);
+	dispatch(req, [&](CFuse *fuse) {
+		CFileHandle *fileHandle = reinterpret_cast<CFileHandle *>(fileInfo->fh);
 
-	if (!oneDrive)
-		return -EIO;
+		if (!fileHandle)
+			return EBADF;
 
-	try {
-		CDrive drive = oneDrive->drive();
+		std::vector<char> buf(size);
 
-		std::memset(st, 0, sizeof(*st));
+		size = fuse->oneDrive_->read(*fileHandle->file, buf.data(), size, offset);
 
-		st->f_bsize = 4096;
-		st->f_frsize = 4096;
-		st->f_blocks = std::stoull(drive.quota().total()) / st->f_frsize;
-		st->f_bfree = (std::stoull(drive.quota().total()) - std::stoull(drive.quota().used())) / st->f_bsize;
-		st->f_bavail = st->f_bfree;
-		st->f_namemax = 1024;
-	} catch (const std::exception &e) {
-		LOG_ERROR("an exception was caught: " << e.what());
-		err = -EIO;
-	} catch (...) {
-		LOG_ERROR("an unknown exception was caught");
-		err = -EIO;
-	}
+		fuse_reply_buf(req, buf.data(), size);
 
-	return err;
+		return 0;
+	});
 }
 
-int CFuse::fuseRead(const char *path, char *buf, size_t size, off_t offset,
-		    struct fuse_file_info *fileInfo)
+void CFuse::fuseRelease(fuse_req_t req, fuse_ino_t /*ino*/, struct fuse_file_info *fileInfo)
 {
-	int err = 0;
-	COneDrive *oneDrive = static_cast<COneDrive *>(fuse_get_context()->private_data);
+	CFuse *fuse = static_cast<CFuse *>(fuse_req_userdata(req));
+	CFileHandle *fileHandle = reinterpret_cast<CFileHandle *>(fileInfo->fh);
 
-	if (!oneDrive)
-		return -EIO;
+	// What is still being downloaded for the file is dropped
+	if (fileHandle && fuse->oneDrive_)
+		fuse->oneDrive_->close(*fileHandle->file);
 
-	try {
-		CDriveItem driveItem = oneDrive->itemFromPath(path);
+	delete fileHandle;
+
+	fileInfo->fh = 0;
+
+	fuse_reply_err(req, 0);
+}
+
+void CFuse::fuseOpenDir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fileInfo)
+{
+	dispatch(req, [&](CFuse *fuse) {
+		CDriveItem driveItem = fuse->itemOf(ino);
 
 		if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
-			return -ENOENT;
+			return ENOENT;
 
-		if (driveItem.type() != CDriveItem::DRIVE_ITEM_FILE)
-			return -EISDIR;
+		if (driveItem.type() != CDriveItem::DRIVE_ITEM_FOLDER)
+			return ENOTDIR;
 
-		err = oneDrive->read(driveItem, buf, size, offset);
-	} catch (const std::exception &e) {
-		LOG_ERROR("an exception was caught: " << e.what());
-		err = -EIO;
-	} catch (...) {
-		LOG_ERROR("an unknown exception was caught");
-		err = -EIO;
-	}
+		// Replied to without waiting for the listing, unless it is cached
+		std::unique_ptr<CDirHandle> dirHandle(new CDirHandle(fuse->oneDrive_->openListing(driveItem)));
+
+		fileInfo->fh = reinterpret_cast<uint64_t>(dirHandle.get());
+
+		if (fuse_reply_open(req, fileInfo) == 0)
+			dirHandle.release();
 
-	return err;
+		return 0;
+	});
 }
 
-int CFuse::fuseUnlink(const char *path)
+void CFuse::fuseReadDir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+			struct fuse_file_info *fileInfo)
 {
-	int err = 0;
-	COneDrive *oneDrive = static_cast<COneDrive *>(fuse_get_context()->private_data);
+	dispatch(req, [&](CFuse *fuse) {
+		CDirHandle *dirHandle = reinterpret_cast<CDirHandle *>(fileInfo->fh);
 
-	if (!oneDrive)
-		return -EIO;
+		if (!dirHandle)
+			return EBADF;
 
-	try {
-		CDriveItem driveItem = oneDrive->itemFromPath(path);
+		if (offset < 0)
+			return EINVAL;
 
-		if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
-			return -ENOENT;
+		std::vector<CDriveItem> entries;
+		std::vector<char> buf(size);
+		size_t used = 0;
 
-		if (driveItem.type() != CDriveItem::DRIVE_ITEM_FILE)
-			return -EISDIR;
+		if (addDotEntries(req, ino, offset, false, buf, used))
+			dirHandle->entries(std::max(offset, dotEntries) - dotEntries, entries);
 
-		oneDrive->deleteItem(driveItem);
-	} catch (const std::exception &e) {
-		LOG_ERROR("an exception was caught: " << e.what());
-		err = -EIO;
-	} catch (...) {
-		LOG_ERROR("an unknown exception was caught");
-		err = -EIO;
-	}
+		// The offset of an entry is that of the one to follow, so that the
+		// next call picks up where the buffer filled up
+		for (size_t n = 0; n < entries.size(); n++) {
+			const CDriveItem &i = entries[n];
+			off_t next = std::max(offset, dotEntries) + n + 1;
+			fuse_ino_t childIno = fuse->inodes_.find(i.id());
+			struct stat st;
+
+			fuse->fillStat(i, childIno ? childIno : unknownIno, &st);
+
+			size_t entrySize = fuse_add_direntry(req, buf.data() + used, size - used, i.name().c_str(), &st, next);
 
-	return err;
+			if (entrySize > size - used)
+				break;
+
+			used += entrySize;
+		}
+
+		fuse_reply_buf(req, buf.data(), used);
+
+		return 0;
+	});
 }
 
-int CFuse::fuseRmDir(const char *path)
+void CFuse::fuseReadDirPlus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+			    struct fuse_file_info *fileInfo)
 {
-	int err = 0;
-	COneDrive *oneDrive = static_cast<COneDrive *>(fuse_get_context()->private_data);
+	dispatch(req, [&](CFuse *fuse) {
+		CDirHandle *dirHandle = reinterpret_cast<CDirHandle *>(fileInfo->fh);
 
-	if (!oneDrive)
-		return -EIO;
+		if (!dirHandle)
+			return EBADF;
 
-	try {
-		CDriveItem driveItem = oneDrive->itemFromPath(path);
+		if (offset < 0)
+			return EINVAL;
 
-		if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
-			return -ENOENT;
+		std::vector<CDriveItem> entries;
+		std::vector<char> buf(size);
+		size_t used = 0;
 
-		if (driveItem.type() != CDriveItem::DRIVE_ITEM_FOLDER)
-			return -ENOTDIR;
+		if (addDotEntries(req, ino, offset, true, buf, used))
+			dirHandle->entries(std::max(offset, dotEntries) - dotEntries, entries);
 
-		std::list<CDriveItem> driveItems;
+		// The lookups counted for the entries in the buffer, which are
+		// undone if they do not reach the kernel
+		std::vector<fuse_ino_t> counted;
 
-		oneDrive->listChildren(driveItem, driveItems);
+		try {
+			for (size_t n = 0; n < entries.size(); n++) {
+				const CDriveItem &i = entries[n];
+				off_t next = std::max(offset, dotEntries) + n + 1;
+				struct fuse_entry_param entry;
 
-		if (driveItems.size() > 0)
-			return -ENOTEMPTY;
+				fuse->fillEntry(i, &entry);
 
-		oneDrive->deleteItem(driveItem);
-	} catch (const std::exception &e) {
-		LOG_ERROR("an exception was caught: " << e.what());
-		err = -EIO;
-	} catch (...) {
-		LOG_ERROR("an unknown exception was caught");
-		err = -EIO;
-	}
+				size_t entrySize = fuse_add_direntry_plus(req, buf.data() + used, size - used,
+									  i.name().c_str(), &entry, next);
+
+				// The entry did not make it to the kernel, nor did its lookup
+				if (entrySize > size - used) {
+					fuse->inodes_.forget(entry.ino, 1);
+					break;
+				}
 
-	return err;
+				counted.push_back(entry.ino);
+				used += entrySize;
+			}
+		} catch (...) {
+			for (auto &&i : counted)
+				fuse->inodes_.forget(i, 1);
+
+			throw;
+		}
+
+		if (fuse_reply_buf(req, buf.data(), used) != 0)
+			for (auto &&i : counted)
+				fuse->inodes_.forget(i, 1);
+
+		return 0;
+	});
 }
 
-int CFuse::fuseFtruncate(const char *path, off_t offset, struct fuse_file_info * /*fileInfo*/)
+void CFuse::fuseReleaseDir(fuse_req_t req, fuse_ino_t /*ino*/, struct fuse_file_info *fileInfo)
 {
-	int err = 0;
-	COneDrive *oneDrive = static_cast<COneDrive *>(fuse_get_context()->private_data);
+	delete reinterpret_cast<CDirHandle *>(fileInfo->fh);
 
-	if (!oneDrive)
-		return -EIO;
+	fileInfo->fh = 0;
 
-	try {
-		CDriveItem driveItem = oneDrive->itemFromPath(path);
+	fuse_reply_err(req, 0);
+}
+
+void CFuse::fuseListXAttr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	dispatch(req, [&](CFuse *fuse) {
+		CDriveItem driveItem = fuse->itemOf(ino);
 
 		if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
-			return -ENOENT;
+			return ENOENT;
 
-		if (driveItem.type() != CDriveItem::DRIVE_ITEM_FILE)
-			return -EISDIR;
+		std::string names;
 
-		oneDrive->truncateItem(driveItem, offset);
-	} catch (const std::exception &e) {
-		LOG_ERROR("an exception was caught: " << e.what());
-		err = -EIO;
-	} catch (...) {
-		LOG_ERROR("an unknown exception was caught");
-		err = -EIO;
-	}
+		if (driveItem.type() == CDriveItem::DRIVE_ITEM_FILE && !driveItem.hash().empty())
+			names.assign(userHashAttr, sizeof(userHashAttr));
 
-	return err;
+		return replyXAttr(req, names, size);
+	});
 }
 
-int CFuse::fuseMkDir(const char *path, mode_t /*mode*/)
+void CFuse::fuseGetXAttr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
 {
-	int err = 0;
-	COneDrive *oneDrive = static_cast<COneDrive *>(fuse_get_context()->private_data);
+	dispatch(req, [&](CFuse *fuse) {
+		if (strcmp(name, userHashAttr))
+			return ENODATA;
 
-	if (!oneDrive)
-		return -EIO;
+		CDriveItem driveItem = fuse->itemOf(ino);
 
-	try {
-		std::string __path = path;
-		std::size_t p = __path.rfind('/');
+		if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
+			return ENOENT;
 
-		if (p == std::string::npos)
-			return -EINVAL;
+		std::string value;
 
-		std::string dir = __path.substr(0, p);
+		if (driveItem.type() == CDriveItem::DRIVE_ITEM_FILE)
+			value = driveItem.hash();
 
-		CDriveItem driveItem = oneDrive->itemFromPath(dir);
+		return replyXAttr(req, value, size);
+	});
+}
+
+void CFuse::fuseStatFs(fuse_req_t req, fuse_ino_t /*ino*/)
+{
+	dispatch(req, [&](CFuse *fuse) {
+		CDrive drive = fuse->oneDrive_->drive();
+		struct statvfs st;
+
+		std::memset(&st, 0, sizeof(st));
+
+		st.f_bsize = 4096;
+		st.f_frsize = 4096;
+		st.f_blocks = std::stoull(drive.quota().total()) / st.f_frsize;
+		st.f_bfree = (std::stoull(drive.quota().total()) - std::stoull(drive.quota().used())) / st.f_bsize;
+		st.f_bavail = st.f_bfree;
+		st.f_namemax = 1024;
+
+		fuse_reply_statfs(req, &st);
+
+		return 0;
+	});
+}
+
+void CFuse::fuseUnlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	dispatch(req, [&](CFuse *fuse) {
+		CDriveItem parentItem = fuse->itemOf(parent);
+
+		if (parentItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
+			return ENOENT;
+
+		CDriveItem driveItem = fuse->oneDrive_->childItem(parentItem, name);
 
 		if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
-			return -ENOENT;
+			return ENOENT;
 
 		if (driveItem.type() != CDriveItem::DRIVE_ITEM_FILE)
-			return -EISDIR;
+			return EISDIR;
 
-		//oneDrive->truncateItem(driveItem, offset);
-	} catch (const std::exception &e) {
-		LOG_ERROR("an exception was caught: " << e.what());
-		err = -EIO;
-	} catch (...) {
-		LOG_ERROR("an unknown exception was caught");
-		err = -EIO;
-	}
+		fuse->oneDrive_->deleteItem(driveItem);
+
+		fuse_reply_err(req, 0);
+
+		return 0;
+	});
+}
+
+void CFuse::fuseRmDir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	dispatch(req, [&](CFuse *fuse) {
+		CDriveItem parentItem = fuse->itemOf(parent);
+
+		if (parentItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
+			return ENOENT;
+
+		CDriveItem driveItem = fuse->oneDrive_->childItem(parentItem, name);
+
+		if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
+			return ENOENT;
+
+		if (driveItem.type() != CDriveItem::DRIVE_ITEM_FOLDER)
+			return ENOTDIR;
+
+		std::list<CDriveItem> driveItems;
+
+		fuse->oneDrive_->listChildren(driveItem, driveItems);
+
+		if (driveItems.size() > 0)
+			return ENOTEMPTY;
+
+		fuse->oneDrive_->deleteItem(driveItem);
+
+		fuse_reply_err(req, 0);
+
+		return 0;
+	});
+}
+
+void CFuse::fuseMkDir(fuse_req_t req, fuse_ino_t parent, const char * /*name*/, mode_t /*mode*/)
+{
+	dispatch(req, [&](CFuse *fuse) {
+		CDriveItem parentItem = fuse->itemOf(parent);
+
+		if (parentItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
+			return ENOENT;
+
+		if (parentItem.type() != CDriveItem::DRIVE_ITEM_FOLDER)
+			return ENOTDIR;
 
-	return err;
+		// Creating folders is not supported yet
+		return ENOSYS;
+	});
 }
 
 } // namespace OneDrive
@@ -5,12 +5,20 @@
 
 #define FUSE_USE_VERSION 31
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include "appconfig.h"
+#include "inodetable.h"
 #include "onedrive.h"
 
 namespace OneDrive {
 
+// The low-level FUSE front end. The kernel refers to items by inode number,
+// so only lookup() resolves names, one component at a time; everything
+// else starts from the item behind the inode.
 class CFuse {
 public:
 	CFuse();
@@ -23,37 +31,96 @@ public:
 	int init(int argc, const char *argv[]);
 
 private:
-	struct fuse_operations fuseOps_{};
+	// How an open file is being read
+	struct CFileHandle {
+		std::shared_ptr<COpenFile> file;
+	};
 
-	static void *fuseInit(struct fuse_conn_info *conn);
+	// The listing of a directory, which the successive readdir calls go
+	// through by offset, its pages being waited for as they get to them
+	class CDirHandle {
+	public:
+		explicit CDirHandle(std::unique_ptr<COneDrive::CListing> listing): listing_{std::move(listing)}
+		{
+		}
 
-	static void fuseDestroy(void *);
+		CDirHandle(const CDirHandle &) = delete;
+		CDirHandle & operator=(const CDirHandle &) = delete;
 
-	static int fuseGetAttr(const char *path, struct stat *st);
+		// Waits for the page with the entries past from and copies those
+		// in so far; none once the listing is over. Throws if the listing
+		// failed before reaching them.
+		void entries(size_t from, std::vector<CDriveItem> &driveItems);
 
-	static int fuseOpen(const char *path, struct fuse_file_info *fileInfo);
+	private:
+		std::mutex                           mutex_;
+		std::unique_ptr<COneDrive::CListing> listing_;
+		std::vector<CDriveItem>              entries_;
+		bool                                 over_{};
+	};
 
-	static int fuseRelease(const char *path, struct fuse_file_info *fileInfo);
+	struct fuse_lowlevel_ops fuseOps_{};
+	COneDrive               *oneDrive_{};
+	CInodeTable              inodes_;
 
-	static int fuseReadDir(const char *path, void *buf, fuse_fill_dir_t fillDir,
-			       off_t offset, struct fuse_file_info *);
+	// The item behind an inode number, unknown if it no longer exists
+	CDriveItem itemOf(fuse_ino_t ino);
 
-	static int fuseListXAttr(const char *path, char *buf, size_t size);
+	void fillStat(const CDriveItem &driveItem, fuse_ino_t ino, struct stat *st);
 
-	static int fuseGetXAttr(const char *path, const char *name, char *buf, size_t size);
+	// Fills in the entry of an item, which counts as a lookup
+	void fillEntry(const CDriveItem &driveItem, struct fuse_entry_param *entry);
 
-	static int fuseStatFs(const char *path, struct statvfs *st);
+	// Runs an operation which either replies itself and returns 0, or
+	// returns the error to reply with
+	template <typename Operation>
+	static void dispatch(fuse_req_t req, Operation operation);
 
-	static int fuseRead(const char *path, char *buf, size_t size, off_t offset,
-			    struct fuse_file_info *fileInfo);
+	static int replyXAttr(fuse_req_t req, const std::string &data, size_t size);
 
-	static int fuseUnlink(const char *path);
+	static void fuseInit(void *userdata, struct fuse_conn_info *conn);
 
-	static int fuseRmDir(const char *path);
+	static void fuseDestroy(void *userdata);
 
-	static int fuseFtruncate(const char *path, off_t offset, struct fuse_file_info *fileInfo);
+	static void fuseLookup(fuse_req_t req, fuse_ino_t parent, const char *name);
 
-	static int fuseMkDir(const char *path, mode_t mode);
+	static void fuseForget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup);
+
+	static void fuseForgetMulti(fuse_req_t req, size_t count, struct fuse_forget_data *forgets);
+
+	static void fuseGetAttr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fileInfo);
+
+	static void fuseSetAttr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int toSet,
+				struct fuse_file_info *fileInfo);
+
+	static void fuseOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fileInfo);
+
+	static void fuseRead(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+			     struct fuse_file_info *fileInfo);
+
+	static void fuseRelease(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fileInfo);
+
+	static void fuseOpenDir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fileInfo);
+
+	static void fuseReadDir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+				struct fuse_file_info *fileInfo);
+
+	static void fuseReadDirPlus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+				    struct fuse_file_info *fileInfo);
+
+	static void fuseReleaseDir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fileInfo);
+
+	static void fuseListXAttr(fuse_req_t req, fuse_ino_t ino, size_t size);
+
+	static void fuseGetXAttr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size);
+
+	static void fuseStatFs(fuse_req_t req, fuse_ino_t ino);
+
+	static void fuseUnlink(fuse_req_t req, fuse_ino_t parent, const char *name);
+
+	static void fuseRmDir(fuse_req_t req, fuse_ino_t parent, const char *name);
+
+	static void fuseMkDir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
 };
 
 } // namespace OneDrive
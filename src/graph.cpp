@@ -1,10 +1,39 @@
 // SPDX-License-Identifier: GPL-2.0
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <fstream>
+#include <stdexcept>
 #include "curl.h"
 #include "graph.h"
 #include "log.h"
 
+namespace {
+
+// The host a URL points to, by which latencies are tracked
+std::string hostOf(const std::string &url)
+{
+	size_t start = url.find("://");
+
+	start = start == std::string::npos ? 0 : start + 3;
+
+	return url.substr(start, url.find('/', start) - start);
+}
+
+bool httpError(std::exception_ptr error)
+{
+	try {
+		std::rethrow_exception(error);
+	} catch (const OneDrive::CHttpError &) {
+		return true;
+	} catch (...) {
+		return false;
+	}
+}
+
+} // anonymous namespace
+
 namespace OneDrive {
 
 void CGraph::init()
@@ -18,239 +47,545 @@ void CGraph::init()
 		params.emplace_back(std::make_pair("response_type", "code"));
 		params.emplace_back(std::make_pair("redirect_uri", gConfig.redirectUri()));
 
-		std::string url = httpClient_.buildUrl(gConfig.authorityUrl() + gConfig.authEndpoint(), params);
+		std::string url = CCurl().buildUrl(gConfig.authorityUrl() + gConfig.authEndpoint(), params);
 
 		throw std::runtime_error(std::string("missing authorization code\n\n"
 			"Open the following URL in your browser (private window) and retrieve the authorization code:\n" + url));
 	}
 
-	// Redeem the code for access tokens
-	if (gConfig.token().empty() || gConfig.refreshToken().empty()) {
-		std::list<std::pair<std::string, std::string>> params;
+	tokens_.init();
+}
 
-		params.emplace_back(std::make_pair("client_id", gConfig.clientId()));
-		params.emplace_back(std::make_pair("redirect_uri", gConfig.redirectUri()));
-		params.emplace_back(std::make_pair("code", gConfig.authorizationCode()));
-		params.emplace_back(std::make_pair("grant_type", "authorization_code"));
+struct CGraph::CTransfer {
+	CScheduler::CSlot                  slot; // released once the handle is back in the pool
+	CCurlPool::CHandle                 curl;
+	Prepare                            prepare;
+	Completion                         done;
+	std::shared_ptr<const std::string> authorization;
+	bool                               authenticated;
+	unsigned int                       renewals;
+	unsigned int                       attempt;
+};
+
+struct CGraph::CRace {
+	std::mutex                                           mutex;
+	std::function<void(std::string, std::exception_ptr)> done;
+	std::string                                          host;
+	std::chrono::steady_clock::time_point                started[2];
+	std::shared_ptr<std::atomic<bool>>                   abort[2];
+	std::exception_ptr                                   error;   // to report if both runners fail
+	unsigned int                                         running;
+	bool                                                 over;
+};
+
+void CGraph::submit(Prepare prepare, Completion done, CScheduler::Priority priority, bool authenticated)
+{
+	if (!breaker_.allow())
+		throw std::runtime_error("the service is unavailable, failing fast");
+
+	// The scheduler never lets out more slots than there are handles
+	CScheduler::CSlot slot(scheduler_.acquire(priority));
+
+	launch(std::move(slot), std::move(prepare), std::move(done), authenticated);
+}
 
-		std::string url = gConfig.authorityUrl() + gConfig.tokenEndpoint();
-		std::string body = httpClient_.formEncode(params);
-		std::list<std::string> headers;
-		long respCode = 0;
+bool CGraph::trySubmit(Prepare prepare, Completion done, CScheduler::Priority priority, bool authenticated)
+{
+	if (!breaker_.allow())
+		return false;
+
+	std::unique_ptr<CScheduler::CSlot> slot(scheduler_.tryAcquire(priority));
 
-		std::string data = httpClient_.post(url, headers, body, respCode);
+	if (!slot)
+		return false;
 
-		if (respCode != 200)
-			throw std::runtime_error("the server responded with: " + data);
+	launch(std::move(*slot), std::move(prepare), std::move(done), authenticated);
 
-		std::ofstream f("token.json", std::ios::binary);
+	return true;
+}
 
-		if (!f)
-			throw std::runtime_error("failed to save the token JSON");
+void CGraph::launch(CScheduler::CSlot slot, Prepare prepare, Completion done, bool authenticated)
+{
+	std::shared_ptr<CTransfer> transfer(new CTransfer{std::move(slot), pool_.acquire(), std::move(prepare),
+							  std::move(done), nullptr, authenticated, 3, 0});
 
-		f << data;
+	schedule(transfer, limiter_.reserve());
+}
+
+void CGraph::schedule(std::shared_ptr<CTransfer> transfer, std::chrono::milliseconds delay)
+{
+	if (delay.count() <= 0) {
+		start(transfer);
+		return;
 	}
+
+	multi_.schedule(std::chrono::steady_clock::now() + delay, [this, transfer]() {
+		try {
+			start(transfer);
+		} catch (...) {
+			transfer->done(*transfer->curl, 0, std::current_exception());
+		}
+	});
 }
 
-void CGraph::refreshToken()
+void CGraph::start(std::shared_ptr<CTransfer> transfer)
 {
-	std::list<std::pair<std::string, std::string>> params;
+	if (transfer->authenticated)
+		transfer->authorization = tokens_.authorization();
 
-	params.emplace_back(std::make_pair("client_id", gConfig.clientId()));
-	params.emplace_back(std::make_pair("redirect_uri", gConfig.redirectUri()));
-	params.emplace_back(std::make_pair("refresh_token", gConfig.refreshToken()));
-	params.emplace_back(std::make_pair("grant_type", "refresh_token"));
+	transfer->curl->setAuthorization(transfer->authorization);
 
-	std::string url = gConfig.authorityUrl() + gConfig.tokenEndpoint();
-	std::string body = httpClient_.formEncode(params);
-	std::list<std::string> headers;
-	long respCode = 0;
+	transfer->prepare(*transfer->curl);
 
-	std::string data = httpClient_.post(url, headers, body, respCode);
+	transfer->curl->setMaxSpeed(scheduler_.maxRecvSpeed(transfer->slot.priority()),
+				    scheduler_.maxSendSpeed(transfer->slot.priority()));
 
-	if (respCode != 200)
-		throw std::runtime_error("the server responded with: " + data);
+	multi_.add(*transfer->curl, [this, transfer](CURLcode err) { finish(transfer, err); });
+}
 
-	std::ofstream f(gConfig.configDir() + "/token.json", std::ios::binary);
+void CGraph::finish(std::shared_ptr<CTransfer> transfer, CURLcode err)
+{
+	long respCode = 0;
+	std::exception_ptr error;
+
+	try {
+		respCode = transfer->curl->complete(err);
+	} catch (...) {
+		error = std::current_exception();
+	}
 
-	if (!f)
-		throw std::runtime_error("failed to save the token JSON");
+	try {
+		if (respCode == 401 && transfer->authenticated && transfer->renewals-- > 0) {
+			tokens_.renew(transfer->authorization, [this, transfer](std::exception_ptr error) {
+				try {
+					if (error)
+						std::rethrow_exception(error);
+					start(transfer);
+				} catch (...) {
+					transfer->done(*transfer->curl, 401, std::current_exception());
+				}
+			});
+			return;
+		}
+
+		bool throttled = CRetryPolicy::throttled(respCode);
+		bool failed = CRetryPolicy::failed(err, respCode);
+
+		if (throttled || failed) {
+			long retryAfter = transfer->curl->retryAfter();
+
+			if (throttled)
+				limiter_.throttled(retryAfter);
+
+			// A throttled request still tells that the service is up, which
+			// also resolves a probe of the breaker
+			if (failed)
+				breaker_.failed();
+			else
+				breaker_.succeeded();
+
+			if (transfer->attempt < retryPolicy_.maxRetries() && breaker_.allow()) {
+				std::chrono::milliseconds delay = std::max(retryPolicy_.backoff(transfer->attempt++, retryAfter),
+									   limiter_.reserve());
+
+				LOG_WARN("request failed (" << (err != CURLE_OK ? curl_easy_strerror(err) : "HTTP " + std::to_string(respCode))
+					 << "), retry " << transfer->attempt << " of " << retryPolicy_.maxRetries()
+					 << " in " << delay.count() << "ms");
+
+				schedule(transfer, delay);
+				return;
+			}
+		} else {
+			// Whatever else went wrong, the service answered
+			breaker_.succeeded();
+
+			if (!error)
+				limiter_.succeeded();
+		}
+	} catch (...) {
+		error = std::current_exception();
+	}
 
-	f << data;
+	transfer->done(*transfer->curl, respCode, error);
 }
 
-std::string CGraph::request(const std::string &resource)
+long CGraph::perform(Prepare prepare, CScheduler::Priority priority, bool authenticated)
 {
-	std::string url = "https://graph.microsoft.com/v1.0" + resource;
+	std::shared_ptr<std::promise<long>> promise(new std::promise<long>());
 
-	std::string data;
+	submit(std::move(prepare), [promise](CCurl &, long respCode, std::exception_ptr error) {
+		if (error)
+			promise->set_exception(error);
+		else
+			promise->set_value(respCode);
+	}, priority, authenticated);
 
-	long respCode = 0;
+	return promise->get_future().get();
+}
 
-	unsigned int retries = 3;
+std::future<std::string> CGraph::requestAsync(const std::string &resource, CScheduler::Priority priority)
+{
+	std::shared_ptr<std::promise<std::string>> promise(new std::promise<std::string>());
 
-	do {
-		std::list<std::string> headers;
+	requestAsync(resource, [promise](std::string data, std::exception_ptr error) {
+		if (error)
+			promise->set_exception(error);
+		else
+			promise->set_value(std::move(data));
+	}, priority);
 
-		headers.emplace_back(std::string("Authorization: " + gConfig.tokenType() + " " + gConfig.token()));
+	return promise->get_future();
+}
 
-		respCode = 0;
+void CGraph::requestAsync(const std::string &resource, std::function<void(std::string data, std::exception_ptr error)> done,
+			  CScheduler::Priority priority)
+{
+	std::string url = gConfig.graphUrl() + resource;
 
-		data = httpClient_.get(url, headers, respCode);
+	std::shared_ptr<std::string> data(new std::string());
 
-		if (respCode == 401) {
-			refreshToken();
-			gConfig.readToken();
-		} else if (respCode != 200)
-			throw std::runtime_error("the server responded with: " + data);
-	} while (respCode != 200 && retries-- > 0);
+	submit([url, data](CCurl &curl) {
+		data->clear();
 
-	if (respCode != 200)
-		throw std::runtime_error("the server responded with: " + data);
+		curl.prepareGet(url, *data);
+	}, [data, done](CCurl &, long respCode, std::exception_ptr error) {
+		if (!error && respCode != 200)
+			error = std::make_exception_ptr(CHttpError("the server responded with: ", respCode, *data));
 
-	return data;
+		done(error ? std::string() : std::move(*data), error);
+	}, priority);
 }
 
-void CGraph::request(const std::string &resource, std::ofstream &file)
+std::future<size_t> CGraph::requestAsync(const std::string &url, void *buf, size_t size, off_t offset,
+					 CScheduler::Priority priority)
 {
-	std::string url = "https://graph.microsoft.com/v1.0" + resource;
+	std::shared_ptr<std::promise<size_t>> promise(new std::promise<size_t>());
 
-	long respCode;
+	// The racing requests cannot both write to the caller's buffer
+	if (hedger_.enabled()) {
+		requestAsync(url, size, offset, [promise, buf](std::string data, std::exception_ptr error) {
+			if (error) {
+				promise->set_exception(error);
+				return;
+			}
 
-	unsigned int retries = 3;
+			std::memcpy(buf, data.data(), data.size());
+
+			promise->set_value(data.size());
+		}, priority);
+
+		return promise->get_future();
+	}
 
-	do {
-		std::list<std::string> headers;
+	submit([url, buf, size, offset](CCurl &curl) {
+		curl.prepareGet(url, buf, size, offset);
+	}, [promise](CCurl &curl, long respCode, std::exception_ptr error) {
+		if (error)
+			promise->set_exception(error);
+		else if (respCode != 206 && respCode != 416)
+			promise->set_exception(std::make_exception_ptr(CHttpError("HTTP error while downloading: ", respCode)));
+		else
+			promise->set_value(curl.received());
+	}, priority, false);
+
+	return promise->get_future();
+}
 
-		headers.emplace_back(std::string("Authorization: " + gConfig.tokenType() + " " + gConfig.token()));
+void CGraph::requestAsync(const std::string &url, size_t size, off_t offset,
+			  std::function<void(std::string data, std::exception_ptr error)> done,
+			  CScheduler::Priority priority, bool hedge)
+{
+	if (hedge && hedger_.enabled()) {
+		hedgedRequest(url, size, offset, std::move(done), priority);
+		return;
+	}
 
-		respCode = 0;
+	std::shared_ptr<std::string> data(new std::string(size, '\0'));
 
-		httpClient_.download(url, headers, file, respCode);
+	submit([url, data, offset](CCurl &curl) {
+		curl.prepareGet(url, &(*data)[0], data->size(), offset);
+	}, [data, done](CCurl &curl, long respCode, std::exception_ptr error) {
+		if (!error && respCode != 206 && respCode != 416)
+			error = std::make_exception_ptr(CHttpError("HTTP error while downloading: ", respCode));
 
-		if (respCode == 401) {
-			refreshToken();
-			gConfig.readToken();
-		} else if (respCode != 200)
-			throw std::runtime_error("the server responded with: " + std::to_string(respCode));
-	} while (respCode != 200 && retries-- > 0);
+		if (!error)
+			data->resize(curl.received());
 
-	if (respCode != 200)
-		throw std::runtime_error("the server responded with: " + std::to_string(respCode));
+		done(error ? std::string() : std::move(*data), error);
+	}, priority, false);
 }
 
-size_t CGraph::request(const std::string &url, void *buf, size_t size, off_t offset)
+void CGraph::hedgedRequest(const std::string &url, size_t size, off_t offset,
+			   std::function<void(std::string data, std::exception_ptr error)> done,
+			   CScheduler::Priority priority)
 {
-	size_t ret = 0;
+	std::shared_ptr<CRace> race(new CRace());
 
-	long respCode;
+	race->done    = std::move(done);
+	race->host    = hostOf(url);
+	race->running = 1;
 
-	unsigned int retries = 3;
+	for (auto &&abort : race->abort)
+		abort = std::make_shared<std::atomic<bool>>(false);
 
-	do {
-		std::list<std::string> headers;
+	std::chrono::steady_clock::duration threshold = hedger_.threshold(race->host);
 
-		headers.emplace_back(std::string("Authorization: " + gConfig.tokenType() + " " + gConfig.token()));
-		headers.emplace_back(std::string("Range: bytes=" + std::to_string(offset) + "-" + std::to_string(offset + size - 1)));
+	this->race(race, 0, url, size, offset, priority);
 
-		respCode = 0;
+	if (threshold == std::chrono::steady_clock::duration::zero())
+		return;
 
-		ret = httpClient_.get(url, headers, buf, size, respCode);
+	try {
+		multi_.schedule(std::chrono::steady_clock::now() + threshold, [this, race, url, size, offset, priority]() {
+			{
+				std::lock_guard<std::mutex> lock(race->mutex);
 
-		if (respCode == 401) {
-			refreshToken();
-			gConfig.readToken();
-		} else if (respCode != 206 && respCode != 416)
-			throw std::runtime_error("HTTP error while downloading: " + std::to_string(respCode));
-	} while (respCode == 401 && retries-- > 0);
+				if (race->over || !hedger_.allow())
+					return;
 
-	if (respCode != 206 && respCode != 416)
-		throw std::runtime_error("HTTP error while downloading: " + std::to_string(respCode));
+				race->running++;
+			}
 
-	return ret;
+			// On the transfer engine thread, which must not wait for a
+			// connection
+			if (this->race(race, 1, url, size, offset, priority))
+				hedger_.hedged();
+			else
+				withdraw(race);
+		});
+	} catch (const std::exception &) {
+		// Shutting down
+	}
 }
 
-void CGraph::deleteRequest(const std::string &resource)
+bool CGraph::race(std::shared_ptr<CRace> race, int runner, const std::string &url, size_t size, off_t offset,
+		  CScheduler::Priority priority)
 {
-	std::string url = "https://graph.microsoft.com/v1.0" + resource;
+	std::shared_ptr<std::string> data(new std::string(size, '\0'));
+	std::shared_ptr<const std::atomic<bool>> abort(race->abort[runner]);
 
-	long respCode;
+	Prepare prepare = [url, data, offset, abort](CCurl &curl) {
+		curl.prepareGet(url, &(*data)[0], data->size(), offset);
+		curl.setAbort(abort);
+	};
 
-	unsigned int retries = 3;
+	Completion done = [this, race, runner, data](CCurl &curl, long respCode, std::exception_ptr error) {
+		if (!error && respCode != 206 && respCode != 416)
+			error = std::make_exception_ptr(CHttpError("HTTP error while downloading: ", respCode));
 
-	do {
-		std::list<std::string> headers;
+		if (!error)
+			data->resize(curl.received());
 
-		headers.emplace_back(std::string("Authorization: " + gConfig.tokenType() + " " + gConfig.token()));
+		settle(race, runner, error ? std::string() : std::move(*data), error);
+	};
 
-		respCode = 0;
+	race->started[runner] = std::chrono::steady_clock::now();
 
-		httpClient_.deleteRequest(url, headers, respCode);
+	if (runner == 0) {
+		submit(std::move(prepare), std::move(done), priority, false);
+		return true;
+	}
 
-		if (respCode == 401) {
-			refreshToken();
-			gConfig.readToken();
-		} else if (respCode != 204)
-			throw std::runtime_error("HTTP error while deleting: " + std::to_string(respCode));
-	} while (respCode == 401 && retries-- > 0);
+	try {
+		return trySubmit(std::move(prepare), std::move(done), priority, false);
+	} catch (const std::exception &) {
+		return false;
+	}
+}
 
-	if (respCode != 204)
-		throw std::runtime_error("HTTP error while deleting: " + std::to_string(respCode));
+void CGraph::settle(std::shared_ptr<CRace> race, int runner, std::string data, std::exception_ptr error)
+{
+	{
+		std::lock_guard<std::mutex> lock(race->mutex);
+
+		race->running--;
+
+		if (race->over)
+			return;
+
+		if (error) {
+			// An HTTP error tells the caller what to do about it, such as
+			// renewing an expired URL; the primary's goes first
+			bool http = httpError(error);
+			bool storedHttp = race->error && httpError(race->error);
+
+			if (!race->error || (http && !storedHttp) || (http == storedHttp && runner == 0))
+				race->error = error;
+
+			// The other one may still succeed
+			if (race->running > 0)
+				return;
+
+			error = race->error;
+		}
+
+		race->over = true;
+	}
+
+	race->abort[1 - runner]->store(true);
+
+	if (!error)
+		hedger_.measured(race->host, std::chrono::steady_clock::now() - race->started[runner], runner == 1);
+
+	race->done(std::move(data), error);
 }
 
-void CGraph::patchRequest(const std::string &resource, const std::string &body)
+void CGraph::withdraw(std::shared_ptr<CRace> race)
 {
-	std::string url = "https://graph.microsoft.com/v1.0" + resource;
+	std::exception_ptr error;
+
+	{
+		std::lock_guard<std::mutex> lock(race->mutex);
+
+		race->running--;
 
-	long respCode;
+		// Unless the primary has already failed, it answers on its own
+		if (race->over || race->running > 0)
+			return;
+
+		race->over = true;
+
+		error = race->error;
+	}
 
-	unsigned int retries = 3;
+	race->done(std::string(), error);
+}
 
-	do {
-		std::list<std::string> headers;
+std::string CGraph::request(const std::string &resource, CScheduler::Priority priority)
+{
+	return requestAsync(resource, priority).get();
+}
 
-		headers.emplace_back(std::string("Authorization: " + gConfig.tokenType() + " " + gConfig.token()));
-		headers.emplace_back(std::string("Content-Type: application/json"));
+void CGraph::request(const std::string &resource, std::ofstream &file)
+{
+	std::string url = gConfig.graphUrl() + resource;
 
-		respCode = 0;
+	const std::streampos start = file.tellp();
 
-		httpClient_.patchRequest(url, headers, body, respCode);
+	// Every attempt writes the content from the start again
+	long respCode = perform([&url, &file, start](CCurl &curl) {
+		file.clear();
+		file.seekp(start);
 
-		if (respCode == 401) {
-			refreshToken();
-			gConfig.readToken();
-		} else if (respCode != 200)
-			throw std::runtime_error("HTTP error while patching: " + std::to_string(respCode));
-	} while (respCode == 401 && retries-- > 0);
+		curl.prepareDownload(url, file);
+	}, CScheduler::PRIORITY_BACKGROUND);
 
 	if (respCode != 200)
-		throw std::runtime_error("HTTP error while patching: " + std::to_string(respCode));
+		throw std::runtime_error("the server responded with: " + std::to_string(respCode));
 }
 
-void CGraph::upload(const std::string &resource, const std::string &body)
+size_t CGraph::request(const std::string &url, void *buf, size_t size, off_t offset,
+		       CScheduler::Priority priority)
+{
+	return requestAsync(url, buf, size, offset, priority).get();
+}
+
+void CGraph::download(const std::string &url, std::ofstream &file, CScheduler::Priority priority)
+{
+	const std::streampos start = file.tellp();
+
+	// Every attempt writes the content from the start again
+	long respCode = perform([&url, &file, start](CCurl &curl) {
+		file.clear();
+		file.seekp(start);
+
+		curl.prepareDownload(url, file);
+	}, priority, false);
+
+	if (respCode != 200)
+		throw CHttpError("HTTP error while downloading: ", respCode);
+}
+
+std::future<std::string> CGraph::batchRequest(const std::string &resource)
+{
+	if (gConfig.batchWindow() == 0)
+		return requestAsync(resource);
+
+	std::shared_ptr<std::promise<std::string>> promise(new std::promise<std::string>());
+
+	batcher_.add("GET", resource, [promise](long status, std::string body, std::exception_ptr error) {
+		if (error)
+			promise->set_exception(error);
+		else if (status != 200)
+			promise->set_exception(std::make_exception_ptr(CHttpError("the server responded with: ", status, body)));
+		else
+			promise->set_value(std::move(body));
+	});
+
+	return promise->get_future();
+}
+
+std::future<void> CGraph::batchDelete(const std::string &resource)
+{
+	std::shared_ptr<std::promise<void>> promise(new std::promise<void>());
+
+	auto done = [promise](long status, std::exception_ptr error) {
+		if (error)
+			promise->set_exception(error);
+		else if (status != 204)
+			promise->set_exception(std::make_exception_ptr(CHttpError("HTTP error while deleting: ", status)));
+		else
+			promise->set_value();
+	};
+
+	if (gConfig.batchWindow() == 0) {
+		std::string url = gConfig.graphUrl() + resource;
+
+		submit([url](CCurl &curl) {
+			curl.prepareDelete(url);
+		}, [done](CCurl &, long respCode, std::exception_ptr error) {
+			done(respCode, error);
+		});
+	} else {
+		batcher_.add("DELETE", resource, [done](long status, std::string, std::exception_ptr error) {
+			done(status, error);
+		});
+	}
+
+	return promise->get_future();
+}
+
+void CGraph::deleteRequest(const std::string &resource)
 {
-	std::string url = "https://graph.microsoft.com/v1.0" + resource;
+	std::string url = gConfig.graphUrl() + resource;
 
-	long respCode;
+	long respCode = perform([&url](CCurl &curl) {
+		curl.prepareDelete(url);
+	});
 
-	unsigned int retries = 3;
+	if (respCode != 204)
+		throw std::runtime_error("HTTP error while deleting: " + std::to_string(respCode));
+}
 
-	do {
-		std::list<std::string> headers;
+void CGraph::patchRequest(const std::string &resource, const std::string &body)
+{
+	std::string url = gConfig.graphUrl() + resource;
 
-		headers.emplace_back(std::string("Authorization: " + gConfig.tokenType() + " " + gConfig.token()));
-		headers.emplace_back(std::string("Content-Type: application/octet-stream"));
+	long respCode = perform([&url, &body](CCurl &curl) {
+		curl.preparePatch(url, body);
+	});
 
-		respCode = 0;
+	if (respCode != 200)
+		throw std::runtime_error("HTTP error while patching: " + std::to_string(respCode));
+}
 
-		httpClient_.putRequest(url, headers, body, respCode);
+std::string CGraph::resourceOf(const std::string &link)
+{
+	const std::string graphUrl = gConfig.graphUrl();
+
+	if (link.compare(0, graphUrl.size(), graphUrl) != 0)
+		throw std::runtime_error("unexpected link: " + link);
+
+	return link.substr(graphUrl.size());
+}
+
+void CGraph::upload(const std::string &resource, const std::string &body)
+{
+	std::string url = gConfig.graphUrl() + resource;
 
-		if (respCode == 401) {
-			refreshToken();
-			gConfig.readToken();
-		} else if (respCode != 200)
-			throw std::runtime_error("HTTP error while uploading: " + std::to_string(respCode));
-	} while (respCode == 401 && retries-- > 0);
+	long respCode = perform([&url, &body](CCurl &curl) {
+		curl.preparePut(url, body);
+	}, CScheduler::PRIORITY_UPLOAD);
 
 	if (respCode != 200)
 		throw std::runtime_error("HTTP error while uploading: " + std::to_string(respCode));
@@ -3,21 +3,73 @@
 #ifndef __GRAPH_H_INCLUDED__
 #define __GRAPH_H_INCLUDED__
 
+#include <chrono>
+#include <exception>
 #include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include "appconfig.h"
+#include "batch.h"
 #include "curl.h"
+#include "curlmulti.h"
+#include "hedger.h"
+#include "retry.h"
+#include "scheduler.h"
+#include "token.h"
 
 namespace OneDrive {
 
+// A request which completed with an unexpected HTTP status
+class CHttpError : public std::runtime_error
+{
+public:
+	CHttpError(const std::string &what, long respCode): std::runtime_error{what + std::to_string(respCode)},
+		respCode_{respCode}
+	{
+	}
+
+	CHttpError(const std::string &what, long respCode, const std::string &body):
+		std::runtime_error{what + std::to_string(respCode) + " " + body}, respCode_{respCode}
+	{
+	}
+
+	long respCode() const
+	{
+		return respCode_;
+	}
+
+private:
+	long respCode_;
+};
+
 class CGraph
 {
 public:
-	CGraph()
+	// Configures a pooled handle for one attempt of a request; invoked again
+	// when the request is retried with a refreshed token
+	typedef std::function<void(CCurl &curl)> Prepare;
+
+	// Receives the final response code of a request or the error which
+	// prevented it from completing. Runs on the transfer engine thread.
+	typedef std::function<void(CCurl &curl, long respCode, std::exception_ptr error)> Completion;
+
+	CGraph(): retryPolicy_{gConfig.retryProfile()},
+		limiter_{gConfig.retryProfile().requestRate, gConfig.retryProfile().requestBurst},
+		breaker_{gConfig.retryProfile().breakerThreshold,
+			 std::chrono::seconds(gConfig.retryProfile().breakerOpenTime)},
+		batcher_{this, &limiter_}, scheduler_{gConfig.schedulerProfile(), gConfig.connectionPoolSize()},
+		pool_{gConfig.connectionPoolSize()}, hedger_{gConfig.hedgeProfile()}
 	{
 	}
 
 	~CGraph()
 	{
+		// Nothing may be handed to the transfer engine while it shuts down
+		batcher_.stop();
+		tokens_.stop();
 	}
 
 	CGraph(const CGraph &) = delete;
@@ -25,22 +77,121 @@ public:
 
 	void init();
 
-	std::string request(const std::string &resource);
+	std::string request(const std::string &resource,
+			    CScheduler::Priority priority = CScheduler::PRIORITY_INTERACTIVE);
 
 	void request(const std::string &resource, std::ofstream &file);
 
-	size_t request(const std::string &url, void *buf, size_t size, off_t offset);
+	// Reads a byte range of a pre-authenticated download URL
+	size_t request(const std::string &url, void *buf, size_t size, off_t offset,
+		       CScheduler::Priority priority = CScheduler::PRIORITY_READ);
+
+	// Saves the content behind a pre-authenticated download URL
+	void download(const std::string &url, std::ofstream &file,
+		      CScheduler::Priority priority = CScheduler::PRIORITY_BACKGROUND);
+
+	std::future<std::string> requestAsync(const std::string &resource,
+					      CScheduler::Priority priority = CScheduler::PRIORITY_INTERACTIVE);
+
+	// Callback flavor of requestAsync(); done runs on the transfer engine thread
+	void requestAsync(const std::string &resource, std::function<void(std::string data, std::exception_ptr error)> done,
+			  CScheduler::Priority priority = CScheduler::PRIORITY_INTERACTIVE);
+
+	std::future<size_t> requestAsync(const std::string &url, void *buf, size_t size, off_t offset,
+					 CScheduler::Priority priority = CScheduler::PRIORITY_READ);
+
+	// Callback flavor of the ranged requestAsync(), which receives the bytes
+	// read; done runs on the transfer engine thread. Both flavors are hedged
+	// when hedging is turned on, unless hedge says otherwise: the latencies
+	// are those of block reads, which much larger ranges would always run
+	// past.
+	void requestAsync(const std::string &url, size_t size, off_t offset,
+			  std::function<void(std::string data, std::exception_ptr error)> done,
+			  CScheduler::Priority priority = CScheduler::PRIORITY_READ, bool hedge = true);
 
 	void deleteRequest(const std::string &resource);
 
+	// Metadata requests which may share a $batch call with the ones issued
+	// meanwhile by other threads
+	std::future<std::string> batchRequest(const std::string &resource);
+
+	std::future<void> batchDelete(const std::string &resource);
+
+	// Sends the batched requests queued so far without waiting any longer,
+	// for callers issuing a group of requests at once
+	void flushBatch()
+	{
+		batcher_.flush();
+	}
+
 	void patchRequest(const std::string &resource, const std::string &body);
 
+	// The resource a link handed out by the server, such as the next page of
+	// a collection, points to
+	static std::string resourceOf(const std::string &link);
+
 	void upload(const std::string &resource, const std::string &body);
 
+	// Runs fn on the transfer engine thread, which is where paused
+	// transfers may be resumed
+	void post(std::function<void()> fn)
+	{
+		multi_.schedule(std::chrono::steady_clock::now(), std::move(fn));
+	}
+
+	// Throws when the circuit breaker is open. Blocks until the scheduler
+	// hands out a connection to the class of the request. Pre-authenticated
+	// URLs must be requested without the bearer token.
+	void submit(Prepare prepare, Completion done, CScheduler::Priority priority = CScheduler::PRIORITY_INTERACTIVE,
+		    bool authenticated = true);
+
 private:
-	CCurl httpClient_;
+	struct CTransfer;
+
+	// Identical ranged requests racing each other
+	struct CRace;
+
+	CTokenManager   tokens_;
+	CRetryPolicy    retryPolicy_;
+	CRateLimiter    limiter_;
+	CCircuitBreaker breaker_;
+	CBatcher        batcher_;
+	CScheduler      scheduler_;
+	CCurlPool       pool_;
+	CHedger         hedger_;
+	CCurlMulti      multi_;
+
+	// Like submit(), but gives up rather than wait for a connection
+	bool trySubmit(Prepare prepare, Completion done, CScheduler::Priority priority, bool authenticated);
+
+	void launch(CScheduler::CSlot slot, Prepare prepare, Completion done, bool authenticated);
+
+	// Has a ranged request issued a second time once it runs late
+	void hedgedRequest(const std::string &url, size_t size, off_t offset,
+			   std::function<void(std::string data, std::exception_ptr error)> done,
+			   CScheduler::Priority priority);
+
+	// Issues one of the racing requests, the first one waiting for a
+	// connection. Returns false if the other could not be issued.
+	bool race(std::shared_ptr<CRace> race, int runner, const std::string &url, size_t size, off_t offset,
+		  CScheduler::Priority priority);
+
+	// The first request to succeed answers and the other is aborted; an
+	// error only answers once both have failed, an HTTP error rather than
+	// another one and the primary's rather than the hedge's
+	void settle(std::shared_ptr<CRace> race, int runner, std::string data, std::exception_ptr error);
+
+	// A hedge which could not be issued leaves the race to the primary
+	void withdraw(std::shared_ptr<CRace> race);
+
+	void schedule(std::shared_ptr<CTransfer> transfer, std::chrono::milliseconds delay);
+
+	void start(std::shared_ptr<CTransfer> transfer);
+
+	void finish(std::shared_ptr<CTransfer> transfer, CURLcode err);
 
-	void refreshToken();
+	long perform(Prepare prepare, CScheduler::Priority priority = CScheduler::PRIORITY_INTERACTIVE,
+		     bool authenticated = true);
 };
 
 } // namespace OneDrive
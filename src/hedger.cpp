@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <algorithm>
+#include "hedger.h"
+#include "log.h"
+
+namespace OneDrive {
+
+CHedger::Clock::duration CHedger::threshold(const std::string &host)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	downloads_++;
+
+	auto i = hosts_.find(host);
+
+	if (i == hosts_.end() || i->second.latencies.size() < profile_.minSamples)
+		return Clock::duration::zero();
+
+	std::vector<double> latencies(i->second.latencies);
+	auto nth = latencies.begin() + (latencies.size() - 1) * profile_.percentile / 100;
+
+	std::nth_element(latencies.begin(), nth, latencies.end());
+
+	return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(*nth));
+}
+
+bool CHedger::allow()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	return (hedges_ + 1) * 100 <= downloads_ * profile_.maxPercent;
+}
+
+void CHedger::hedged()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	hedges_++;
+}
+
+void CHedger::measured(const std::string &host, Clock::duration latency, bool won)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (won)
+		wins_++;
+
+	auto i = hosts_.find(host);
+
+	if (i == hosts_.end()) {
+		// The download URLs seldom spread over that many hosts
+		if (hosts_.size() >= maxHosts)
+			hosts_.clear();
+
+		i = hosts_.emplace(host, CHost{std::vector<double>(), 0}).first;
+	}
+
+	CHost &entry = i->second;
+	double sample = std::chrono::duration<double>(latency).count();
+
+	if (entry.latencies.size() < window)
+		entry.latencies.push_back(sample);
+	else
+		entry.latencies[entry.next] = sample;
+
+	entry.next = (entry.next + 1) % window;
+
+	logStats(Clock::now());
+}
+
+void CHedger::logStats(Clock::time_point now)
+{
+	if (now - lastStatsTime_ < std::chrono::seconds(60) || downloads_ == lastDownloads_)
+		return;
+
+	LOG_INFO("hedging: " << downloads_ << " downloads, " << hedges_ << " hedged, " << wins_ << " won by the hedge");
+
+	lastDownloads_ = downloads_;
+	lastStatsTime_ = now;
+}
+
+} // namespace OneDrive
@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef __HEDGER_H_INCLUDED__
+#define __HEDGER_H_INCLUDED__
+
+#include <stddef.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "appconfig.h"
+
+namespace OneDrive {
+
+// Decides when a ranged download is worth duplicating on another
+// connection: once it has been running longer than the configured
+// percentile of the latencies lately measured for its host, as long as the
+// duplicates, the hedges, stay within a small share of the downloads.
+class CHedger
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	explicit CHedger(const CHedgeProfile &profile): profile_(profile)
+	{
+	}
+
+	~CHedger()
+	{
+	}
+
+	CHedger(const CHedger &) = delete;
+	CHedger & operator=(const CHedger &) = delete;
+
+	bool enabled() const
+	{
+		return profile_.percentile > 0;
+	}
+
+	// Notes a download from the host and returns how long it may run before
+	// it is hedged; zero if it is not to be, too little being known of the
+	// host yet
+	Clock::duration threshold(const std::string &host);
+
+	// Whether one more hedge stays within the allowed share
+	bool allow();
+
+	// A hedge was issued
+	void hedged();
+
+	// A download from the host succeeded after that long; won tells a hedge
+	// which came in first
+	void measured(const std::string &host, Clock::duration latency, bool won);
+
+private:
+	// Latencies kept per host, and hosts kept track of
+	static const size_t window = 256;
+	static const size_t maxHosts = 64;
+
+	struct CHost {
+		std::vector<double> latencies; // s, a ring of the latest ones
+		size_t              next;
+	};
+
+	// Reports the counters, at most once a minute
+	void logStats(Clock::time_point now);
+
+	CHedgeProfile                          profile_;
+	std::mutex                             mutex_;
+	std::unordered_map<std::string, CHost> hosts_;
+	unsigned long                          downloads_{};
+	unsigned long                          hedges_{};
+	unsigned long                          wins_{};   // hedges which came in first
+	unsigned long                          lastDownloads_{};
+	Clock::time_point                      lastStatsTime_{Clock::now()};
+};
+
+} // namespace OneDrive
+
+#endif // __HEDGER_H_INCLUDED__
@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "inodetable.h"
+
+namespace OneDrive {
+
+const uint64_t CInodeTable::rootIno;
+
+uint64_t CInodeTable::lookup(const std::string &id)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (id == rootId_)
+		return rootIno;
+
+	auto i = ids_.find(id);
+
+	if (i != ids_.end()) {
+		inodes_[i->second].nlookup++;
+		return i->second;
+	}
+
+	uint64_t ino = next_++;
+
+	inodes_[ino] = CInode{id, 1};
+	ids_[id] = ino;
+
+	return ino;
+}
+
+void CInodeTable::forget(uint64_t ino, uint64_t nlookup)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto i = inodes_.find(ino);
+
+	if (i == inodes_.end())
+		return;
+
+	if (i->second.nlookup > nlookup) {
+		i->second.nlookup -= nlookup;
+		return;
+	}
+
+	ids_.erase(i->second.id);
+	inodes_.erase(i);
+}
+
+uint64_t CInodeTable::find(const std::string &id) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (id == rootId_)
+		return rootIno;
+
+	auto i = ids_.find(id);
+
+	return i != ids_.end() ? i->second : 0;
+}
+
+std::string CInodeTable::id(uint64_t ino) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (ino == rootIno)
+		return rootId_;
+
+	auto i = inodes_.find(ino);
+
+	return i != inodes_.end() ? i->second.id : std::string();
+}
+
+} // namespace OneDrive
@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef __INODETABLE_H_INCLUDED__
+#define __INODETABLE_H_INCLUDED__
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace OneDrive {
+
+// Gives the items the kernel knows about stable inode numbers. An item
+// keeps its number for as long as the kernel holds lookups on it; the root
+// is always inode 1. Item ids never change, renames and moves included, so
+// the numbers follow the items around.
+class CInodeTable
+{
+public:
+	static const uint64_t rootIno = 1;
+
+	CInodeTable()
+	{
+	}
+
+	~CInodeTable()
+	{
+	}
+
+	CInodeTable(const CInodeTable &) = delete;
+	CInodeTable & operator=(const CInodeTable &) = delete;
+
+	void setRootId(const std::string &id)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		rootId_ = id;
+	}
+
+	// The inode number of the item, with one more lookup held by the kernel
+	uint64_t lookup(const std::string &id);
+
+	// The kernel dropped nlookup of its lookups
+	void forget(uint64_t ino, uint64_t nlookup);
+
+	// The inode number of the item if the kernel knows it, 0 otherwise
+	uint64_t find(const std::string &id) const;
+
+	// The id of the item behind the inode number, empty if there is none
+	std::string id(uint64_t ino) const;
+
+private:
+	struct CInode {
+		std::string id;
+		uint64_t    nlookup;
+	};
+
+	mutable std::mutex                        mutex_;
+	std::string                               rootId_;
+	std::unordered_map<uint64_t, CInode>      inodes_;
+	std::unordered_map<std::string, uint64_t> ids_;
+	uint64_t                                  next_{rootIno + 1};
+};
+
+} // namespace OneDrive
+
+#endif // __INODETABLE_H_INCLUDED__
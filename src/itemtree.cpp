@@ -0,0 +1,640 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <deque>
+#include <map>
+#include "itemtree.h"
+
+namespace OneDrive {
+
+void CItemTree::setRoot(const CDriveItem &root)
+{
+	// A different drive, nothing cached is of any use
+	if (!rootId_.empty() && rootId_ != root.id())
+		erase(rootId_);
+
+	if (snapshot_ && snapshot_->id(snapshot_->root()) != root.id())
+		detachSnapshot();
+
+	auto i = nodes_.find(root.id());
+
+	if (i == nodes_.end()) {
+		i = nodes_.emplace(root.id(), CNode()).first;
+
+		lru_.push_front(root.id());
+		i->second.lru = lru_.begin();
+		i->second.snap = snapshotIndex(root.id());
+	}
+
+	rootId_ = root.id();
+
+	i->second.item = root;
+	i->second.item.setCacheTime(std::time(nullptr));
+
+	touch(i->second);
+}
+
+void CItemTree::attach(std::unique_ptr<CSnapshot> snapshot)
+{
+	if (snapshot->root() == CSnapshot::none)
+		return;
+
+	snapshot_ = std::move(snapshot);
+
+	changed_.clear();
+	dirty_.clear();
+
+	setRoot(snapshot_->item(snapshot_->root()));
+}
+
+const size_t CItemTree::maxMissing;
+
+size_t CItemTree::resolve(const std::string &fromId, const std::vector<std::string> &components, CDriveItem &driveItem,
+			  bool &missing)
+{
+	missing = false;
+
+	auto i = nodes_.find(fromId);
+
+	if (i == nodes_.end()) {
+		driveItem = CDriveItem();
+		return 0;
+	}
+
+	time_t now = std::time(nullptr);
+	CNode *node = &i->second;
+	size_t resolved = 0;
+
+	for (; resolved < components.size(); resolved++) {
+		auto child = node->children.find(components[resolved]);
+
+		if (child == node->children.end()) {
+			bool absent = false;
+			CNode *next = hydrate(*node, components[resolved], absent);
+
+			if (!next) {
+				missing = absent || knownMissing(*node, components[resolved], now);
+				break;
+			}
+
+			node = next;
+			continue;
+		}
+
+		auto j = nodes_.find(child->second);
+
+		if (j == nodes_.end() || !usable(j->second, now))
+			break;
+
+		node = &j->second;
+	}
+
+	touch(*node);
+
+	driveItem = node->item;
+
+	return resolved;
+}
+
+bool CItemTree::find(const std::string &id, CDriveItem &driveItem)
+{
+	auto i = nodes_.find(id);
+
+	if (i == nodes_.end() || !usable(i->second, std::time(nullptr)))
+		return false;
+
+	touch(i->second);
+
+	driveItem = i->second.item;
+
+	return true;
+}
+
+bool CItemTree::children(const std::string &parentId, std::list<CDriveItem> &children)
+{
+	auto i = nodes_.find(parentId);
+
+	if (i == nodes_.end())
+		return false;
+
+	time_t now = std::time(nullptr);
+	const CNode &node = i->second;
+	bool stale = node.listed > 0 && node.listed <= now && now - node.listed <= ttl_ + maxStale_;
+
+	if (!listed(node, now) && stale) {
+		staleListings_.insert(parentId);
+	} else if (!listed(node, now)) {
+		if (!trusted(node) || !snapshot_->listed(node.snap))
+			return false;
+
+		std::vector<uint32_t> indexes;
+
+		snapshot_->children(node.snap, indexes);
+
+		std::list<CDriveItem> items;
+
+		for (auto &&index : indexes)
+			items.push_back(snapshotItem(index));
+
+		setChildren(parentId, items);
+
+		for (auto &&index : indexes) {
+			auto j = nodes_.find(snapshot_->id(index));
+
+			if (j != nodes_.end())
+				j->second.snap = index;
+		}
+
+		// Some of the children may not have fitted
+		i = nodes_.find(parentId);
+
+		if (i == nodes_.end() || i->second.listed == 0)
+			return false;
+	}
+
+	std::list<CDriveItem> items;
+
+	for (auto &&child : i->second.children) {
+		auto j = nodes_.find(child.second);
+
+		if (j == nodes_.end())
+			return false;
+
+		items.push_back(j->second.item);
+	}
+
+	touch(i->second);
+
+	children.splice(children.end(), items);
+
+	return true;
+}
+
+void CItemTree::setChildren(const std::string &parentId, const std::list<CDriveItem> &children)
+{
+	auto i = nodes_.find(parentId);
+
+	if (i == nodes_.end())
+		return;
+
+	time_t now = std::time(nullptr);
+	CNode &parent = i->second;
+	std::unordered_map<std::string, std::string> names;
+	std::unordered_set<std::string> ids;
+
+	for (auto &&child : children) {
+		auto j = nodes_.find(child.id());
+
+		if (j == nodes_.end()) {
+			j = nodes_.emplace(child.id(), CNode()).first;
+
+			lru_.push_front(child.id());
+			j->second.lru = lru_.begin();
+			j->second.snap = snapshotIndex(child.id());
+		} else if (j->second.parentId != parentId) {
+			// Moved here from another folder
+			detach(j->second);
+		}
+
+		j->second.item     = child;
+		j->second.parentId = parentId;
+		j->second.item.setCacheTime(now);
+
+		names[child.name()] = child.id();
+		ids.insert(child.id());
+	}
+
+	std::vector<std::string> gone;
+
+	for (auto &&child : parent.children)
+		if (ids.find(child.second) == ids.end())
+			gone.push_back(child.second);
+
+	if (names != parent.children)
+		parent.version++;
+
+	// Renamed children only change their entry in the folder
+	parent.children.swap(names);
+
+	parent.listed = now;
+
+	for (auto &&id : gone)
+		erase(id);
+
+	touch(parent);
+
+	evict();
+}
+
+void CItemTree::insert(const std::string &parentId, const CDriveItem &driveItem)
+{
+	auto i = nodes_.find(parentId);
+
+	if (i == nodes_.end())
+		return;
+
+	CNode &parent = i->second;
+
+	auto child = parent.children.find(driveItem.name());
+
+	// Another item went by that name before
+	if (child != parent.children.end() && child->second != driveItem.id())
+		erase(std::string(child->second));
+
+	auto j = nodes_.find(driveItem.id());
+
+	if (j == nodes_.end()) {
+		j = nodes_.emplace(driveItem.id(), CNode()).first;
+
+		lru_.push_front(driveItem.id());
+		j->second.lru = lru_.begin();
+		j->second.snap = snapshotIndex(driveItem.id());
+	} else if (j->second.parentId != parentId || j->second.item.name() != driveItem.name()) {
+		// Moved or renamed
+		detach(j->second);
+	}
+
+	j->second.item     = driveItem;
+	j->second.parentId = parentId;
+	j->second.item.setCacheTime(std::time(nullptr));
+
+	std::string &id = parent.children[driveItem.name()];
+
+	// Learning about a name does not change the folder, replacing one does
+	if (!id.empty() && id != driveItem.id())
+		parent.version++;
+
+	id = driveItem.id();
+
+	touch(j->second);
+
+	evict();
+}
+
+void CItemTree::addMissing(const std::string &parentId, const std::string &name)
+{
+	auto i = nodes_.find(parentId);
+
+	if (i == nodes_.end())
+		return;
+
+	if (i->second.missing.size() >= maxMissing)
+		i->second.missing.clear();
+
+	i->second.missing[name] = CMissing{i->second.version, std::time(nullptr)};
+}
+
+void CItemTree::update(const std::string &parentId, const CDriveItem &driveItem)
+{
+	changes_++;
+
+	changed(parentId, driveItem);
+
+	if (nodes_.find(parentId) != nodes_.end())
+		insert(parentId, driveItem);
+	else
+		erase(driveItem.id());
+}
+
+void CItemTree::remove(const std::string &id)
+{
+	changes_++;
+
+	uint32_t index = snapshot_ ? snapshot_->find(id) : CSnapshot::none;
+
+	if (index != CSnapshot::none && snapshot_->parent(index) != CSnapshot::none)
+		dirty_.insert(snapshot_->id(snapshot_->parent(index)));
+
+	changed_.erase(id);
+
+	erase(id);
+}
+
+void CItemTree::exportTo(CExport &copy) const
+{
+	copy.rootId_   = rootId_;
+	copy.snapshot_ = snapshot_;
+	copy.changed_  = changed_;
+	copy.dirty_    = dirty_;
+
+	copy.nodes_.reserve(nodes_.size());
+
+	for (auto &&i : nodes_) {
+		CExport::CNode &node = copy.nodes_[i.first];
+
+		node.item   = i.second.item;
+		node.listed = i.second.listed > 0;
+		node.snap   = trusted(i.second) ? i.second.snap : CSnapshot::none;
+
+		node.children.assign(i.second.children.begin(), i.second.children.end());
+	}
+}
+
+void CItemTree::CExport::entries(std::vector<CSnapshot::CEntry> &entries) const
+{
+	auto root = nodes_.find(rootId_);
+
+	if (root == nodes_.end())
+		return;
+
+	// A folder still to be written out, from the tree, the snapshot or both
+	struct CSource {
+		uint32_t     entry;
+		const CNode *node;
+		uint32_t     snap;
+	};
+
+	std::deque<CSource> pending;
+
+	entries.push_back(CSnapshot::CEntry{root->second.item, CSnapshot::none, false});
+	pending.push_back(CSource{0, &root->second, root->second.snap});
+
+	// Breadth first, so that the children of a folder end up next to each
+	// other
+	while (!pending.empty()) {
+		CSource source = pending.front();
+
+		pending.pop_front();
+
+		std::map<std::string, CSource> children;
+		bool complete = false;
+
+		if (source.node) {
+			for (auto &&child : source.node->children) {
+				auto i = nodes_.find(child.second);
+
+				if (i != nodes_.end())
+					children[child.first] = CSource{0, &i->second, i->second.snap};
+			}
+
+			complete = source.node->listed;
+		}
+
+		if (!complete && source.snap != CSnapshot::none) {
+			std::vector<uint32_t> indexes;
+
+			snapshot_->children(source.snap, indexes);
+
+			for (auto &&index : indexes) {
+				std::string id(snapshot_->id(index));
+
+				// Cached items are placed where the tree has them
+				if (nodes_.find(id) != nodes_.end())
+					continue;
+
+				children.emplace(snapshotItem(index).name(), CSource{0, nullptr, index});
+			}
+
+			complete = snapshot_->listed(source.snap);
+		}
+
+		entries[source.entry].listed = complete;
+
+		for (auto &&child : children) {
+			CSource next = child.second;
+			CDriveItem driveItem(next.node ? next.node->item : snapshotItem(next.snap));
+
+			next.entry = entries.size();
+
+			entries.push_back(CSnapshot::CEntry{driveItem, source.entry, false});
+
+			if (driveItem.type() != CDriveItem::DRIVE_ITEM_FOLDER)
+				continue;
+
+			// The saved children are only of use while still current
+			if (next.snap != CSnapshot::none && dirty_.find(driveItem.id()) != dirty_.end())
+				next.snap = CSnapshot::none;
+
+			pending.push_back(next);
+		}
+	}
+}
+
+CDriveItem CItemTree::CExport::snapshotItem(uint32_t index) const
+{
+	auto i = changed_.find(snapshot_->id(index));
+
+	return i != changed_.end() ? i->second : snapshot_->item(index);
+}
+
+bool CItemTree::fresh(const CNode &node, time_t now) const
+{
+	if (now <= syncedUntil_ && node.item.cacheTime() > syncedSince_)
+		return true;
+
+	return node.item.cacheTime() <= now && now - node.item.cacheTime() <= ttl_;
+}
+
+bool CItemTree::usable(const CNode &node, time_t now)
+{
+	if (fresh(node, now))
+		return true;
+
+	if (node.item.cacheTime() > now || now - node.item.cacheTime() > ttl_ + maxStale_)
+		return false;
+
+	staleItems_.insert(node.item.id());
+
+	return true;
+}
+
+void CItemTree::takeStale(std::vector<std::string> &items, std::vector<std::string> &listings)
+{
+	items.assign(staleItems_.begin(), staleItems_.end());
+	listings.assign(staleListings_.begin(), staleListings_.end());
+
+	staleItems_.clear();
+	staleListings_.clear();
+}
+
+bool CItemTree::listed(const CNode &node, time_t now) const
+{
+	if (node.listed == 0)
+		return false;
+
+	return (now <= syncedUntil_ && node.listed > syncedSince_) || (node.listed <= now && now - node.listed <= ttl_);
+}
+
+bool CItemTree::trusted(const CNode &node) const
+{
+	return snapshot_ && node.snap != CSnapshot::none && dirty_.find(node.item.id()) == dirty_.end();
+}
+
+uint32_t CItemTree::snapshotIndex(const std::string &id) const
+{
+	return snapshot_ ? snapshot_->find(id) : CSnapshot::none;
+}
+
+CDriveItem CItemTree::snapshotItem(uint32_t index) const
+{
+	auto i = changed_.find(snapshot_->id(index));
+
+	return i != changed_.end() ? i->second : snapshot_->item(index);
+}
+
+CItemTree::CNode *CItemTree::hydrate(CNode &parent, const std::string &name, bool &absent)
+{
+	if (!trusted(parent))
+		return nullptr;
+
+	uint32_t index = snapshot_->child(parent.snap, name);
+
+	if (index == CSnapshot::none) {
+		absent = snapshot_->listed(parent.snap);
+		return nullptr;
+	}
+
+	CDriveItem driveItem(snapshotItem(index));
+
+	// Cached elsewhere, so it has moved since
+	if (nodes_.find(driveItem.id()) != nodes_.end())
+		return nullptr;
+
+	insert(parent.item.id(), driveItem);
+
+	auto i = nodes_.find(driveItem.id());
+
+	if (i == nodes_.end())
+		return nullptr;
+
+	i->second.snap = index;
+
+	return &i->second;
+}
+
+void CItemTree::changed(const std::string &parentId, const CDriveItem &driveItem)
+{
+	if (!snapshot_)
+		return;
+
+	uint32_t index = snapshot_->find(driveItem.id());
+
+	if (index == CSnapshot::none) {
+		dirty_.insert(parentId);
+		return;
+	}
+
+	changed_[driveItem.id()] = driveItem;
+
+	uint32_t parent = snapshot_->parent(index);
+
+	// Only moves and renames change how the folders are listed
+	if (parent == CSnapshot::none || snapshot_->id(parent) != parentId ||
+	    snapshot_->item(index).name() != driveItem.name()) {
+		if (parent != CSnapshot::none)
+			dirty_.insert(snapshot_->id(parent));
+
+		dirty_.insert(parentId);
+	}
+}
+
+void CItemTree::detachSnapshot()
+{
+	snapshot_.reset();
+
+	changed_.clear();
+	dirty_.clear();
+
+	for (auto &&node : nodes_)
+		node.second.snap = CSnapshot::none;
+}
+
+bool CItemTree::knownMissing(CNode &node, const std::string &name, time_t now)
+{
+	// A complete listing without the name is as good as the listed items
+	if (listed(node, now))
+		return true;
+
+	auto i = node.missing.find(name);
+
+	if (i == node.missing.end())
+		return false;
+
+	bool synced = now <= syncedUntil_ && i->second.time > syncedSince_;
+	bool expired = !synced && (i->second.time > now || now - i->second.time > negativeTtl_);
+
+	if (i->second.version != node.version || expired) {
+		node.missing.erase(i);
+		return false;
+	}
+
+	return true;
+}
+
+void CItemTree::touch(CNode &node)
+{
+	CNode *current = &node;
+
+	for (;;) {
+		lru_.splice(lru_.begin(), lru_, current->lru);
+
+		auto i = nodes_.find(current->parentId);
+
+		if (current->parentId.empty() || i == nodes_.end())
+			break;
+
+		current = &i->second;
+	}
+}
+
+void CItemTree::detach(CNode &node)
+{
+	auto i = nodes_.find(node.parentId);
+
+	if (!node.parentId.empty() && i != nodes_.end()) {
+		auto child = i->second.children.find(node.item.name());
+
+		if (child != i->second.children.end() && child->second == node.item.id()) {
+			i->second.children.erase(child);
+			i->second.version++;
+		}
+	}
+
+	node.parentId.clear();
+}
+
+void CItemTree::erase(const std::string &id)
+{
+	auto i = nodes_.find(id);
+
+	if (i == nodes_.end())
+		return;
+
+	detach(i->second);
+
+	std::vector<std::string> pending(1, id);
+
+	if (id == rootId_)
+		rootId_.clear();
+
+	while (!pending.empty()) {
+		auto j = nodes_.find(pending.back());
+
+		pending.pop_back();
+
+		if (j == nodes_.end())
+			continue;
+
+		for (auto &&child : j->second.children)
+			pending.push_back(child.second);
+
+		lru_.erase(j->second.lru);
+
+		nodes_.erase(j);
+	}
+}
+
+void CItemTree::evict()
+{
+	while (nodes_.size() > maxItems_ && lru_.back() != rootId_) {
+		std::string id(lru_.back());
+		auto i = nodes_.find(nodes_[id].parentId);
+
+		// The folder is no longer completely cached
+		if (i != nodes_.end())
+			i->second.listed = 0;
+
+		erase(id);
+	}
+}
+
+} // namespace OneDrive
@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef __ITEMTREE_H_INCLUDED__
+#define __ITEMTREE_H_INCLUDED__
+
+#include <ctime>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "driveitem.h"
+#include "snapshot.h"
+
+namespace OneDrive {
+
+// The cached part of the drive: items keyed by id, each folder mapping the
+// names of its children to their ids. Paths are resolved one component at
+// a time from the root, so renaming a folder touches a single entry.
+// Memory is bounded by evicting the least recently used items; a folder is
+// always more recent than anything below it, so eviction starts with the
+// leaves. A name is known to be missing from a folder while a complete
+// listing of the folder is fresh, or for a while after the server said so,
+// as long as the names in the folder have not changed since. While the
+// changes made on the server are being applied as they happen, nothing
+// fetched since they are followed expires. Whatever is not cached may
+// still be found in the snapshot saved by a previous mount, as long as the
+// server has not reported a change to it since. Items and listings past
+// their ttl are still served for up to maxStale seconds, and noted down
+// for the caller to have them refreshed. Not synchronized.
+class CItemTree
+{
+public:
+	CItemTree(size_t maxItems, time_t ttl, time_t maxStale, time_t negativeTtl): maxItems_{maxItems},
+		ttl_{ttl}, maxStale_{maxStale}, negativeTtl_{negativeTtl}
+	{
+	}
+
+	~CItemTree()
+	{
+	}
+
+	CItemTree(const CItemTree &) = delete;
+	CItemTree & operator=(const CItemTree &) = delete;
+
+	void setRoot(const CDriveItem &root);
+
+	// Falls back on a snapshot for what is not cached. Every change the
+	// server reports afterwards must go through update() or remove().
+	void attach(std::unique_ptr<CSnapshot> snapshot);
+
+	// Resolves as many leading components as possible with usable items
+	// and returns how many. driveItem is the last item resolved, which is left
+	// unknown if not even the root is cached. missing tells whether the
+	// next component is known not to exist.
+	size_t resolve(const std::vector<std::string> &components, CDriveItem &driveItem, bool &missing)
+	{
+		return resolve(rootId_, components, driveItem, missing);
+	}
+
+	// Same, from the folder by that id rather than the root
+	size_t resolve(const std::string &fromId, const std::vector<std::string> &components, CDriveItem &driveItem,
+		       bool &missing);
+
+	// The item by that id, if cached and usable
+	bool find(const std::string &id, CDriveItem &driveItem);
+
+	// The children of a folder, if a complete listing is at hand
+	bool children(const std::string &parentId, std::list<CDriveItem> &children);
+
+	// Replaces the cached children of a folder with a complete listing
+	void setChildren(const std::string &parentId, const std::list<CDriveItem> &children);
+
+	// Adds or refreshes a single child of a folder, leaving its siblings alone
+	void insert(const std::string &parentId, const CDriveItem &driveItem);
+
+	// Records that the server found no item by that name in the folder
+	void addMissing(const std::string &parentId, const std::string &name);
+
+	// An item changed on the server: it is refreshed if its folder is
+	// cached and forgotten otherwise
+	void update(const std::string &parentId, const CDriveItem &driveItem);
+
+	// Forgets an item and everything below it
+	void remove(const std::string &id);
+
+	void clear()
+	{
+		erase(std::string(rootId_));
+		detachSnapshot();
+	}
+
+	// What is cached, and what is still current in the attached snapshot,
+	// copied out so that it can be flattened without holding whatever
+	// guards the tree
+	class CExport
+	{
+	public:
+		CExport()
+		{
+		}
+
+		CExport(const CExport &) = delete;
+		CExport & operator=(const CExport &) = delete;
+
+		// Flattens the copy into entries for a new snapshot
+		void entries(std::vector<CSnapshot::CEntry> &entries) const;
+
+	private:
+		friend class CItemTree;
+
+		struct CNode {
+			CDriveItem                                       item;
+			std::vector<std::pair<std::string, std::string>> children; // name, id
+			bool                                             listed;
+			uint32_t                                         snap;
+		};
+
+		CDriveItem snapshotItem(uint32_t index) const;
+
+		std::string                                 rootId_;
+		std::unordered_map<std::string, CNode>      nodes_;
+		std::shared_ptr<const CSnapshot>            snapshot_;
+		std::unordered_map<std::string, CDriveItem> changed_;
+		std::unordered_set<std::string>             dirty_;
+	};
+
+	void exportTo(CExport &copy) const;
+
+	// The cached items fetched after since reflect every change made on the
+	// server up to until, and are trusted as such until then. Those fetched
+	// before may have missed changes made ahead of the first delta token.
+	void setSynced(time_t since, time_t until)
+	{
+		syncedSince_ = since;
+		syncedUntil_ = until;
+	}
+
+	// Counts the changes reported by the server, so that what was fetched
+	// meanwhile can be told apart and left out rather than overwrite them
+	unsigned long changes() const
+	{
+		return changes_;
+	}
+
+	size_t size() const
+	{
+		return nodes_.size();
+	}
+
+	// Hands over the ids of the items and of the folder listings served
+	// stale since the last call
+	void takeStale(std::vector<std::string> &items, std::vector<std::string> &listings);
+
+private:
+	struct CMissing {
+		unsigned long version; // of the folder when the name was found missing
+		time_t        time;
+	};
+
+	struct CNode {
+		CDriveItem                                   item;
+		std::string                                  parentId;
+		std::unordered_map<std::string, std::string> children;  // name -> id
+		time_t                                       listed{};  // last complete listing, 0 if none
+		unsigned long                                version{}; // bumped when the names change
+		std::unordered_map<std::string, CMissing>    missing;
+		uint32_t                                     snap{CSnapshot::none}; // index in the snapshot
+		std::list<std::string>::iterator             lru;
+	};
+
+	// The most names remembered as missing from a single folder
+	static const size_t maxMissing = 256;
+
+	bool fresh(const CNode &node, time_t now) const;
+
+	// Fresh, or stale but not too much, in which case it is noted down
+	bool usable(const CNode &node, time_t now);
+
+	bool listed(const CNode &node, time_t now) const;
+
+	// Whether the snapshot still lists the children of the folder
+	bool trusted(const CNode &node) const;
+
+	uint32_t snapshotIndex(const std::string &id) const;
+
+	CDriveItem snapshotItem(uint32_t index) const;
+
+	// Adds the child by that name from the snapshot. absent tells whether
+	// the snapshot knows the name does not exist.
+	CNode *hydrate(CNode &parent, const std::string &name, bool &absent);
+
+	// The server reported a change to the item
+	void changed(const std::string &parentId, const CDriveItem &driveItem);
+
+	void detachSnapshot();
+
+	bool knownMissing(CNode &node, const std::string &name, time_t now);
+
+	// Moves the node and its ancestors to the front of the LRU list
+	void touch(CNode &node);
+
+	void detach(CNode &node);
+
+	void erase(const std::string &id);
+
+	void evict();
+
+	size_t                                 maxItems_;
+	time_t                                 ttl_;
+	time_t                                 maxStale_;
+	time_t                                 negativeTtl_;
+	time_t                                 syncedSince_{};
+	time_t                                 syncedUntil_{};
+	unsigned long                          changes_{};
+	std::string                            rootId_;
+	std::unordered_map<std::string, CNode> nodes_;
+	std::list<std::string>                 lru_; // most recently used first
+
+	std::shared_ptr<const CSnapshot>            snapshot_; // shared with the exports taken
+	std::unordered_map<std::string, CDriveItem> changed_; // newer than in the snapshot
+	std::unordered_set<std::string>             dirty_;   // folders listed differently now
+
+	std::unordered_set<std::string> staleItems_;
+	std::unordered_set<std::string> staleListings_;
+};
+
+} // namespace OneDrive
+
+#endif // __ITEMTREE_H_INCLUDED__
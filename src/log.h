@@ -5,6 +5,7 @@
 
 #include <ctime>
 #include <fstream>
+#include <mutex>
 #include <sstream>
 #include "appconfig.h"
 
@@ -31,26 +32,35 @@ public:
 
 	void debug(const std::string &s)
 	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
 		f_ << timestamp() << " DEBUG: " << s << std::endl;
 	}
 
 	void info(const std::string &s)
 	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
 		f_ << timestamp() << " INFO: " << s << std::endl;
 	}
 
 	void warn(const std::string &s)
 	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
 		f_ << timestamp() << " WARN: " << s << std::endl;
 	}
 
 	void error(const std::string &s)
 	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
 		f_ << timestamp() << " ERROR: " << s << std::endl;
 	}
 
 private:
 	std::fstream f_;
+	std::mutex   mutex_;
 
 	// rfc3339, rfc5424
 	std::string timestamp() const
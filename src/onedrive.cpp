@@ -1,10 +1,15 @@
 // SPDX-License-Identifier: GPL-2.0
 
 #include <ctime>
+#include <cctype>
+#include <cstring>
 #include <json/json.h>
+#include <algorithm>
 #include <chrono>
+#include <future>
 #include <iostream>
 #include <sstream>
+#include <vector>
 #include "onedrive.h"
 #include "log.h"
 #include "utils.h"
@@ -45,38 +50,109 @@ OneDrive::CDriveItem driveItemFromJson(const Json::Value &node)
 	if (!!node["file"] && !!node["file"]["hashes"] && !!node["file"]["hashes"]["sha1Hash"])
 		driveItem.setHash(node["file"]["hashes"]["sha1Hash"].asString());
 
+	// Not every listing carries the cTag; the eTag changes at least as often
+	driveItem.setCTag(!!node["cTag"] ? node["cTag"].asString() : node["eTag"].asString());
+
 	return driveItem;
 }
 
+// All that is used of the items in a listing; the download URLs are fetched
+// as the files are opened
+const char childFields[] = "id,name,size,file,folder,createdDateTime,lastModifiedDateTime,eTag,cTag";
+
+// The sequential reads after which a file is streamed; fewer do not pay for
+// holding a connection
+const unsigned int streamAfter = 4;
+
+// How long a stream may go unread before another file may take its place
+const std::chrono::seconds streamIdle(10);
+
+// Graph path addressing takes percent-encoded path segments
+std::string pathEscape(const std::string &s)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	std::string escaped;
+
+	for (unsigned char c : s) {
+		if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+			escaped += c;
+		} else {
+			escaped += '%';
+			escaped += hex[c >> 4];
+			escaped += hex[c & 15];
+		}
+	}
+
+	return escaped;
+}
+
 } // anonymous namespace
 
 namespace OneDrive {
 
+const time_t COneDrive::cacheTtl;
+
 CDrive COneDrive::drive()
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	CDrive drive;
+	bool stale;
 
-	std::stringstream data;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
 
-	data << graph_.request("/me/drive");
+		time_t now = std::time(nullptr);
+		bool fetched = driveTime_ > 0 && driveTime_ <= now;
 
-	Json::Value root;
+		if (fetched && now - driveTime_ <= cacheTtl)
+			return drive_;
 
-	data >> root;
+		drive = drive_;
+		stale = fetched && now - driveTime_ <= cacheTtl + static_cast<time_t>(gConfig.maxStaleness());
+	}
+
+	if (stale) {
+		refreshDrive();
+		return drive;
+	}
 
-	CDrive drive(driveFromJson(root));
+	// Nothing to answer with, so it is not left waiting behind the
+	// background refreshes
+	return fetchDrive(CScheduler::PRIORITY_INTERACTIVE);
+}
 
-	drive.setOwner(ownerFromJson(root));
+bool COneDrive::refreshDrive()
+{
+	return refresher_.schedule("drive", [this]() { fetchDrive(CScheduler::PRIORITY_BACKGROUND); });
+}
 
-	drive.setQuota(quotaFromJson(root));
+CDrive COneDrive::fetchDrive(CScheduler::Priority priority)
+{
+	return driveFlights_.run("drive", [this, priority]() {
+		std::stringstream data;
 
-	return drive;
+		data << metadataRequest("/me/drive", priority).get();
+
+		Json::Value root;
+
+		data >> root;
+
+		CDrive drive(driveFromJson(root));
+
+		drive.setOwner(ownerFromJson(root));
+
+		drive.setQuota(quotaFromJson(root));
+
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		drive_     = drive;
+		driveTime_ = std::time(nullptr);
+
+		return drive;
+	});
 }
 
 void COneDrive::drives(std::list<CDrive> &drives)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	std::stringstream data;
 
 	data << graph_.request("/me/drives");
@@ -100,102 +176,555 @@ void COneDrive::drives(std::list<CDrive> &drives)
 
 void COneDrive::listChildren(std::list<CDriveItem> &driveItems)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	listPages("/me/drive/root/children", [](const CDriveItem &) { return true; }, driveItems);
+}
 
-	std::stringstream data;
+void COneDrive::listChildren(const CDriveItem &driveItem, std::list<CDriveItem> &driveItems)
+{
+	listChildren(driveItem, [&driveItems](const CDriveItem &child) {
+		driveItems.push_back(child);
+		return true;
+	});
+}
 
-	data << graph_.request("/me/drive/root/children");
+void COneDrive::listChildren(const CDriveItem &driveItem, const Visitor &visit)
+{
+	std::list<CDriveItem> children;
+	bool cached;
 
-	Json::Value root;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
 
-	data >> root;
+		cached = tree_.children(driveItem.id(), children);
+	}
 
-	for (unsigned int i = 0; i < root["value"].size(); i++) {
-		const Json::Value node(root["value"][i]);
+	revalidate();
 
-		CDriveItem driveItem(driveItemFromJson(node));
+	if (cached) {
+		for (auto &&child : children)
+			if (!visit(child))
+				break;
 
-		if (driveItem.type() == CDriveItem::DRIVE_ITEM_FILE ||
-		    driveItem.type() == CDriveItem::DRIVE_ITEM_FOLDER)
-			driveItems.push_back(driveItem);
+		return;
+	}
+
+	for (;;) {
+		bool listed = false;
+
+		// Whoever lists the folder meanwhile is handed this listing once
+		// it is complete
+		std::shared_ptr<const std::list<CDriveItem>> listing = listFlights_.run("children:" + driveItem.id(), [&]() {
+			listed = true;
+
+			unsigned long since = changes();
+
+			if (!listPages("/me/drive/items/" + driveItem.id() + "/children", visit, children))
+				return std::shared_ptr<const std::list<CDriveItem>>();
+
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			// Not to overwrite the changes which came in meanwhile
+			if (tree_.changes() == since)
+				tree_.setChildren(driveItem.id(), children);
+
+			return std::make_shared<const std::list<CDriveItem>>(children);
+		});
+
+		if (listed)
+			return;
+
+		// The caller who listed it stopped half way
+		if (!listing)
+			continue;
+
+		for (auto &&child : *listing)
+			if (!visit(child))
+				break;
+
+		return;
 	}
 }
 
-void COneDrive::listChildren(const CDriveItem &driveItem, std::list<CDriveItem> &driveItems)
+void COneDrive::refreshChildren(const std::string &id)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	std::list<CDriveItem> children;
+	unsigned long since = changes();
 
-	std::stringstream data;
+	try {
+		listPages("/me/drive/items/" + id + "/children", [](const CDriveItem &) { return true; }, children,
+			  CScheduler::PRIORITY_BACKGROUND);
+	} catch (const CHttpError &e) {
+		if (e.respCode() != 404)
+			throw;
 
-	data << graph_.request("/me/drive/items/" + driveItem.id() + "/children");
+		std::lock_guard<std::mutex> lock(mutex_);
 
-	Json::Value root;
+		tree_.remove(id);
+		return;
+	}
 
-	data >> root;
+	std::lock_guard<std::mutex> lock(mutex_);
 
-	for (unsigned int i = 0; i < root["value"].size(); i++) {
-		const Json::Value node(root["value"][i]);
+	if (tree_.changes() == since)
+		tree_.setChildren(id, children);
+}
 
-		CDriveItem driveItem(driveItemFromJson(node));
+bool COneDrive::listPages(const std::string &resource, const Visitor &visit, std::list<CDriveItem> &driveItems,
+			  CScheduler::Priority priority)
+{
+	CListing listing(this, resource, priority);
+	std::list<CDriveItem> page;
 
-		if (driveItem.type() == CDriveItem::DRIVE_ITEM_FILE ||
-		    driveItem.type() == CDriveItem::DRIVE_ITEM_FOLDER)
+	while (listing.next(page)) {
+		for (auto &&driveItem : page) {
 			driveItems.push_back(driveItem);
+
+			if (!visit(driveItem))
+				return false;
+		}
+
+		page.clear();
 	}
+
+	return true;
+}
+
+COneDrive::CListing::CListing(COneDrive *oneDrive, const std::string &resource, CScheduler::Priority priority,
+			      const std::string &folderId): oneDrive_{oneDrive}, priority_{priority}, folderId_{folderId}
+{
+	if (!folderId_.empty())
+		since_ = oneDrive_->changes();
+
+	page_ = oneDrive_->metadataRequest(resource + "?$select=" + childFields + "&$top=" +
+					   std::to_string(gConfig.pageSize()), priority_);
+}
+
+bool COneDrive::CListing::next(std::list<CDriveItem> &driveItems)
+{
+	if (error_)
+		std::rethrow_exception(error_);
+
+	if (!pending_.empty()) {
+		driveItems.splice(driveItems.end(), pending_);
+		return true;
+	}
+
+	if (!page_.valid())
+		return false;
+
+	std::list<CDriveItem> items;
+
+	try {
+		std::stringstream data;
+
+		data << page_.get();
+
+		Json::Value root;
+
+		data >> root;
+
+		// The next page is on its way while this one is handed out
+		if (!!root["@odata.nextLink"])
+			page_ = oneDrive_->graph_.requestAsync(CGraph::resourceOf(root["@odata.nextLink"].asString()),
+								priority_);
+
+		for (unsigned int i = 0; i < root["value"].size(); i++) {
+			CDriveItem driveItem(driveItemFromJson(root["value"][i]));
+
+			if (driveItem.type() == CDriveItem::DRIVE_ITEM_FILE ||
+			    driveItem.type() == CDriveItem::DRIVE_ITEM_FOLDER)
+				items.push_back(driveItem);
+		}
+	} catch (...) {
+		error_ = std::current_exception();
+		throw;
+	}
+
+	if (!folderId_.empty())
+		seen_.insert(seen_.end(), items.begin(), items.end());
+
+	if (!folderId_.empty() && !page_.valid()) {
+		std::lock_guard<std::mutex> lock(oneDrive_->mutex_);
+
+		// Not to overwrite the changes which came in meanwhile
+		if (oneDrive_->tree_.changes() == since_)
+			oneDrive_->tree_.setChildren(folderId_, seen_);
+	}
+
+	driveItems.splice(driveItems.end(), items);
+
+	return true;
+}
+
+std::unique_ptr<COneDrive::CListing> COneDrive::openListing(const CDriveItem &driveItem)
+{
+	std::list<CDriveItem> children;
+	bool cached;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		cached = tree_.children(driveItem.id(), children);
+	}
+
+	revalidate();
+
+	if (cached)
+		return std::unique_ptr<CListing>(new CListing(std::move(children)));
+
+	return std::unique_ptr<CListing>(new CListing(this, "/me/drive/items/" + driveItem.id() + "/children",
+						      CScheduler::PRIORITY_INTERACTIVE, driveItem.id()));
 }
 
 void COneDrive::download(const CDriveItem &driveItem, std::ofstream &file)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	std::shared_ptr<CSegmentedDownload> segments = segmentedDownload(driveItem, 0, CScheduler::PRIORITY_BACKGROUND);
+
+	if (segments) {
+		const uint64_t fileSize = std::stoull(driveItem.size());
+		std::string data;
+		off_t offset;
 
-	graph_.request("/me/drive/items/" + driveItem.id() + "/content", file);
+		while (segments->next(data, offset)) {
+			if (!file.write(data.data(), data.size()))
+				throw std::runtime_error("failed to write " + driveItem.name());
+
+			cache_.write(driveItem.id(), driveItem.cTag(), fileSize, data.data(), data.size(), offset);
+		}
+
+		return;
+	}
+
+	// Skip the redirect of the /content endpoint
+	std::string url = downloadUrls_.url(driveItem.id());
+
+	try {
+		graph_.download(url, file);
+	} catch (const CHttpError &e) {
+		if (!CDownloadUrls::expired(e.respCode()))
+			throw;
+
+		downloadUrls_.reject(driveItem.id(), url);
+
+		file.seekp(0);
+
+		graph_.download(downloadUrls_.url(driveItem.id()), file);
+	}
 }
 
 CDriveItem COneDrive::root()
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	return itemFlights_.run("root", [this]() {
+		std::stringstream data;
+
+		data << graph_.batchRequest("/me/drive/root").get();
 
+		Json::Value root;
+
+		data >> root;
+
+		CDriveItem driveItem(driveItemFromJson(root));
+
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		tree_.setRoot(driveItem);
+
+		return driveItem;
+	});
+}
+
+CDriveItem COneDrive::itemFromPath(const std::string &path)
+{
+	std::list<std::string> items;
+
+	stringSplit(path, '/', items);
+
+	std::vector<std::string> components;
+
+	for (auto &&i : items)
+		if (!i.empty())
+			components.push_back(i);
+
+	return resolve(CDriveItem(), components);
+}
+
+CDriveItem COneDrive::childItem(const CDriveItem &parent, const std::string &name)
+{
+	return resolve(parent, std::vector<std::string>(1, name));
+}
+
+CDriveItem COneDrive::itemFromId(const std::string &id)
+{
+	CDriveItem driveItem;
+	bool cached;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		cached = tree_.find(id, driveItem);
+	}
+
+	revalidate();
+
+	if (cached)
+		return driveItem;
+
+	return itemFlights_.run("item:" + id, [this, &id]() {
+		return fetchItem(id, CScheduler::PRIORITY_INTERACTIVE);
+	});
+}
+
+CDriveItem COneDrive::fetchItem(const std::string &id, CScheduler::Priority priority)
+{
 	std::stringstream data;
+	unsigned long since = changes();
 
-	data << graph_.request("/me/drive/root");
+	try {
+		data << metadataRequest("/me/drive/items/" + id + "?$select=" + childFields + ",parentReference,root",
+					priority).get();
+	} catch (const CHttpError &e) {
+		if (e.respCode() != 404)
+			throw;
+
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		tree_.remove(id);
+
+		return CDriveItem();
+	}
 
 	Json::Value root;
 
 	data >> root;
 
-	return CDriveItem(driveItemFromJson(root));
+	CDriveItem driveItem(driveItemFromJson(root));
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (!!root["root"])
+		tree_.setRoot(driveItem);
+	else if (tree_.changes() == since)
+		tree_.insert(root["parentReference"]["id"].asString(), driveItem);
+
+	return driveItem;
 }
 
-CDriveItem COneDrive::itemFromPath(const std::string &path)
+CDriveItem COneDrive::resolve(const CDriveItem &start, const std::vector<std::string> &components)
 {
 	CDriveItem driveItem;
+	size_t resolved;
+	bool missing;
 
 	{
 		std::lock_guard<std::mutex> lock(mutex_);
 
-		driveItem = queryCache(path);
-		if (driveItem.type() != CDriveItem::DRIVE_ITEM_UNKNOWN)
-			return driveItem;
+		if (start.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
+			resolved = tree_.resolve(components, driveItem, missing);
+		else
+			resolved = tree_.resolve(start.id(), components, driveItem, missing);
 	}
 
-	std::list<std::string> items;
+	revalidate();
 
-	stringSplit(path, '/', items);
+	if (missing)
+		return CDriveItem();
 
-	driveItem = root();
+	// Not cached, but the caller knows where to start from
+	if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
+		driveItem = start;
 
-	for (auto &&i : items) {
-		bool found = false;
+	if (driveItem.type() != CDriveItem::DRIVE_ITEM_UNKNOWN && resolved == components.size())
+		return driveItem;
 
-		if (i.empty())
-			continue;
+	const std::string name(components.empty() ? "/" : components.back());
+
+	// Names cannot hold a slash, so the key tells the lookups apart
+	std::string key("path:" + driveItem.id());
+
+	for (size_t i = resolved; i < components.size(); i++)
+		key += "/" + components[i];
+
+	try {
+		return itemFlights_.run(key, [&]() { return lookupPath(components, resolved, driveItem); });
+	} catch (const CHttpError &e) {
+		if (e.respCode() == 404)
+			return CDriveItem();
+
+		LOG_WARN("failed to look up " << name << " (" << e.what() << "), listing its folders instead");
+	} catch (const std::exception &e) {
+		LOG_WARN("failed to look up " << name << " (" << e.what() << "), listing its folders instead");
+	}
+
+	if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN)
+		driveItem = root();
+
+	return walkPath(components, resolved, driveItem);
+}
+
+void COneDrive::revalidate()
+{
+	std::vector<std::string> items;
+	std::vector<std::string> listings;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		tree_.takeStale(items, listings);
+	}
+
+	// What could not be queued is noted down again on its next use
+	for (auto &&id : items)
+		refresher_.schedule("item:" + id, [this, id]() { fetchItem(id, CScheduler::PRIORITY_BACKGROUND); });
+
+	for (auto &&id : listings)
+		refresher_.schedule("children:" + id, [this, id]() { refreshChildren(id); });
+}
+
+std::future<std::string> COneDrive::metadataRequest(const std::string &resource, CScheduler::Priority priority)
+{
+	if (priority == CScheduler::PRIORITY_INTERACTIVE)
+		return graph_.batchRequest(resource);
+
+	return graph_.requestAsync(resource, priority);
+}
+
+CDriveItem COneDrive::lookupPath(const std::vector<std::string> &components, size_t resolved, CDriveItem driveItem)
+{
+	std::future<std::string> rootData;
+	std::string resource;
+	unsigned long since = changes();
+
+	if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN) {
+		rootData = graph_.batchRequest("/me/drive/root");
+		resource = "/me/drive/root:";
+	} else {
+		resource = "/me/drive/items/" + driveItem.id() + ":";
+	}
+
+	for (size_t i = resolved; i < components.size(); i++)
+		resource += "/" + pathEscape(components[i]);
+
+	std::future<std::string> itemData = graph_.batchRequest(resource);
+
+	graph_.flushBatch();
+
+	if (rootData.valid()) {
+		std::stringstream data;
+
+		data << rootData.get();
+
+		Json::Value root;
+
+		data >> root;
+
+		driveItem = driveItemFromJson(root);
+
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		tree_.setRoot(driveItem);
+	}
+
+	std::stringstream data;
+
+	try {
+		data << itemData.get();
+	} catch (const CHttpError &e) {
+		if (e.respCode() == 404) {
+			try {
+				lookupMissing(components, resolved, driveItem, since);
+			} catch (const std::exception &) {
+				// Only costs asking the server again next time
+			}
+		}
+
+		throw;
+	}
+
+	Json::Value root;
+
+	data >> root;
+
+	CDriveItem child(driveItemFromJson(root));
+
+	downloadUrls_.update(child.id(), child.url());
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	// Kept if its folder is cached, which it is when a single name was
+	// looked up
+	if (tree_.changes() == since)
+		tree_.insert(root["parentReference"]["id"].asString(), child);
+
+	return child;
+}
+
+void COneDrive::lookupMissing(const std::vector<std::string> &components, size_t resolved, CDriveItem driveItem,
+			      unsigned long since)
+{
+	std::list<std::future<std::string>> parentData;
+	std::string resource = "/me/drive/items/" + driveItem.id() + ":";
+
+	// Every folder on the way is requested, the batch making that a single
+	// round trip
+	for (size_t i = resolved; i + 1 < components.size(); i++) {
+		resource += "/" + pathEscape(components[i]);
+
+		parentData.push_back(graph_.batchRequest(resource));
+	}
+
+	if (!parentData.empty())
+		graph_.flushBatch();
+
+	size_t component = resolved;
+
+	for (auto &&i : parentData) {
+		std::stringstream data;
+
+		try {
+			data << i.get();
+		} catch (const CHttpError &e) {
+			if (e.respCode() != 404)
+				throw;
+
+			break;
+		}
+
+		Json::Value root;
+
+		data >> root;
+
+		CDriveItem child(driveItemFromJson(root));
+
+		downloadUrls_.update(child.id(), child.url());
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			if (tree_.changes() == since)
+				tree_.insert(driveItem.id(), child);
+		}
+
+		driveItem = child;
+		component++;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (tree_.changes() == since)
+		tree_.addMissing(driveItem.id(), components[component]);
+}
+
+CDriveItem COneDrive::walkPath(const std::vector<std::string> &components, size_t resolved, CDriveItem driveItem)
+{
+	for (size_t i = resolved; i < components.size(); i++) {
+		bool found = false;
 
 		std::list<CDriveItem> driveItems;
 
 		listChildren(driveItem, driveItems);
 
 		for (auto &&j : driveItems) {
-			if (j.name() == i) {
+			if (j.name() == components[i]) {
 				driveItem = j;
 				found = true;
 				break;
@@ -206,13 +735,130 @@ CDriveItem COneDrive::itemFromPath(const std::string &path)
 			return CDriveItem();
 	}
 
+	return driveItem;
+}
+
+void COneDrive::applyChanges(const Json::Value &items)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	for (unsigned int i = 0; i < items.size(); i++) {
+		const Json::Value &node = items[i];
+
+		if (!!node["deleted"]) {
+			tree_.remove(node["id"].asString());
+			cache_.remove(node["id"].asString());
+			continue;
+		}
+
+		CDriveItem driveItem(driveItemFromJson(node));
+
+		if (!!node["root"]) {
+			tree_.setRoot(driveItem);
+			continue;
+		}
+
+		if (driveItem.type() == CDriveItem::DRIVE_ITEM_UNKNOWN) {
+			tree_.remove(driveItem.id());
+			continue;
+		}
+
+		downloadUrls_.update(driveItem.id(), driveItem.url());
+
+		tree_.update(node["parentReference"]["id"].asString(), driveItem);
+	}
+}
+
+void COneDrive::resetCache()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	tree_.setSynced(0, 0);
+	tree_.clear();
+
+	deltaLink_.clear();
+}
+
+unsigned long COneDrive::changes()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	return tree_.changes();
+}
+
+void COneDrive::synced(time_t since, time_t time, const std::string &deltaLink)
+{
 	{
 		std::lock_guard<std::mutex> lock(mutex_);
 
-		cache(path, driveItem);
+		// Trusted until a poll or two have gone missing
+		tree_.setSynced(since, time + 2 * gConfig.deltaInterval());
+
+		deltaLink_ = deltaLink;
 	}
 
-	return driveItem;
+	if (gConfig.snapshotInterval() > 0 && std::time(nullptr) - lastSnapshot_ >= gConfig.snapshotInterval())
+		saveSnapshot();
+}
+
+std::string COneDrive::loadSnapshot()
+{
+	if (gConfig.snapshotInterval() == 0)
+		return std::string();
+
+	std::unique_ptr<CSnapshot> snapshot(new CSnapshot());
+
+	if (!snapshot->load(gConfig.configDir() + "/metadata.snapshot"))
+		return std::string();
+
+	std::string deltaLink = snapshot->deltaLink();
+
+	// Of no use without a way to catch up with the changes made since
+	if (deltaLink.empty())
+		return std::string();
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	tree_.attach(std::move(snapshot));
+
+	return deltaLink;
+}
+
+void COneDrive::saveSnapshot()
+{
+	if (gConfig.snapshotInterval() == 0 || gConfig.deltaInterval() == 0)
+		return;
+
+	CItemTree::CExport copy;
+	std::string deltaLink;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (deltaLink_.empty())
+			return;
+
+		tree_.exportTo(copy);
+
+		deltaLink = deltaLink_;
+	}
+
+	lastSnapshot_ = std::time(nullptr);
+
+	// Sorted and flattened without holding up the lookups
+	std::vector<CSnapshot::CEntry> entries;
+
+	copy.entries(entries);
+
+	if (entries.empty())
+		return;
+
+	try {
+		CSnapshot::save(gConfig.configDir() + "/metadata.snapshot", entries, deltaLink);
+	} catch (const std::exception &e) {
+		// Only costs a colder start next time
+		LOG_WARN("failed to save the metadata snapshot: " << e.what());
+	}
 }
 
 // The source timestamp looks like this: 2009-05-06T23:31:32.193Z
@@ -226,67 +872,417 @@ void COneDrive::driveItemTime(const std::string &s, struct timespec &ts)
 	ts.tv_nsec = 0;
 }
 
-size_t COneDrive::read(const CDriveItem &driveItem, void *buf, size_t size, off_t offset)
+std::shared_ptr<COpenFile> COneDrive::open(const CDriveItem &driveItem)
 {
+	std::shared_ptr<COpenFile> file(new COpenFile(driveItem));
+
+	if (gConfig.readaheadMax() > 0)
+		file->readahead = std::make_shared<CReadahead>(std::stoull(driveItem.size()), cache_.blockSize(),
+							       gConfig.readaheadMax());
+
+	return file;
+}
+
+void COneDrive::close(COpenFile &file)
+{
+	// The downloads ahead still queued are dropped
+	if (file.readahead)
+		file.readahead->close();
+
+	std::lock_guard<std::mutex> lock(file.mutex);
+
+	if (file.stream) {
+		file.stream->close();
+		file.stream.reset();
+	}
+
+	if (file.segments) {
+		file.segments->close();
+		file.segments.reset();
+	}
+}
+
+size_t COneDrive::read(COpenFile &file, void *buf, size_t size, off_t offset)
+{
+	const CDriveItem &driveItem = file.driveItem;
+	const std::shared_ptr<CReadahead> &readahead = file.readahead;
+
 	if (offset > std::stoll(driveItem.size()))
 		return 0;
 
-	if ((offset + size) > std::stoull(driveItem.size()))
-		size = std::stoull(driveItem.size()) - offset;
+	const uint64_t fileSize = std::stoull(driveItem.size());
 
-	std::lock_guard<std::mutex> lock(mutex_);
+	if ((offset + size) > fileSize)
+		size = fileSize - offset;
+
+	if (size == 0)
+		return 0;
+
+	bool cached = cache_.read(driveItem.id(), driveItem.cTag(), buf, size, offset);
+
+	// A stream needs no downloads ahead. None is opened for what is cached
+	// already, which it would download again.
+	if (!follow(file, offset, size, !cached) && readahead)
+		prefetch(driveItem, readahead, offset, size);
+
+	if (cached)
+		return size;
+
+	if (readStreamed(file, buf, size, offset))
+		return size;
+
+	if (readahead && readahead->read(buf, size, offset))
+		return size;
+
+	off_t start = offset;
+	size_t length = size;
+
+	// Whole blocks are downloaded, so that they can be cached and the
+	// downloads ahead pick up where this one ends
+	if (cache_.enabled() || readahead) {
+		const size_t blockSize = cache_.blockSize();
+
+		start  = offset / blockSize * blockSize;
+		length = std::min<uint64_t>((offset + size + blockSize - 1) / blockSize * blockSize, fileSize) - start;
+	}
+
+	// Several readers of the same block of a file share one download of it
+	std::shared_ptr<const std::string> data = readFlights_.run(driveItem.id() + ":" + std::to_string(start) + ":" +
+								   std::to_string(length), [&]() {
+		std::shared_ptr<std::string> data = std::make_shared<std::string>(length, '\0');
+
+		data->resize(readRange(driveItem, &(*data)[0], length, start));
+
+		cache_.write(driveItem.id(), driveItem.cTag(), fileSize, data->data(), data->size(), start);
+
+		return std::shared_ptr<const std::string>(data);
+	});
+
+	const size_t skip = offset - start;
+
+	if (data->size() <= skip)
+		return 0;
+
+	size = std::min(size, data->size() - skip);
 
-	return graph_.request(driveItem.url(), buf, size, offset);
+	std::memcpy(buf, data->data() + skip, size);
+
+	return size;
 }
 
-void COneDrive::deleteItem(const CDriveItem &driveItem)
+bool COneDrive::follow(COpenFile &file, off_t offset, size_t size, bool miss)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	std::lock_guard<std::mutex> lock(file.mutex);
+
+	file.streak = offset == file.next ? file.streak + 1 : 0;
+	file.next   = offset + size;
+
+	// Dropped by a read it could not serve; the reads have to prove
+	// sequential again before another one is opened
+	if ((file.stream && file.stream->closed()) || (file.segments && file.segments->closed())) {
+		file.stream.reset();
+		file.segments.reset();
+		file.streak = 0;
+	}
+
+	if (file.stream || file.segments || file.streak < streamAfter || !miss)
+		return file.stream || file.segments;
+
+	const CDriveItem &driveItem = file.driveItem;
 
-	graph_.deleteRequest("/me/drive/items/" + driveItem.id());
+	try {
+		// Large files are fetched over several connections at once
+		const size_t blockSize = cache_.blockSize();
+
+		file.segments = segmentedDownload(driveItem, offset / blockSize * blockSize, CScheduler::PRIORITY_STREAM);
+
+		if (!file.segments && gConfig.streamBuffer() > 0 &&
+		    static_cast<uint64_t>(offset) < std::stoull(driveItem.size()))
+			file.stream = openStream(driveItem, offset);
+	} catch (const std::exception &e) {
+		LOG_WARN("failed to stream " << driveItem.name() << ": " << e.what());
+	}
+
+	return file.stream || file.segments;
 }
 
-void COneDrive::truncateItem(const CDriveItem &driveItem, off_t offset)
+bool COneDrive::readStreamed(COpenFile &file, void *buf, size_t size, off_t offset)
 {
-	// The following request is limited to 4MiB
-	if (offset > 4194304)
-		offset = 4194304;
+	std::shared_ptr<CStream> stream;
+	std::shared_ptr<CSegmentedDownload> segments;
 
-	std::string body(offset, '\0');
+	{
+		std::lock_guard<std::mutex> lock(file.mutex);
 
-	std::lock_guard<std::mutex> lock(mutex_);
+		stream   = file.stream;
+		segments = file.segments;
+	}
 
-	graph_.upload("/me/drive/items/" + driveItem.id() + "/content", body);
+	if (!stream && !segments)
+		return false;
+
+	if (segments ? segments->read(buf, size, offset) : stream->read(buf, size, offset)) {
+		cacheStreamed(file, buf, size, offset);
+		return true;
+	}
+
+	LOG_INFO("stopped streaming " << file.driveItem.name() << " at " << offset);
+
+	return false;
 }
 
-CDriveItem COneDrive::queryCache(const std::string &path)
+std::shared_ptr<CSegmentedDownload> COneDrive::segmentedDownload(const CDriveItem &driveItem, off_t offset,
+								 CScheduler::Priority priority)
 {
-	time_t now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+	const uint64_t fileSize = std::stoull(driveItem.size());
+	const size_t blockSize = cache_.blockSize();
+	const size_t segmentSize = (gConfig.segmentSize() + blockSize - 1) / blockSize * blockSize;
 
-	std::size_t hash = std::hash<std::string>{}(path);
+	if (gConfig.downloadSegments() < 2 || static_cast<uint64_t>(offset) + 2 * segmentSize > fileSize)
+		return nullptr;
 
-	auto driveItem = cache_.find(hash);
+	const std::string id = driveItem.id();
+	const std::string cTag = driveItem.cTag();
 
-	if (driveItem == cache_.end())
-		return CDriveItem();
+	auto fetch = [this, id, cTag, priority](off_t offset, size_t size, CSegmentedDownload::Done done) {
+		std::string data(size, '\0');
 
-	if (driveItem->second.cacheTime() > now || (now - driveItem->second.cacheTime()) > 30) {
-		cache_.erase(driveItem);
-		return CDriveItem();
+		if (cache_.read(id, cTag, &data[0], size, offset)) {
+			done(std::move(data), nullptr);
+			return;
+		}
+
+		std::string url = downloadUrls_.url(id);
+
+		// Not hedged, as a segment takes far longer than the block reads
+		// the latencies are measured on
+		graph_.requestAsync(url, size, offset, [this, id, url, done](std::string data, std::exception_ptr error) {
+			// Renewed before the segment is fetched again
+			if (error) {
+				try {
+					std::rethrow_exception(error);
+				} catch (const CHttpError &e) {
+					if (CDownloadUrls::expired(e.respCode()))
+						downloadUrls_.reject(id, url);
+				} catch (...) {
+				}
+			}
+
+			done(std::move(data), error);
+		}, priority, false);
+	};
+
+	LOG_INFO("downloading " << driveItem.name() << " from " << offset << " in segments of " << segmentSize);
+
+	return std::make_shared<CSegmentedDownload>(fetch, offset, fileSize, segmentSize, gConfig.downloadSegments());
+}
+
+std::shared_ptr<CStream> COneDrive::openStream(const CDriveItem &driveItem, off_t offset)
+{
+	std::shared_ptr<CStream> stream(new CStream(&graph_, offset, gConfig.streamBuffer()));
+
+	{
+		std::lock_guard<std::mutex> lock(streamsMutex_);
+
+		unsigned int open = 0;
+
+		for (auto i = streams_.begin(); i != streams_.end();) {
+			std::shared_ptr<CStream> other(i->lock());
+
+			if (!other || other->closed()) {
+				i = streams_.erase(i);
+				continue;
+			}
+
+			// Left behind by a reader which stopped short of the end
+			if (open >= gConfig.maxStreams() - 1 && other->idle() >= streamIdle) {
+				other->close();
+				i = streams_.erase(i);
+				continue;
+			}
+
+			open++;
+			i++;
+		}
+
+		if (open >= gConfig.maxStreams())
+			return nullptr;
+
+		streams_.push_back(stream);
+	}
+
+	LOG_INFO("streaming " << driveItem.name() << " from " << offset);
+
+	stream->open(downloadUrls_.url(driveItem.id()));
+
+	return stream;
+}
+
+void COneDrive::closeStreams()
+{
+	std::lock_guard<std::mutex> lock(streamsMutex_);
+
+	for (auto &&i : streams_) {
+		std::shared_ptr<CStream> stream(i.lock());
+
+		if (stream)
+			stream->close();
+	}
+
+	streams_.clear();
+}
+
+void COneDrive::cacheStreamed(COpenFile &file, const void *data, size_t size, off_t offset)
+{
+	if (!cache_.enabled())
+		return;
+
+	const CDriveItem &driveItem = file.driveItem;
+	const uint64_t fileSize = std::stoull(driveItem.size());
+	const size_t blockSize = cache_.blockSize();
+
+	std::lock_guard<std::mutex> lock(file.mutex);
+
+	// Not following what was gathered so far; start over at the next block
+	if (offset != file.blockStart + static_cast<off_t>(file.block.size())) {
+		file.block.clear();
+		file.blockStart = (offset + blockSize - 1) / blockSize * blockSize;
 	}
 
-	return driveItem->second;
+	if (offset + static_cast<off_t>(size) <= file.blockStart)
+		return;
+
+	const size_t skip = file.blockStart - offset + file.block.size();
+
+	file.block.append(static_cast<const char *>(data) + skip, size - skip);
+
+	const bool end = file.blockStart + file.block.size() >= fileSize;
+	const size_t whole = end ? file.block.size() : file.block.size() / blockSize * blockSize;
+
+	if (whole == 0)
+		return;
+
+	cache_.write(driveItem.id(), driveItem.cTag(), fileSize, file.block.data(), whole, file.blockStart);
+
+	file.block.erase(0, whole);
+	file.blockStart += whole;
 }
 
-void COneDrive::cache(const std::string &path, CDriveItem &driveItem)
+size_t COneDrive::readRange(const CDriveItem &driveItem, void *buf, size_t size, off_t offset)
 {
-	time_t now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+	std::string url = downloadUrls_.url(driveItem.id());
+
+	try {
+		return graph_.request(url, buf, size, offset);
+	} catch (const CHttpError &e) {
+		if (!CDownloadUrls::expired(e.respCode()))
+			throw;
+
+		LOG_INFO("the download URL of " << driveItem.name() << " was rejected (" << e.respCode() << "), renewing it");
+
+		downloadUrls_.reject(driveItem.id(), url);
+
+		return graph_.request(downloadUrls_.url(driveItem.id()), buf, size, offset);
+	}
+}
+
+void COneDrive::prefetch(const CDriveItem &driveItem, const std::shared_ptr<CReadahead> &readahead, off_t offset,
+			 size_t size)
+{
+	std::vector<CReadahead::Fetch> fetches;
+
+	readahead->access(offset, size, fetches);
+
+	const uint64_t fileSize = std::stoull(driveItem.size());
+
+	for (auto &&fetch : fetches) {
+		// Read from the disk instead
+		if (cache_.contains(driveItem.id(), driveItem.cTag(),
+				    std::min<uint64_t>(readahead->blockSize(), fileSize - fetch.first), fetch.first)) {
+			fetch.second->set_value(nullptr);
+			continue;
+		}
+
+		// A block fetched again after the window was dropped comes with a
+		// new promise, which must not be taken for the one still queued
+		const std::string key(std::to_string(reinterpret_cast<uintptr_t>(fetch.second.get())));
+
+		if (!prefetcher_.schedule(key, [this, driveItem, readahead, fetch]() { fetchAhead(driveItem, readahead, fetch); }))
+			fetch.second->set_value(nullptr);
+	}
+}
+
+void COneDrive::fetchAhead(const CDriveItem &driveItem, std::shared_ptr<CReadahead> readahead,
+			   const CReadahead::Fetch &fetch)
+{
+	std::shared_ptr<std::promise<CReadahead::Block>> promise = fetch.second;
+
+	if (readahead->closed()) {
+		promise->set_value(nullptr);
+		return;
+	}
 
-	std::size_t hash = std::hash<std::string>{}(path);
+	const uint64_t fileSize = std::stoull(driveItem.size());
+	const off_t start = fetch.first;
+	const CReadahead::Clock::time_point started = CReadahead::Clock::now();
 
-	driveItem.setCacheTime(now);
+	auto done = [this, driveItem, readahead, promise, fileSize, start, started](std::string data,
+										   std::exception_ptr error) {
+		if (error) {
+			// The reader downloads it itself
+			promise->set_value(nullptr);
+			return;
+		}
+
+		readahead->fetched(CReadahead::Clock::now() - started);
+
+		CReadahead::Block block(std::make_shared<const std::string>(std::move(data)));
+
+		promise->set_value(block);
+
+		// Not on the transfer engine thread
+		prefetcher_.schedule("store:" + driveItem.id() + ":" + std::to_string(start), [this, driveItem, fileSize, block, start]() {
+			cache_.write(driveItem.id(), driveItem.cTag(), fileSize, block->data(), block->size(), start);
+		});
+	};
+
+	try {
+		graph_.requestAsync(downloadUrls_.url(driveItem.id()), std::min<uint64_t>(readahead->blockSize(), fileSize - start),
+				    start, done, CScheduler::PRIORITY_BACKGROUND);
+	} catch (const std::exception &e) {
+		LOG_WARN("failed to download ahead in " << driveItem.name() << ": " << e.what());
+
+		promise->set_value(nullptr);
+	}
+}
+
+void COneDrive::deleteItem(const CDriveItem &driveItem)
+{
+	graph_.batchDelete("/me/drive/items/" + driveItem.id()).get();
+
+	cache_.remove(driveItem.id());
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	tree_.remove(driveItem.id());
+}
+
+void COneDrive::truncateItem(const CDriveItem &driveItem, off_t offset)
+{
+	// The following request is limited to 4MiB
+	if (offset > 4194304)
+		offset = 4194304;
+
+	std::string body(offset, '\0');
+
+	graph_.upload("/me/drive/items/" + driveItem.id() + "/content", body);
+
+	cache_.remove(driveItem.id());
+
+	// The size and times are refreshed with the next listing of the parent
+	std::lock_guard<std::mutex> lock(mutex_);
 
-	cache_[hash] = driveItem;
+	tree_.remove(driveItem.id());
 }
 
 } // namespace OneDrive
@@ -3,13 +3,27 @@
 #ifndef __ONEDRIVE_H_INCLUDED__
 #define __ONEDRIVE_H_INCLUDED__
 
+#include <exception>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <list>
-#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <vector>
+#include "contentcache.h"
+#include "delta.h"
+#include "downloadurls.h"
+#include "driveitem.h"
 #include "graph.h"
+#include "itemtree.h"
+#include "readahead.h"
+#include "refresher.h"
+#include "scheduler.h"
+#include "segmented.h"
+#include "singleflight.h"
+#include "stream.h"
 
 namespace OneDrive {
 
@@ -188,139 +202,59 @@ private:
 	CQuota      quota_;
 };
 
-class CDriveItem
-{
-public:
-	enum DriveItemType {
-		DRIVE_ITEM_FOLDER,
-		DRIVE_ITEM_FILE,
-		DRIVE_ITEM_UNKNOWN
-	};
-
-	CDriveItem()
-	{
-	}
-
-	CDriveItem(const std::string &id, const std::string &name, const std::string &size,
-		   const std::string &createTime, const std::string &modifiedTime,
-		   const std::string &url, DriveItemType type):
-			id_{id}, name_{name}, size_{size}, createTime_{createTime}, modifiedTime_{modifiedTime},
-			url_{url}, type_{type}
-	{
-	}
-
-	CDriveItem(const CDriveItem &driveItem): id_{driveItem.id_}, name_{driveItem.name_},
-		size_{driveItem.size_}, createTime_{driveItem.createTime_}, modifiedTime_{driveItem.modifiedTime_},
-		url_{driveItem.url_}, type_{driveItem.type_}, hash_{driveItem.hash_}, cacheTime_{driveItem.cacheTime_}
-	{
-	}
-
-	CDriveItem & operator=(const CDriveItem &driveItem)
-	{
-		id_           = driveItem.id_;
-		name_         = driveItem.name_;
-		size_         = driveItem.size_;
-		createTime_   = driveItem.createTime_;
-		modifiedTime_ = driveItem.modifiedTime_;
-		url_          = driveItem.url_;
-		type_         = driveItem.type_;
-		hash_         = driveItem.hash_;
-		cacheTime_    = driveItem.cacheTime_;
-
-		return *this;
-	}
-
-	~CDriveItem()
-	{
-	}
-
-	std::string id() const
-	{
-		return id_;
-	}
-
-	std::string name() const
-	{
-		return name_;
-	}
-
-	std::string size() const
-	{
-		return size_;
-	}
-
-	std::string createTime() const
-	{
-		return createTime_;
-	}
-
-	std::string modifiedTime() const
-	{
-		return modifiedTime_;
-	}
-
-	std::string url() const
-	{
-		return url_;
-	}
-
-	DriveItemType type() const
-	{
-		return type_;
-	}
-
-	void setDriveItemType(DriveItemType type)
-	{
-		type_ = type;
-	}
-
-	std::string hash() const
-	{
-		return hash_;
-	}
-
-	void setHash(const std::string &hash)
+// What is kept about a file while it is open
+struct COpenFile {
+	explicit COpenFile(const CDriveItem &item): driveItem{item}
 	{
-		hash_ = hash;
 	}
 
-	time_t cacheTime() const
-	{
-		return cacheTime_;
-	}
-
-	void setCacheTime(time_t cacheTime)
-	{
-		cacheTime_ = cacheTime;
-	}
-
-private:
-	std::string   id_;
-	std::string   name_;
-	std::string   size_;
-	std::string   createTime_;
-	std::string   modifiedTime_;
-	std::string   url_;
-	DriveItemType type_{DRIVE_ITEM_UNKNOWN};
-	std::string   hash_;
-	time_t        cacheTime_;
+	const CDriveItem                    driveItem;
+	std::shared_ptr<CReadahead>         readahead; // null when readahead is turned off
+	std::mutex                          mutex;     // guards what follows
+	std::shared_ptr<CStream>            stream;    // feeding a sequential reader
+	std::shared_ptr<CSegmentedDownload> segments;  // in its place for a large file
+	unsigned int                        streak{};  // reads which started where the previous one ended
+	off_t                               next{};
+	std::string                         block;     // streamed bytes gathered for the content cache
+	off_t                               blockStart{};
 };
 
 class COneDrive
 {
 public:
-	COneDrive()
+	COneDrive(): downloadUrls_{&graph_}, cache_{gConfig.contentCacheProfile()},
+		tree_{gConfig.cacheSize(), cacheTtl, gConfig.maxStaleness(), gConfig.negativeTimeout()},
+		delta_{&graph_, [this](const Json::Value &items) { applyChanges(items); },
+		       [this]() { resetCache(); },
+		       [this](time_t since, time_t time, const std::string &deltaLink) { synced(since, time, deltaLink); }}
 	{
 		graph_.init();
+
+		refresher_.start();
+		prefetcher_.start();
+
+		// Ready by the time the file system is first asked about it
+		refreshDrive();
+
+		if (gConfig.deltaInterval() > 0)
+			delta_.start(gConfig.deltaInterval(), loadSnapshot());
 	}
 
 	~COneDrive()
 	{
+		delta_.stop();
+		refresher_.stop();
+		prefetcher_.stop();
+		closeStreams();
+
+		saveSnapshot();
 	}
 
 	COneDrive(const COneDrive &) = delete;
 	COneDrive & operator=(const COneDrive &) = delete;
 
+	// The drive and its quota as last fetched, which is only waited for
+	// when it was never fetched or is too stale to answer with
 	CDrive drive();
 
 	void drives(std::list<CDrive> &drives);
@@ -329,35 +263,192 @@ public:
 
 	void listChildren(const CDriveItem &driveItem, std::list<CDriveItem> &driveItems);
 
+	// Receives the children of a folder as they arrive; returning false
+	// ends the listing
+	typedef std::function<bool(const CDriveItem &driveItem)> Visitor;
+
+	void listChildren(const CDriveItem &driveItem, const Visitor &visit);
+
+	// A listing of a folder gone through page by page, each page being asked
+	// for before the previous one is handed out. Dropping it midway leaves
+	// the page on its way to be discarded.
+	class CListing
+	{
+	public:
+		// Of what is already at hand, handed out as a single page
+		explicit CListing(std::list<CDriveItem> driveItems): pending_{std::move(driveItems)}
+		{
+		}
+
+		// Of the resource; the complete listing of the folder by that id,
+		// if given, is cached once gone through
+		CListing(COneDrive *oneDrive, const std::string &resource, CScheduler::Priority priority,
+			 const std::string &folderId = std::string());
+
+		CListing(const CListing &) = delete;
+		CListing & operator=(const CListing &) = delete;
+
+		// Appends the next page to driveItems; false once the listing is
+		// over. Throws if a page could not be fetched, and again on every
+		// later call.
+		bool next(std::list<CDriveItem> &driveItems);
+
+	private:
+		COneDrive               *oneDrive_{};
+		CScheduler::Priority     priority_{};
+		std::string              folderId_;
+		unsigned long            since_{};
+		std::list<CDriveItem>    pending_;
+		std::future<std::string> page_;
+		std::list<CDriveItem>    seen_;  // handed out so far, to be cached
+		std::exception_ptr       error_;
+	};
+
+	// Opens a listing of a folder, at once if the tree has it
+	std::unique_ptr<CListing> openListing(const CDriveItem &driveItem);
+
 	void download(const CDriveItem &driveItem, std::ofstream &file);
 
 	CDriveItem root();
 
 	CDriveItem itemFromPath(const std::string &path);
 
-	void driveItemTime(const std::string &s, struct timespec &ts);
+	// Looks a name up in a folder
+	CDriveItem childItem(const CDriveItem &parent, const std::string &name);
 
-	size_t read(const CDriveItem &driveItem, void *buf, size_t size, off_t offset);
+	CDriveItem itemFromId(const std::string &id);
 
-	void deleteItem(const CDriveItem &driveItem);
+	void driveItemTime(const std::string &s, struct timespec &ts);
 
-	void truncateItem(const CDriveItem &driveItem, off_t offset);
+	// Sets up the reading of a file being opened
+	std::shared_ptr<COpenFile> open(const CDriveItem &driveItem);
 
-	CDriveItem queryCache(const std::string &path);
+	// Drops what is still being downloaded for a file being closed
+	void close(COpenFile &file);
 
-	void cache(const std::string &path, CDriveItem &driveItem);
+	size_t read(COpenFile &file, void *buf, size_t size, off_t offset);
 
-	void cacheLocked(const std::string &path, CDriveItem &driveItem)
-	{
-		std::lock_guard<std::mutex> lock(mutex_);
+	void deleteItem(const CDriveItem &driveItem);
 
-		cache(path, driveItem);
-	}
+	void truncateItem(const CDriveItem &driveItem, off_t offset);
 
 private:
+	// Declared ahead of graph_ so they outlive the renewals and the
+	// downloads ahead still in flight when the transfer engine shuts down
+	CDownloadUrls                     downloadUrls_;
+	CContentCache                     cache_;
+	CRefresher                        prefetcher_;  // hands out the downloads ahead of the readers
 	CGraph                            graph_;
 	std::mutex                        mutex_;
-	std::map<std::size_t, CDriveItem> cache_;
+	CItemTree                         tree_;
+	std::string                       deltaLink_;    // the tree is current with
+	time_t                            lastSnapshot_{std::time(nullptr)};
+	CDrive                            drive_;
+	time_t                            driveTime_{};  // when drive_ was fetched
+	CDeltaSync                        delta_;
+	CRefresher                        refresher_;
+
+	// Concurrent callers asking for the same drive, item, listing or byte
+	// range wait for a single request
+	CSingleFlight<CDrive>                                       driveFlights_;
+	CSingleFlight<CDriveItem>                                   itemFlights_;
+	CSingleFlight<std::shared_ptr<const std::list<CDriveItem>>> listFlights_;
+	CSingleFlight<std::shared_ptr<const std::string>>           readFlights_;
+
+	// The streams open, to keep within the allowed number
+	std::mutex                        streamsMutex_;
+	std::list<std::weak_ptr<CStream>> streams_;
+
+	// How long metadata is current for when not kept up to date by the
+	// delta synchronization
+	static const time_t cacheTtl = 30;
+
+	// Asks for metadata, on its own at background priority or along with
+	// other requests otherwise
+	std::future<std::string> metadataRequest(const std::string &resource, CScheduler::Priority priority);
+
+	// Fetches an item into the tree, dropping it from there if it no
+	// longer exists
+	CDriveItem fetchItem(const std::string &id, CScheduler::Priority priority);
+
+	// Has the stale items and listings served by the tree refreshed
+	void revalidate();
+
+	void refreshChildren(const std::string &id);
+
+	// Has the drive fetched in the background. Returns false if it could
+	// not be queued.
+	bool refreshDrive();
+
+	// Fetches the drive, sharing the request with whoever fetches it
+	// meanwhile
+	CDrive fetchDrive(CScheduler::Priority priority);
+
+	size_t readRange(const CDriveItem &driveItem, void *buf, size_t size, off_t offset);
+
+	// Has the blocks ahead of a sequential read downloaded in the background
+	void prefetch(const CDriveItem &driveItem, const std::shared_ptr<CReadahead> &readahead, off_t offset,
+		      size_t size);
+
+	void fetchAhead(const CDriveItem &driveItem, std::shared_ptr<CReadahead> readahead, const CReadahead::Fetch &fetch);
+
+	// Notes a read of the file and, once the reads have been sequential for
+	// a while, has the rest of the file streamed to them unless miss tells
+	// the read was served from the cache. Returns whether it is streamed.
+	bool follow(COpenFile &file, off_t offset, size_t size, bool miss);
+
+	// Serves a read out of what is streamed to the file
+	bool readStreamed(COpenFile &file, void *buf, size_t size, off_t offset);
+
+	// Null when what is left of the file from the offset on spans fewer
+	// than two segments, or segmented downloads are turned off
+	std::shared_ptr<CSegmentedDownload> segmentedDownload(const CDriveItem &driveItem, off_t offset,
+							      CScheduler::Priority priority);
+
+	// Null when as many streams as allowed are in use
+	std::shared_ptr<CStream> openStream(const CDriveItem &driveItem, off_t offset);
+
+	void closeStreams();
+
+	// Hands the whole blocks among the streamed bytes to the content cache
+	void cacheStreamed(COpenFile &file, const void *data, size_t size, off_t offset);
+
+	// Resolves the components from the given folder, or from the root if
+	// the folder is unknown
+	CDriveItem resolve(const CDriveItem &start, const std::vector<std::string> &components);
+
+	// Looks up the components past the resolved ones with path addressing,
+	// in a single request for the whole path
+	CDriveItem lookupPath(const std::vector<std::string> &components, size_t resolved, CDriveItem driveItem);
+
+	// Finds out which of the components of a path that was not found is
+	// missing, by looking up the folders on the way, and remembers it
+	void lookupMissing(const std::vector<std::string> &components, size_t resolved, CDriveItem driveItem,
+			   unsigned long since);
+
+	// Follows a listing from page to page, asking for each page before the
+	// previous one is handed out. Returns whether the listing was seen
+	// through; driveItems receives what was handed out.
+	bool listPages(const std::string &resource, const Visitor &visit, std::list<CDriveItem> &driveItems,
+		       CScheduler::Priority priority = CScheduler::PRIORITY_INTERACTIVE);
+
+	void applyChanges(const Json::Value &items);
+
+	void resetCache();
+
+	void synced(time_t since, time_t time, const std::string &deltaLink);
+
+	// Tells apart what was fetched while changes came in from the server
+	unsigned long changes();
+
+	// Attaches the snapshot saved by a previous mount to the tree and
+	// returns the delta link it is current with, empty if there is none
+	std::string loadSnapshot();
+
+	void saveSnapshot();
+
+	// Looks up the components past the resolved ones by listing each folder
+	CDriveItem walkPath(const std::vector<std::string> &components, size_t resolved, CDriveItem driveItem);
 };
 
 } // namespace OneDrive
@@ -0,0 +1,155 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <algorithm>
+#include <cstring>
+#include "readahead.h"
+
+namespace {
+
+// The weight of the latest measurement in the moving averages
+const double smoothing = 0.25;
+
+// How long a read waits for a block being downloaded ahead
+const std::chrono::seconds fetchWait(5);
+
+double average(double current, double sample)
+{
+	return current > 0 ? current + smoothing * (sample - current) : sample;
+}
+
+} // anonymous namespace
+
+namespace OneDrive {
+
+void CReadahead::access(off_t offset, size_t size, std::vector<Fetch> &fetches)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	Clock::time_point now = Clock::now();
+
+	// The kernel may hand out the reads of a sequential reader slightly out
+	// of order
+	bool sequential = offset + static_cast<off_t>(blockSize_) >= next_ &&
+			  offset <= next_ + static_cast<off_t>(blockSize_);
+
+	if (sequential) {
+		if (lastAccess_ != Clock::time_point()) {
+			double elapsed = std::max(std::chrono::duration<double>(now - lastAccess_).count(), 0.001);
+
+			readRate_ = average(readRate_, size / elapsed);
+		}
+
+		window_ = std::min(window_ > 0 ? window_ * 2 : blockSize_, target());
+		next_   = std::max<off_t>(next_, offset + size);
+	} else {
+		window_ = 0;
+		next_   = offset + size;
+
+		blocks_.clear();
+	}
+
+	lastAccess_ = now;
+
+	// What is behind the reader is not read again
+	blocks_.erase(blocks_.begin(), blocks_.lower_bound(offset / blockSize_ * blockSize_));
+
+	if (window_ == 0)
+		return;
+
+	off_t start = (offset + size + blockSize_ - 1) / blockSize_ * blockSize_;
+	uint64_t end = std::min<uint64_t>(offset + size + window_, fileSize_);
+
+	for (; static_cast<uint64_t>(start) < end; start += blockSize_) {
+		if (blocks_.count(start) > 0)
+			continue;
+
+		std::shared_ptr<std::promise<Block>> promise(new std::promise<Block>());
+
+		blocks_.emplace(start, promise->get_future().share());
+
+		fetches.emplace_back(start, promise);
+	}
+}
+
+bool CReadahead::read(void *buf, size_t size, off_t offset)
+{
+	std::vector<std::shared_future<Block>> blocks;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		for (off_t start = offset / blockSize_ * blockSize_; start < offset + static_cast<off_t>(size);
+		     start += blockSize_) {
+			auto i = blocks_.find(start);
+
+			if (i == blocks_.end())
+				return false;
+
+			blocks.push_back(i->second);
+		}
+	}
+
+	char *p = static_cast<char *>(buf);
+	off_t start = offset / blockSize_ * blockSize_;
+
+	for (auto &&i : blocks) {
+		// Rather than hang on a download ahead stuck in the queue, the
+		// reader downloads the block itself
+		if (i.wait_for(fetchWait) != std::future_status::ready)
+			return false;
+
+		Block block = i.get();
+
+		if (!block)
+			return false;
+
+		off_t from = std::max(offset, start);
+		off_t to = std::min<off_t>(offset + size, start + blockSize_);
+
+		if (static_cast<off_t>(block->size()) < to - start)
+			return false;
+
+		std::memcpy(p, block->data() + (from - start), to - from);
+
+		p     += to - from;
+		start += blockSize_;
+	}
+
+	return true;
+}
+
+void CReadahead::fetched(Clock::duration elapsed)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	fetchTime_ = average(fetchTime_, std::chrono::duration<double>(elapsed).count());
+}
+
+void CReadahead::close()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	closed_ = true;
+
+	blocks_.clear();
+}
+
+bool CReadahead::closed()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	return closed_;
+}
+
+size_t CReadahead::target() const
+{
+	// Nothing measured yet
+	if (readRate_ <= 0 || fetchTime_ <= 0)
+		return maxWindow_;
+
+	double window = 2 * readRate_ * fetchTime_;
+
+	return std::min<double>(std::max<double>(window, 2 * blockSize_), maxWindow_);
+}
+
+} // namespace OneDrive
@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef __READAHEAD_H_INCLUDED__
+#define __READAHEAD_H_INCLUDED__
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace OneDrive {
+
+// Follows the reads of an open file and, while they are sequential, has
+// the blocks ahead of them downloaded before they are asked for. The window
+// fetched ahead doubles with every sequential read, up to twice what the
+// reader consumes while a block is being downloaded: enough to keep ahead
+// of it on a slow link without holding more memory than needed on a fast
+// one. A read elsewhere in the file drops the window.
+class CReadahead
+{
+public:
+	// Null when it could not be fetched
+	typedef std::shared_ptr<const std::string> Block;
+
+	typedef std::chrono::steady_clock Clock;
+
+	// A block to fetch, by offset, and where to hand it in
+	typedef std::pair<off_t, std::shared_ptr<std::promise<Block>>> Fetch;
+
+	CReadahead(uint64_t fileSize, size_t blockSize, size_t maxWindow): fileSize_{fileSize},
+		blockSize_{blockSize}, maxWindow_{maxWindow}
+	{
+	}
+
+	~CReadahead()
+	{
+	}
+
+	CReadahead(const CReadahead &) = delete;
+	CReadahead & operator=(const CReadahead &) = delete;
+
+	size_t blockSize() const
+	{
+		return blockSize_;
+	}
+
+	// Notes a read and hands out the blocks to fetch ahead of it
+	void access(off_t offset, size_t size, std::vector<Fetch> &fetches);
+
+	// Copies a byte range out of the blocks fetched ahead, waiting for the
+	// ones still on their way, though not for long. Returns false if any of
+	// them is missing or late.
+	bool read(void *buf, size_t size, off_t offset);
+
+	// A block fetched ahead took that long to download
+	void fetched(Clock::duration elapsed);
+
+	// The file was closed; what is still to be fetched is not needed anymore
+	void close();
+
+	bool closed();
+
+private:
+	// How much is fetched ahead given the rates measured so far
+	size_t target() const;
+
+	const uint64_t    fileSize_;
+	const size_t      blockSize_;
+	const size_t      maxWindow_;
+	std::mutex        mutex_;
+	off_t             next_{};      // where a sequential read would start
+	size_t            window_{};
+	Clock::time_point lastAccess_;
+	double            readRate_{};  // bytes/s consumed by the reader
+	double            fetchTime_{}; // s taken by a block to download
+	bool              closed_{};
+
+	std::map<off_t, std::shared_future<Block>> blocks_;
+};
+
+} // namespace OneDrive
+
+#endif // __READAHEAD_H_INCLUDED__
@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <stdexcept>
+#include "log.h"
+#include "refresher.h"
+
+namespace OneDrive {
+
+const size_t CRefresher::maxQueued;
+
+void CRefresher::start()
+{
+	thread_ = std::thread(&CRefresher::run, this);
+}
+
+void CRefresher::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		stop_ = true;
+	}
+
+	cond_.notify_one();
+
+	if (thread_.joinable())
+		thread_.join();
+}
+
+bool CRefresher::schedule(const std::string &key, Task task)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (queued_.find(key) != queued_.end())
+			return true;
+
+		if (stop_ || queue_.size() >= maxQueued)
+			return false;
+
+		queued_.insert(key);
+		queue_.emplace_back(key, std::move(task));
+	}
+
+	cond_.notify_one();
+
+	return true;
+}
+
+void CRefresher::run()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	for (;;) {
+		cond_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+
+		if (stop_)
+			break;
+
+		std::pair<std::string, Task> refresh(std::move(queue_.front()));
+
+		queue_.pop_front();
+		queued_.erase(refresh.first);
+
+		lock.unlock();
+
+		try {
+			refresh.second();
+		} catch (const std::exception &e) {
+			LOG_WARN("failed to refresh " << refresh.first << ": " << e.what());
+		}
+
+		lock.lock();
+	}
+}
+
+} // namespace OneDrive
@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef __REFRESHER_H_INCLUDED__
+#define __REFRESHER_H_INCLUDED__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+
+namespace OneDrive {
+
+// Refreshes cached data on a background thread while the callers are
+// answered with what is cached. Refreshes are told apart by key, and one
+// already waiting to run is not queued again.
+class CRefresher
+{
+public:
+	typedef std::function<void()> Task;
+
+	CRefresher()
+	{
+	}
+
+	~CRefresher()
+	{
+		stop();
+	}
+
+	CRefresher(const CRefresher &) = delete;
+	CRefresher & operator=(const CRefresher &) = delete;
+
+	void start();
+
+	void stop();
+
+	// Returns false if the refresh could not be queued
+	bool schedule(const std::string &key, Task task);
+
+private:
+	// Past that, refreshes are dropped; what they were for is refreshed on
+	// the next use or, once too stale, by the caller
+	static const size_t maxQueued = 4096;
+
+	void run();
+
+	std::mutex                               mutex_;
+	std::condition_variable                  cond_;
+	std::deque<std::pair<std::string, Task>> queue_;
+	std::unordered_set<std::string>          queued_;
+	bool                                     stop_{};
+	std::thread                              thread_;
+};
+
+} // namespace OneDrive
+
+#endif // __REFRESHER_H_INCLUDED__
@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <algorithm>
+#include <random>
+#include "log.h"
+#include "retry.h"
+
+namespace OneDrive {
+
+bool CRetryPolicy::failed(CURLcode err, long respCode)
+{
+	switch (err) {
+	case CURLE_OK:
+		break;
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_CONNECT:
+	case CURLE_OPERATION_TIMEDOUT:
+	case CURLE_SSL_CONNECT_ERROR:
+	case CURLE_GOT_NOTHING:
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+	case CURLE_PARTIAL_FILE:
+	case CURLE_HTTP2:
+	case CURLE_HTTP2_STREAM:
+		return true;
+	default:
+		return false;
+	}
+
+	return respCode == 500 || respCode == 502 || respCode == 503 || respCode == 504;
+}
+
+std::chrono::milliseconds CRetryPolicy::backoff(unsigned int attempt, long retryAfter) const
+{
+	std::chrono::milliseconds maxDelay(profile_.maxDelay);
+
+	if (retryAfter > 0)
+		return std::min(std::chrono::milliseconds(std::chrono::seconds(retryAfter)), maxDelay);
+
+	// Full jitter: a random delay up to the exponentially growing ceiling
+	long ceiling = profile_.baseDelay;
+
+	for (unsigned int i = 0; i < attempt && ceiling < profile_.maxDelay; i++)
+		ceiling *= 2;
+
+	ceiling = std::min(ceiling, profile_.maxDelay);
+
+	thread_local std::mt19937 generator{std::random_device{}()};
+
+	std::uniform_int_distribution<long> distribution(ceiling / 2, ceiling);
+
+	return std::chrono::milliseconds(distribution(generator));
+}
+
+CRateLimiter::CRateLimiter(double rate, double burst): maxRate_{rate}, minRate_{std::min(1.0, rate)},
+	rate_{rate}, burst_{burst}, tokens_{burst}, last_{std::chrono::steady_clock::now()}
+{
+}
+
+void CRateLimiter::refill(std::chrono::steady_clock::time_point now)
+{
+	std::chrono::duration<double> elapsed = now - last_;
+
+	tokens_ = std::min(burst_, tokens_ + elapsed.count() * rate_);
+	last_ = now;
+}
+
+std::chrono::milliseconds CRateLimiter::reserve()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	refill(std::chrono::steady_clock::now());
+
+	// The bucket goes into debt so that the requests waiting for a token
+	// are spread evenly at the current rate
+	tokens_ -= 1;
+
+	if (tokens_ >= 0)
+		return std::chrono::milliseconds(0);
+
+	return std::chrono::milliseconds(static_cast<long>(-tokens_ / rate_ * 1000));
+}
+
+void CRateLimiter::throttled(long retryAfter)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	refill(std::chrono::steady_clock::now());
+
+	rate_ = std::max(minRate_, rate_ / 2);
+
+	if (retryAfter > 0)
+		tokens_ = std::min(tokens_, -retryAfter * rate_);
+
+	LOG_WARN("throttled by the server, the request rate is now " << rate_ << "/s");
+}
+
+void CRateLimiter::succeeded()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (rate_ >= maxRate_)
+		return;
+
+	refill(std::chrono::steady_clock::now());
+
+	rate_ = std::min(maxRate_, rate_ + maxRate_ / 100);
+}
+
+bool CCircuitBreaker::allow()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	switch (state_) {
+	case STATE_CLOSED:
+		return true;
+	case STATE_OPEN:
+		if (std::chrono::steady_clock::now() - openedAt_ < openTime_)
+			return false;
+		state_ = STATE_HALF_OPEN;
+		probedAt_ = std::chrono::steady_clock::now();
+		return true;
+	case STATE_HALF_OPEN:
+		// A probe is already on its way, unless it got lost without
+		// reporting back
+		if (std::chrono::steady_clock::now() - probedAt_ < openTime_)
+			return false;
+		probedAt_ = std::chrono::steady_clock::now();
+		return true;
+	}
+
+	return false;
+}
+
+void CCircuitBreaker::succeeded()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (state_ != STATE_CLOSED)
+		LOG_INFO("the service has recovered");
+
+	state_ = STATE_CLOSED;
+	failures_ = 0;
+}
+
+void CCircuitBreaker::failed()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	failures_++;
+
+	if (state_ == STATE_HALF_OPEN || (state_ == STATE_CLOSED && failures_ >= threshold_)) {
+		LOG_WARN("the service appears to be down, failing requests for the next " << openTime_.count() << "s");
+		state_ = STATE_OPEN;
+		openedAt_ = std::chrono::steady_clock::now();
+	}
+}
+
+} // namespace OneDrive
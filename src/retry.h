@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef __RETRY_H_INCLUDED__
+#define __RETRY_H_INCLUDED__
+
+#include <curl/curl.h>
+#include <chrono>
+#include <mutex>
+#include "appconfig.h"
+
+namespace OneDrive {
+
+// Decides which failed attempts are worth repeating and how long to wait
+// before doing so
+class CRetryPolicy
+{
+public:
+	explicit CRetryPolicy(const CRetryProfile &profile): profile_(profile)
+	{
+	}
+
+	~CRetryPolicy()
+	{
+	}
+
+	CRetryPolicy(const CRetryPolicy &) = delete;
+	CRetryPolicy & operator=(const CRetryPolicy &) = delete;
+
+	unsigned int maxRetries() const
+	{
+		return profile_.maxRetries;
+	}
+
+	// The server is asking us to slow down
+	static bool throttled(long respCode)
+	{
+		return respCode == 429 || respCode == 503;
+	}
+
+	// The server or the network failed to handle the request
+	static bool failed(CURLcode err, long respCode);
+
+	// A Retry-After given by the server wins over the jittered exponential
+	// backoff, but is still capped
+	std::chrono::milliseconds backoff(unsigned int attempt, long retryAfter) const;
+
+private:
+	CRetryProfile profile_;
+};
+
+// A token bucket which halves its rate when the server throttles us and
+// slowly grows it back towards the configured rate as requests succeed
+class CRateLimiter
+{
+public:
+	CRateLimiter(double rate, double burst);
+
+	~CRateLimiter()
+	{
+	}
+
+	CRateLimiter(const CRateLimiter &) = delete;
+	CRateLimiter & operator=(const CRateLimiter &) = delete;
+
+	// Takes a token for a request and returns how long the request must be
+	// held back until the token is actually available
+	std::chrono::milliseconds reserve();
+
+	// When the server asked for a pause, no token is handed out before it ends
+	void throttled(long retryAfter);
+
+	void succeeded();
+
+private:
+	void refill(std::chrono::steady_clock::time_point now);
+
+	std::mutex                            mutex_;
+	double                                maxRate_;
+	double                                minRate_;
+	double                                rate_;
+	double                                burst_;
+	double                                tokens_;
+	std::chrono::steady_clock::time_point last_;
+};
+
+// Stops sending requests once the service keeps failing, so that callers
+// fail fast during an outage instead of piling up. After a while a single
+// probe is let through to find out whether the service has recovered.
+class CCircuitBreaker
+{
+public:
+	CCircuitBreaker(unsigned int threshold, std::chrono::seconds openTime):
+		threshold_{threshold}, openTime_{openTime}
+	{
+	}
+
+	~CCircuitBreaker()
+	{
+	}
+
+	CCircuitBreaker(const CCircuitBreaker &) = delete;
+	CCircuitBreaker & operator=(const CCircuitBreaker &) = delete;
+
+	bool allow();
+
+	void succeeded();
+
+	void failed();
+
+private:
+	enum State {
+		STATE_CLOSED,
+		STATE_OPEN,
+		STATE_HALF_OPEN
+	};
+
+	std::mutex                            mutex_;
+	unsigned int                          threshold_;
+	std::chrono::seconds                  openTime_;
+	State                                 state_{STATE_CLOSED};
+	unsigned int                          failures_{};
+	std::chrono::steady_clock::time_point openedAt_;
+	std::chrono::steady_clock::time_point probedAt_;
+};
+
+} // namespace OneDrive
+
+#endif // __RETRY_H_INCLUDED__
@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <algorithm>
+#include "scheduler.h"
+
+namespace OneDrive {
+
+CScheduler::CScheduler(const CSchedulerProfile &profile, unsigned int connections): profile_(profile),
+	connections_{connections}
+{
+	limits_[PRIORITY_INTERACTIVE] = profile_.interactiveSlots;
+	limits_[PRIORITY_READ]        = profile_.readSlots;
+	limits_[PRIORITY_STREAM]      = profile_.streamSlots;
+	limits_[PRIORITY_BACKGROUND]  = profile_.backgroundSlots;
+	limits_[PRIORITY_UPLOAD]      = profile_.uploadSlots;
+
+	unsigned int bulk = 0;
+
+	for (int i = PRIORITY_READ; i < PRIORITY_CLASSES; i++)
+		bulk += limits_[i];
+
+	// At least one, even if the other classes were given more slots than
+	// there are connections
+	reserved_ = connections_ > bulk ? connections_ - bulk : 1;
+	reserved_ = std::min(reserved_, limits_[PRIORITY_INTERACTIVE]);
+}
+
+CScheduler::CSlot CScheduler::acquire(Priority priority)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	waiting_[priority]++;
+
+	cond_.wait(lock, [this, priority] { return admissible(priority); });
+
+	waiting_[priority]--;
+
+	active_[priority]++;
+	busy_++;
+
+	return CSlot(*this, priority);
+}
+
+std::unique_ptr<CScheduler::CSlot> CScheduler::tryAcquire(Priority priority)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (!admissible(priority))
+		return nullptr;
+
+	active_[priority]++;
+	busy_++;
+
+	return std::unique_ptr<CSlot>(new CSlot(*this, priority));
+}
+
+void CScheduler::release(Priority priority)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		active_[priority]--;
+		busy_--;
+	}
+
+	// The waiters of several classes may be after the connection
+	cond_.notify_all();
+}
+
+bool CScheduler::admissible(Priority priority) const
+{
+	if (busy_ >= connections_ || active_[priority] >= limits_[priority])
+		return false;
+
+	// The connections kept for the lookups, which long transfers of the
+	// other classes could otherwise hold on to
+	if (priority != PRIORITY_INTERACTIVE && busy_ + reserved_ >= connections_)
+		return false;
+
+	// A more urgent request which could use the connection goes first
+	for (int i = PRIORITY_INTERACTIVE; i < priority; i++)
+		if (waiting_[i] > 0 && active_[i] < limits_[i])
+			return false;
+
+	return true;
+}
+
+curl_off_t CScheduler::maxRecvSpeed(Priority priority) const
+{
+	// Splitting the cap evenly keeps the class under it at full concurrency
+	if (priority == PRIORITY_BACKGROUND && profile_.backgroundRate > 0)
+		return std::max<curl_off_t>(1, profile_.backgroundRate / limits_[priority]);
+
+	return 0;
+}
+
+curl_off_t CScheduler::maxSendSpeed(Priority priority) const
+{
+	if (priority == PRIORITY_UPLOAD && profile_.uploadRate > 0)
+		return std::max<curl_off_t>(1, profile_.uploadRate / limits_[priority]);
+
+	return 0;
+}
+
+} // namespace OneDrive
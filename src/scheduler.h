@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef __SCHEDULER_H_INCLUDED__
+#define __SCHEDULER_H_INCLUDED__
+
+#include <curl/curl.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include "appconfig.h"
+
+namespace OneDrive {
+
+// Hands out the connections to the classes of requests by priority, so an
+// interactive lookup never queues behind a bulk transfer. Each class is
+// also bounded on its own, which keeps connections free for the classes
+// above it, and the connections the other classes may not have between
+// them are kept for the interactive requests.
+class CScheduler
+{
+public:
+	// In the order in which waiting requests are served
+	enum Priority {
+		PRIORITY_INTERACTIVE, // metadata needed to answer a file system call
+		PRIORITY_READ,        // data needed to answer a read
+		PRIORITY_STREAM,      // data streamed ahead of a sequential reader
+		PRIORITY_BACKGROUND,  // prefetching and synchronization
+		PRIORITY_UPLOAD,
+		PRIORITY_CLASSES
+	};
+
+	class CSlot
+	{
+	public:
+		CSlot(CScheduler &scheduler, Priority priority): scheduler_{&scheduler}, priority_{priority}
+		{
+		}
+
+		CSlot(CSlot &&slot): scheduler_{slot.scheduler_}, priority_{slot.priority_}
+		{
+			slot.scheduler_ = nullptr;
+		}
+
+		~CSlot()
+		{
+			if (scheduler_)
+				scheduler_->release(priority_);
+		}
+
+		CSlot(const CSlot &) = delete;
+		CSlot & operator=(const CSlot &) = delete;
+
+		Priority priority() const
+		{
+			return priority_;
+		}
+
+	private:
+		CScheduler *scheduler_;
+		Priority    priority_;
+	};
+
+	CScheduler(const CSchedulerProfile &profile, unsigned int connections);
+
+	~CScheduler()
+	{
+	}
+
+	CScheduler(const CScheduler &) = delete;
+	CScheduler & operator=(const CScheduler &) = delete;
+
+	// Blocks until a connection is available to the class and no request of
+	// a more urgent class is waiting for one
+	CSlot acquire(Priority priority);
+
+	// Hands out a connection only if one is available right away; null
+	// otherwise
+	std::unique_ptr<CSlot> tryAcquire(Priority priority);
+
+	// The speed caps of a single transfer of the class, in bytes/s; 0 means
+	// unlimited. A transfer gets its share of the class cap whether or not
+	// the other slots are in use, as curl fixes the cap when it starts.
+	curl_off_t maxRecvSpeed(Priority priority) const;
+
+	curl_off_t maxSendSpeed(Priority priority) const;
+
+private:
+	void release(Priority priority);
+
+	bool admissible(Priority priority) const;
+
+	CSchedulerProfile       profile_;
+	unsigned int            connections_;
+	unsigned int            limits_[PRIORITY_CLASSES];
+	unsigned int            reserved_; // connections only interactive requests get
+	std::mutex              mutex_;
+	std::condition_variable cond_;
+	unsigned int            busy_{};
+	unsigned int            active_[PRIORITY_CLASSES]{};
+	unsigned int            waiting_[PRIORITY_CLASSES]{};
+};
+
+} // namespace OneDrive
+
+#endif // __SCHEDULER_H_INCLUDED__
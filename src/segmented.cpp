@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "log.h"
+#include "segmented.h"
+
+namespace OneDrive {
+
+bool CSegmentedDownload::next(std::string &data, off_t &offset)
+{
+	fill();
+
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	for (;;) {
+		if (closed_ || segments_.empty())
+			return false;
+
+		const off_t start = segments_.begin()->first;
+
+		cond_.wait(lock, [this] { return closed_ || segments_.begin()->second.done; });
+
+		if (closed_)
+			return false;
+
+		CSegment &segment = segments_.begin()->second;
+
+		if (!segment.error)
+			break;
+
+		if (++segment.attempts >= maxAttempts)
+			std::rethrow_exception(segment.error);
+
+		segment.done  = false;
+		segment.error = nullptr;
+
+		const size_t size = segment.size;
+
+		lock.unlock();
+
+		issue(start, size);
+
+		lock.lock();
+	}
+
+	offset = segments_.begin()->first;
+	data   = std::move(segments_.begin()->second.data);
+
+	segments_.erase(segments_.begin());
+
+	lock.unlock();
+
+	fill();
+
+	return true;
+}
+
+bool CSegmentedDownload::read(void *buf, size_t size, off_t offset)
+{
+	std::lock_guard<std::mutex> lock(readMutex_);
+
+	char *p = static_cast<char *>(buf);
+
+	while (size > 0) {
+		const off_t currentEnd = currentOffset_ + current_.size();
+
+		// Behind what is left, or further ahead than what is on its way
+		if (offset < currentOffset_ || offset - currentEnd >= static_cast<off_t>(segmentSize_ * count_)) {
+			close();
+			return false;
+		}
+
+		if (offset >= currentEnd) {
+			try {
+				if (next(current_, currentOffset_))
+					continue;
+			} catch (const std::exception &e) {
+				LOG_WARN("segmented download failed at " << currentEnd << ": " << e.what());
+			}
+
+			close();
+			return false;
+		}
+
+		const size_t n = std::min<size_t>(size, currentEnd - offset);
+
+		std::memcpy(p, current_.data() + (offset - currentOffset_), n);
+
+		p      += n;
+		size   -= n;
+		offset += n;
+	}
+
+	return true;
+}
+
+void CSegmentedDownload::close()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	closed_ = true;
+
+	segments_.clear();
+
+	cond_.notify_all();
+}
+
+bool CSegmentedDownload::closed()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	return closed_;
+}
+
+void CSegmentedDownload::fill()
+{
+	std::vector<std::pair<off_t, size_t>> issues;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		while (!closed_ && segments_.size() < count_ && static_cast<uint64_t>(issued_) < end_) {
+			const size_t size = std::min<uint64_t>(segmentSize_, end_ - issued_);
+
+			segments_.emplace(issued_, CSegment{size, std::string(), nullptr, false, 0});
+			issues.emplace_back(issued_, size);
+
+			issued_ += size;
+		}
+	}
+
+	// Issuing may wait for a connection
+	for (auto &&i : issues)
+		issue(i.first, i.second);
+}
+
+void CSegmentedDownload::issue(off_t offset, size_t size)
+{
+	std::weak_ptr<CSegmentedDownload> weak(shared_from_this());
+
+	try {
+		fetch_(offset, size, [weak, offset](std::string data, std::exception_ptr error) {
+			std::shared_ptr<CSegmentedDownload> self(weak.lock());
+
+			if (self)
+				self->fetched(offset, std::move(data), error);
+		});
+	} catch (...) {
+		fetched(offset, std::string(), std::current_exception());
+	}
+}
+
+void CSegmentedDownload::fetched(off_t offset, std::string data, std::exception_ptr error)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto i = segments_.find(offset);
+
+	// Closed meanwhile
+	if (i == segments_.end())
+		return;
+
+	// The file changed under the download
+	if (!error && data.size() != i->second.size)
+		error = std::make_exception_ptr(std::runtime_error("short segment at " + std::to_string(offset)));
+
+	i->second.done  = true;
+	i->second.error = error;
+	i->second.data  = std::move(data);
+
+	cond_.notify_all();
+}
+
+} // namespace OneDrive
@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef __SEGMENTED_H_INCLUDED__
+#define __SEGMENTED_H_INCLUDED__
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace OneDrive {
+
+// Downloads a byte range of a file as segments fetched over several
+// connections at once and handed out in order. No more segments than
+// allowed are in flight or waiting to be handed out, which bounds the
+// memory held. A segment which failed is fetched again a few times before
+// the whole download fails.
+class CSegmentedDownload : public std::enable_shared_from_this<CSegmentedDownload>
+{
+public:
+	typedef std::function<void(std::string data, std::exception_ptr error)> Done;
+
+	// Fetches a byte range; done may run on any thread, this one included
+	typedef std::function<void(off_t offset, size_t size, Done done)> Fetch;
+
+	CSegmentedDownload(Fetch fetch, off_t offset, uint64_t end, size_t segmentSize, unsigned int segments):
+		fetch_{std::move(fetch)}, end_{end}, segmentSize_{segmentSize}, count_{segments}, issued_{offset},
+		currentOffset_{offset}
+	{
+	}
+
+	~CSegmentedDownload()
+	{
+	}
+
+	CSegmentedDownload(const CSegmentedDownload &) = delete;
+	CSegmentedDownload & operator=(const CSegmentedDownload &) = delete;
+
+	// Waits for the next segment. Returns false once all of them were
+	// handed out, or if the download was closed; throws if a segment could
+	// not be fetched. Meant for a single consumer.
+	bool next(std::string &data, off_t &offset);
+
+	// Serves a read of a sequential reader out of the segments, in the way
+	// CStream does. Returns false, and closes the download, if the read
+	// cannot be served.
+	bool read(void *buf, size_t size, off_t offset);
+
+	// Drops the segments still on their way
+	void close();
+
+	bool closed();
+
+private:
+	struct CSegment {
+		size_t             size;
+		std::string        data;
+		std::exception_ptr error;
+		bool               done;
+		unsigned int       attempts;
+	};
+
+	// Fetches of a segment before its error is passed on
+	static const unsigned int maxAttempts = 3;
+
+	Fetch                     fetch_;
+	const uint64_t            end_;
+	const size_t              segmentSize_;
+	const unsigned int        count_;
+	std::mutex                mutex_;
+	std::condition_variable   cond_;
+	std::map<off_t, CSegment> segments_; // issued and not handed out yet
+	off_t                     issued_;   // where the next segment starts
+	bool                      closed_{};
+
+	// The last segment handed out to the readers
+	std::mutex                readMutex_;
+	std::string               current_;
+	off_t                     currentOffset_;
+
+	// Issues segments until as many as allowed are pending
+	void fill();
+
+	void issue(off_t offset, size_t size);
+
+	void fetched(off_t offset, std::string data, std::exception_ptr error);
+};
+
+} // namespace OneDrive
+
+#endif // __SEGMENTED_H_INCLUDED__
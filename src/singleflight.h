@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef __SINGLEFLIGHT_H_INCLUDED__
+#define __SINGLEFLIGHT_H_INCLUDED__
+
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace OneDrive {
+
+// Lets concurrent callers asking for the same thing share a single fetch.
+// The first caller with a given key runs the fetch; whoever comes with the
+// same key while it is in flight waits for it and gets the same result,
+// or the same exception.
+template <typename Result>
+class CSingleFlight
+{
+public:
+	typedef std::function<Result()> Fetch;
+
+	CSingleFlight()
+	{
+	}
+
+	~CSingleFlight()
+	{
+	}
+
+	CSingleFlight(const CSingleFlight &) = delete;
+	CSingleFlight & operator=(const CSingleFlight &) = delete;
+
+	Result run(const std::string &key, const Fetch &fetch)
+	{
+		std::shared_ptr<std::promise<Result>> promise;
+		std::shared_future<Result> result;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			auto i = flights_.find(key);
+
+			if (i != flights_.end()) {
+				result = i->second;
+			} else {
+				promise.reset(new std::promise<Result>());
+				result = promise->get_future().share();
+
+				flights_.emplace(key, result);
+			}
+		}
+
+		if (!promise)
+			return result.get();
+
+		try {
+			promise->set_value(fetch());
+		} catch (...) {
+			promise->set_exception(std::current_exception());
+		}
+
+		// Whoever comes from now on fetches again
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			flights_.erase(key);
+		}
+
+		return result.get();
+	}
+
+private:
+	std::mutex                                                  mutex_;
+	std::unordered_map<std::string, std::shared_future<Result>> flights_;
+};
+
+} // namespace OneDrive
+
+#endif // __SINGLEFLIGHT_H_INCLUDED__
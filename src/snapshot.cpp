@@ -0,0 +1,285 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include "log.h"
+#include "snapshot.h"
+
+namespace OneDrive {
+
+const char CSnapshot::magic_[8] = {'O', 'D', 'F', 'S', 'S', 'N', 'P', '2'};
+
+const uint32_t CSnapshot::none;
+
+CSnapshot::~CSnapshot()
+{
+	if (map_)
+		munmap(map_, size_);
+}
+
+bool CSnapshot::load(const std::string &path)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+
+	if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(CHeader)) {
+		close(fd);
+		return false;
+	}
+
+	void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return false;
+
+	const size_t size = st.st_size;
+	const CHeader *header = static_cast<const CHeader *>(map);
+
+	// Only the layout is checked here, so that loading does not depend on
+	// the number of items; the strings are checked as they are read
+	bool valid = memcmp(header->magic, magic_, sizeof(magic_)) == 0 &&
+		     header->itemsOffset % alignof(CItem) == 0 &&
+		     header->itemsOffset <= size && (size - header->itemsOffset) / sizeof(CItem) >= header->count &&
+		     header->idsOffset % alignof(uint32_t) == 0 &&
+		     header->idsOffset <= size && (size - header->idsOffset) / sizeof(uint32_t) >= header->count &&
+		     header->stringsOffset <= size && size - header->stringsOffset >= header->stringsSize;
+
+	if (!valid) {
+		LOG_WARN("ignoring the metadata snapshot " << path << ": the file is damaged or from another version");
+
+		munmap(map, size);
+		return false;
+	}
+
+	map_     = map;
+	size_    = size;
+	header_  = header;
+	count_   = header->count;
+	items_   = reinterpret_cast<const CItem *>(static_cast<const char *>(map) + header->itemsOffset);
+	ids_     = reinterpret_cast<const uint32_t *>(static_cast<const char *>(map) + header->idsOffset);
+	strings_ = static_cast<const char *>(map) + header->stringsOffset;
+
+	return true;
+}
+
+void CSnapshot::save(const std::string &path, const std::vector<CEntry> &entries, const std::string &deltaLink)
+{
+	if (entries.size() >= none)
+		throw std::runtime_error("too many items for a metadata snapshot");
+
+	std::string strings;
+
+	auto add = [&strings](const std::string &s) {
+		CStringRef ref{static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(s.size())};
+
+		strings += s;
+
+		if (strings.size() >= none)
+			throw std::runtime_error("too much metadata for a snapshot");
+
+		return ref;
+	};
+
+	std::vector<CItem> items(entries.size());
+
+	for (size_t i = 0; i < entries.size(); i++) {
+		const CDriveItem &driveItem = entries[i].item;
+		CItem &item = items[i];
+
+		item.id           = add(driveItem.id());
+		item.name         = add(driveItem.name());
+		item.size         = add(driveItem.size());
+		item.createTime   = add(driveItem.createTime());
+		item.modifiedTime = add(driveItem.modifiedTime());
+		item.hash         = add(driveItem.hash());
+		item.cTag         = add(driveItem.cTag());
+		item.parent       = entries[i].parent;
+		item.firstChild   = none;
+		item.childCount   = 0;
+		item.type         = driveItem.type();
+		item.listed       = entries[i].listed;
+
+		if (item.parent == none)
+			continue;
+
+		CItem &parent = items[item.parent];
+
+		if (parent.firstChild == none)
+			parent.firstChild = i;
+
+		parent.childCount++;
+	}
+
+	std::vector<uint32_t> ids(entries.size());
+
+	for (size_t i = 0; i < ids.size(); i++)
+		ids[i] = i;
+
+	std::sort(ids.begin(), ids.end(), [&entries](uint32_t a, uint32_t b) {
+		return entries[a].item.id() < entries[b].item.id();
+	});
+
+	CHeader header{};
+
+	memcpy(header.magic, magic_, sizeof(magic_));
+
+	header.count         = entries.size();
+	header.itemsOffset   = sizeof(header);
+	header.idsOffset     = header.itemsOffset + items.size() * sizeof(CItem);
+	header.stringsOffset = header.idsOffset + ids.size() * sizeof(uint32_t);
+	header.deltaLink     = add(deltaLink);
+	header.stringsSize   = strings.size();
+
+	const std::string tmpPath = path + ".tmp";
+
+	{
+		std::ofstream f(tmpPath, std::ios::binary | std::ios::trunc);
+
+		if (!f)
+			throw std::runtime_error("failed to create " + tmpPath);
+
+		f.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		f.write(reinterpret_cast<const char *>(items.data()), items.size() * sizeof(CItem));
+		f.write(reinterpret_cast<const char *>(ids.data()), ids.size() * sizeof(uint32_t));
+		f.write(strings.data(), strings.size());
+
+		if (!f.flush())
+			throw std::runtime_error("failed to write " + tmpPath);
+	}
+
+	if (std::rename(tmpPath.c_str(), path.c_str()) < 0)
+		throw std::runtime_error("failed to replace " + path);
+}
+
+std::string CSnapshot::deltaLink() const
+{
+	return header_ ? string(header_->deltaLink) : std::string();
+}
+
+CDriveItem CSnapshot::item(uint32_t index) const
+{
+	const CItem &item = items_[index];
+
+	CDriveItem driveItem(string(item.id), string(item.name), string(item.size), string(item.createTime),
+			     string(item.modifiedTime), "",
+			     item.type <= CDriveItem::DRIVE_ITEM_UNKNOWN ?
+			     static_cast<CDriveItem::DriveItemType>(item.type) : CDriveItem::DRIVE_ITEM_UNKNOWN);
+
+	driveItem.setHash(string(item.hash));
+	driveItem.setCTag(string(item.cTag));
+
+	return driveItem;
+}
+
+std::string CSnapshot::id(uint32_t index) const
+{
+	return string(items_[index].id);
+}
+
+uint32_t CSnapshot::parent(uint32_t index) const
+{
+	return items_[index].parent < count_ ? items_[index].parent : none;
+}
+
+bool CSnapshot::listed(uint32_t index) const
+{
+	return items_[index].listed;
+}
+
+uint32_t CSnapshot::child(uint32_t parent, const std::string &name) const
+{
+	const CItem &item = items_[parent];
+
+	if (item.childCount == 0 || item.firstChild >= count_ || count_ - item.firstChild < item.childCount)
+		return none;
+
+	uint32_t first = item.firstChild;
+	uint32_t last = item.firstChild + item.childCount;
+
+	while (first < last) {
+		uint32_t middle = first + (last - first) / 2;
+		int result = compare(items_[middle].name, name);
+
+		if (result == 0)
+			return middle;
+
+		if (result < 0)
+			first = middle + 1;
+		else
+			last = middle;
+	}
+
+	return none;
+}
+
+void CSnapshot::children(uint32_t parent, std::vector<uint32_t> &children) const
+{
+	const CItem &item = items_[parent];
+
+	if (item.childCount == 0 || item.firstChild >= count_ || count_ - item.firstChild < item.childCount)
+		return;
+
+	for (uint32_t i = 0; i < item.childCount; i++)
+		children.push_back(item.firstChild + i);
+}
+
+uint32_t CSnapshot::find(const std::string &id) const
+{
+	uint32_t first = 0;
+	uint32_t last = count_;
+
+	while (first < last) {
+		uint32_t middle = first + (last - first) / 2;
+
+		if (ids_[middle] >= count_)
+			return none;
+
+		int result = compare(items_[ids_[middle]].id, id);
+
+		if (result == 0)
+			return ids_[middle];
+
+		if (result < 0)
+			first = middle + 1;
+		else
+			last = middle;
+	}
+
+	return none;
+}
+
+std::string CSnapshot::string(const CStringRef &ref) const
+{
+	if (ref.offset > header_->stringsSize || header_->stringsSize - ref.offset < ref.length)
+		return std::string();
+
+	return std::string(strings_ + ref.offset, ref.length);
+}
+
+int CSnapshot::compare(const CStringRef &ref, const std::string &s) const
+{
+	if (ref.offset > header_->stringsSize || header_->stringsSize - ref.offset < ref.length)
+		return -1;
+
+	int result = memcmp(strings_ + ref.offset, s.data(), std::min<size_t>(ref.length, s.size()));
+
+	if (result != 0)
+		return result;
+
+	return ref.length < s.size() ? -1 : ref.length > s.size() ? 1 : 0;
+}
+
+} // namespace OneDrive
@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef __SNAPSHOT_H_INCLUDED__
+#define __SNAPSHOT_H_INCLUDED__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "driveitem.h"
+
+namespace OneDrive {
+
+// The item tree saved by a previous mount: a flat array of items, a string
+// pool and the delta link the items are current with. The file is mapped
+// and searched in place, so opening it costs the same whatever the size of
+// the drive. The children of a folder are stored next to each other and
+// sorted by name; the items are also indexed by id.
+class CSnapshot
+{
+public:
+	static const uint32_t none = 0xffffffff;
+
+	// An item to be saved. The items must come parents first, with the
+	// children of a folder next to each other and sorted by name.
+	struct CEntry {
+		CDriveItem item;
+		uint32_t   parent; // none for the root
+		bool       listed; // all the children follow
+	};
+
+	CSnapshot()
+	{
+	}
+
+	~CSnapshot();
+
+	CSnapshot(const CSnapshot &) = delete;
+	CSnapshot & operator=(const CSnapshot &) = delete;
+
+	// Maps a snapshot file. Returns false when there is none or it cannot
+	// be used.
+	bool load(const std::string &path);
+
+	static void save(const std::string &path, const std::vector<CEntry> &entries, const std::string &deltaLink);
+
+	std::string deltaLink() const;
+
+	uint32_t root() const
+	{
+		return count_ > 0 ? 0 : none;
+	}
+
+	CDriveItem item(uint32_t index) const;
+
+	std::string id(uint32_t index) const;
+
+	uint32_t parent(uint32_t index) const;
+
+	// Whether all the children of the folder were saved
+	bool listed(uint32_t index) const;
+
+	uint32_t child(uint32_t parent, const std::string &name) const;
+
+	void children(uint32_t parent, std::vector<uint32_t> &children) const;
+
+	uint32_t find(const std::string &id) const;
+
+private:
+	struct CStringRef {
+		uint32_t offset;
+		uint32_t length;
+	};
+
+	struct CHeader {
+		char       magic[8];
+		uint32_t   count;
+		uint32_t   reserved;
+		uint64_t   itemsOffset;
+		uint64_t   idsOffset;
+		uint64_t   stringsOffset;
+		uint64_t   stringsSize;
+		CStringRef deltaLink;
+	};
+
+	struct CItem {
+		CStringRef id;
+		CStringRef name;
+		CStringRef size;
+		CStringRef createTime;
+		CStringRef modifiedTime;
+		CStringRef hash;
+		CStringRef cTag;
+		uint32_t   parent;
+		uint32_t   firstChild;
+		uint32_t   childCount;
+		uint8_t    type;
+		uint8_t    listed;
+		uint8_t    reserved[2];
+	};
+
+	static const char magic_[8];
+
+	std::string string(const CStringRef &ref) const;
+
+	int compare(const CStringRef &ref, const std::string &s) const;
+
+	void       *map_{};
+	size_t      size_{};
+	uint32_t    count_{};
+	const CHeader  *header_{};
+	const CItem    *items_{};
+	const uint32_t *ids_{};
+	const char     *strings_{};
+};
+
+} // namespace OneDrive
+
+#endif // __SNAPSHOT_H_INCLUDED__
@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <algorithm>
+#include <cstring>
+#include "log.h"
+#include "stream.h"
+
+namespace {
+
+// How long a read ahead of the stream waits for the ones before it
+const std::chrono::milliseconds reorderWait(20);
+
+} // anonymous namespace
+
+namespace OneDrive {
+
+void CStream::open(const std::string &url)
+{
+	std::shared_ptr<CStream> self(shared_from_this());
+
+	// A retry picks up where the previous attempt stopped
+	graph_->submit([self, url](CCurl &curl) {
+		off_t offset;
+
+		{
+			std::lock_guard<std::mutex> lock(self->mutex_);
+
+			self->curl_   = &curl;
+			self->paused_ = false;
+
+			offset = self->received_;
+		}
+
+		curl.prepareStream(url, offset, [self](const char *data, size_t size) {
+			return self->take(data, size);
+		});
+	}, [self](CCurl & /*curl*/, long respCode, std::exception_ptr error) {
+		self->finished(respCode, error);
+	}, CScheduler::PRIORITY_STREAM, false);
+}
+
+bool CStream::read(void *buf, size_t size, off_t offset)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	cond_.wait_for(lock, reorderWait, [&] { return closed_ || (!busy_ && position_ >= offset); });
+	cond_.wait(lock, [this] { return closed_ || !busy_; });
+
+	if (closed_ || offset < position_ || offset - position_ > static_cast<off_t>(capacity_)) {
+		lock.unlock();
+
+		close();
+
+		return false;
+	}
+
+	busy_     = true;
+	lastRead_ = Clock::now();
+
+	char *p = static_cast<char *>(buf);
+	bool served = true;
+
+	while (size > 0) {
+		cond_.wait(lock, [this] { return closed_ || done_ || buffered() > 0; });
+
+		if (closed_ || buffered() == 0) {
+			served = false;
+			break;
+		}
+
+		size_t n = buffered();
+
+		if (position_ < offset) {
+			n = std::min<size_t>(n, offset - position_);
+		} else {
+			n = std::min(n, size);
+
+			std::memcpy(p, buffer_.data() + head_, n);
+
+			p    += n;
+			size -= n;
+		}
+
+		head_     += n;
+		position_ += n;
+
+		if (head_ >= capacity_) {
+			buffer_.erase(0, head_);
+			head_ = 0;
+		}
+
+		if (paused_ && buffered() <= capacity_ / 2) {
+			paused_ = false;
+			resume();
+		}
+	}
+
+	busy_ = false;
+	cond_.notify_all();
+
+	if (!served) {
+		lock.unlock();
+
+		close();
+	}
+
+	return served;
+}
+
+void CStream::close()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	closed_ = true;
+
+	buffer_.clear();
+	head_ = 0;
+
+	cond_.notify_all();
+
+	// Handed the data again, the sink aborts the transfer
+	if (paused_) {
+		paused_ = false;
+		resume();
+	}
+}
+
+bool CStream::closed()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	return closed_;
+}
+
+CStream::Clock::duration CStream::idle()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	return Clock::now() - lastRead_;
+}
+
+size_t CStream::take(const char *data, size_t size)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (closed_)
+		return 0;
+
+	// The buffer may overshoot its capacity by one piece
+	if (buffered() >= capacity_) {
+		paused_ = true;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+
+	buffer_.append(data, size);
+	received_ += size;
+
+	cond_.notify_all();
+
+	return size;
+}
+
+void CStream::finished(long respCode, std::exception_ptr error)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	curl_   = nullptr;
+	paused_ = false;
+	done_   = true;
+
+	// Reaching the end of the file is how a stream normally ends
+	if (!closed_ && !error && respCode != 206 && respCode != 416)
+		error = std::make_exception_ptr(CHttpError("HTTP error while streaming: ", respCode));
+
+	if (error && !closed_) {
+		try {
+			std::rethrow_exception(error);
+		} catch (const std::exception &e) {
+			LOG_WARN("streaming stopped at " << received_ << ": " << e.what());
+		} catch (...) {
+		}
+	}
+
+	cond_.notify_all();
+}
+
+void CStream::resume()
+{
+	std::weak_ptr<CStream> weak(shared_from_this());
+
+	try {
+		graph_->post([weak]() {
+			std::shared_ptr<CStream> self(weak.lock());
+
+			if (!self)
+				return;
+
+			CCurl *curl;
+
+			{
+				std::lock_guard<std::mutex> lock(self->mutex_);
+
+				curl = self->curl_;
+			}
+
+			// Unpausing may hand the data to the sink right away
+			if (curl)
+				curl_easy_pause(curl->handle(), CURLPAUSE_CONT);
+		});
+	} catch (const std::exception &e) {
+		LOG_WARN("could not resume streaming: " << e.what());
+	}
+}
+
+} // namespace OneDrive
@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef __STREAM_H_INCLUDED__
+#define __STREAM_H_INCLUDED__
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "curl.h"
+#include "graph.h"
+
+namespace OneDrive {
+
+// An open-ended download of a file from an offset on, which feeds the
+// successive reads of a sequential reader without a request each. What
+// arrives ahead of the reader is held in a bounded buffer; the transfer is
+// paused while the buffer is full and resumed once half of it has been
+// read. A read the stream cannot serve, such as one behind it, closes it.
+class CStream : public std::enable_shared_from_this<CStream>
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	CStream(CGraph *graph, off_t offset, size_t capacity): graph_{graph}, position_{offset}, received_{offset},
+		capacity_{capacity}, lastRead_{Clock::now()}
+	{
+	}
+
+	~CStream()
+	{
+	}
+
+	CStream(const CStream &) = delete;
+	CStream & operator=(const CStream &) = delete;
+
+	// Starts the download. Blocks until the scheduler lets it run.
+	void open(const std::string &url);
+
+	// Fills buf with the bytes at offset, waiting for them to arrive. A read
+	// a little ahead of the stream first gives the ones before it, which
+	// the kernel may hand out of order, a chance to come; the bytes in
+	// between are then skipped. Returns false, and closes the stream, if
+	// the read cannot be served.
+	bool read(void *buf, size_t size, off_t offset);
+
+	// Ends the download, and with it the stream
+	void close();
+
+	bool closed();
+
+	// Since when it has not served a read
+	Clock::duration idle();
+
+private:
+	CGraph                  *graph_;
+	std::mutex              mutex_;
+	std::condition_variable cond_;
+	std::string             buffer_;   // what was received and not read yet, past head_
+	size_t                  head_{};
+	off_t                   position_; // of the next byte to be read
+	off_t                   received_; // past the last byte received
+	size_t                  capacity_;
+	bool                    busy_{};   // a read is being served
+	bool                    paused_{};
+	bool                    done_{};
+	bool                    closed_{};
+	CCurl                   *curl_{};  // running the transfer
+	Clock::time_point       lastRead_;
+
+	// Takes a piece of the body, on the transfer engine thread
+	size_t take(const char *data, size_t size);
+
+	void finished(long respCode, std::exception_ptr error);
+
+	// Has the transfer unpaused on the transfer engine thread
+	void resume();
+
+	size_t buffered() const
+	{
+		return buffer_.size() - head_;
+	}
+};
+
+} // namespace OneDrive
+
+#endif // __STREAM_H_INCLUDED__
@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <json/json.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "appconfig.h"
+#include "log.h"
+#include "token.h"
+
+namespace OneDrive {
+
+void CTokenManager::init()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (!gConfig.token().empty() && !gConfig.refreshToken().empty()) {
+		const std::string path = gConfig.configDir() + "/token.json";
+		std::chrono::system_clock::time_point issued;
+		struct stat st{};
+
+		// The expiry is relative to when the tokens were saved
+		if (stat(path.c_str(), &st) == 0)
+			issued = std::chrono::system_clock::from_time_t(st.st_mtime);
+
+		Json::Value root;
+
+		root["token_type"] = gConfig.tokenType();
+		root["access_token"] = gConfig.token();
+		root["refresh_token"] = gConfig.refreshToken();
+		root["expires_in"] = gConfig.tokenExpires();
+
+		apply(root, issued);
+	} else {
+		// Redeem the code for access tokens
+		std::list<std::pair<std::string, std::string>> params;
+
+		params.emplace_back(std::make_pair("client_id", gConfig.clientId()));
+		params.emplace_back(std::make_pair("redirect_uri", gConfig.redirectUri()));
+		params.emplace_back(std::make_pair("code", gConfig.authorizationCode()));
+		params.emplace_back(std::make_pair("grant_type", "authorization_code"));
+
+		Json::Value root = parse(fetch(params));
+
+		apply(root, std::chrono::system_clock::now());
+
+		root["refresh_token"] = refreshToken_;
+
+		persist(root);
+	}
+
+	thread_ = std::thread(&CTokenManager::run, this);
+}
+
+void CTokenManager::stop()
+{
+	std::list<Completion> waiters;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (stop_)
+			return;
+
+		stop_ = true;
+	}
+
+	cond_.notify_one();
+
+	if (thread_.joinable())
+		thread_.join();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		waiters.swap(waiters_);
+	}
+
+	for (auto &&w : waiters)
+		w(std::make_exception_ptr(std::runtime_error("the token manager has stopped")));
+}
+
+std::shared_ptr<const std::string> CTokenManager::authorization()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	return authorization_;
+}
+
+void CTokenManager::renew(const std::shared_ptr<const std::string> &rejected, Completion done)
+{
+	std::exception_ptr error;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (stop_) {
+			error = std::make_exception_ptr(std::runtime_error("the token manager has stopped"));
+		} else if (authorization_ == rejected) {
+			// A refresh already on its way will do
+			waiters_.emplace_back(std::move(done));
+			if (!refreshing_) {
+				refreshNow_ = true;
+				cond_.notify_one();
+			}
+			return;
+		}
+	}
+
+	done(error);
+}
+
+Json::Value CTokenManager::parse(const std::string &data)
+{
+	std::stringstream ss(data);
+	Json::Value root;
+
+	ss >> root;
+
+	return root;
+}
+
+void CTokenManager::apply(const Json::Value &root, std::chrono::system_clock::time_point issued)
+{
+	if (root["access_token"].asString().empty())
+		throw std::runtime_error("the token endpoint did not return an access token");
+
+	authorization_ = std::make_shared<const std::string>("Authorization: " + root["token_type"].asString() + " " +
+							     root["access_token"].asString());
+
+	// The refresh token is only sometimes rotated
+	if (!root["refresh_token"].asString().empty())
+		refreshToken_ = root["refresh_token"].asString();
+
+	long expiresIn = 0;
+
+	try {
+		expiresIn = std::stol(root["expires_in"].asString());
+	} catch (...) {
+	}
+
+	// Refresh ahead of the expiry, leaving enough time to retry on failure
+	std::chrono::seconds lifetime(expiresIn);
+
+	refreshAt_ = issued + lifetime - std::min(std::chrono::seconds(300), lifetime / 2);
+}
+
+std::string CTokenManager::fetch(const std::list<std::pair<std::string, std::string>> &params)
+{
+	std::string url = gConfig.authorityUrl() + gConfig.tokenEndpoint();
+	std::string body = httpClient_.formEncode(params);
+	long respCode = 0;
+
+	std::string data = httpClient_.post(url, body, respCode);
+
+	if (respCode != 200)
+		throw std::runtime_error("the server responded with: " + data);
+
+	return data;
+}
+
+void CTokenManager::persist(const Json::Value &root)
+{
+	const std::string path = gConfig.configDir() + "/token.json";
+	const std::string tmpPath = path + ".tmp";
+
+	{
+		std::ofstream f(tmpPath, std::ios::binary | std::ios::trunc);
+
+		if (!f)
+			throw std::runtime_error("failed to save the token JSON");
+
+		f << root;
+
+		if (!f.flush())
+			throw std::runtime_error("failed to save the token JSON");
+	}
+
+	if (std::rename(tmpPath.c_str(), path.c_str()) < 0)
+		throw std::runtime_error("failed to save the token JSON");
+}
+
+void CTokenManager::run()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	while (!stop_) {
+		if (!refreshNow_ && std::chrono::system_clock::now() < refreshAt_) {
+			cond_.wait_until(lock, refreshAt_);
+			continue;
+		}
+
+		refreshNow_ = false;
+		refreshing_ = true;
+
+		std::list<std::pair<std::string, std::string>> params;
+
+		params.emplace_back(std::make_pair("client_id", gConfig.clientId()));
+		params.emplace_back(std::make_pair("redirect_uri", gConfig.redirectUri()));
+		params.emplace_back(std::make_pair("refresh_token", refreshToken_));
+		params.emplace_back(std::make_pair("grant_type", "refresh_token"));
+
+		lock.unlock();
+
+		Json::Value root;
+		std::exception_ptr error;
+
+		try {
+			root = parse(fetch(params));
+		} catch (...) {
+			error = std::current_exception();
+		}
+
+		lock.lock();
+
+		if (!error) {
+			try {
+				apply(root, std::chrono::system_clock::now());
+
+				// The response leaves the refresh token out unless it rotated
+				root["refresh_token"] = refreshToken_;
+			} catch (...) {
+				error = std::current_exception();
+			}
+		}
+
+		if (error) {
+			try {
+				std::rethrow_exception(error);
+			} catch (const std::exception &e) {
+				LOG_ERROR("failed to refresh the access token: " << e.what());
+			} catch (...) {
+				LOG_ERROR("failed to refresh the access token: unknown exception");
+			}
+
+			refreshAt_ = std::chrono::system_clock::now() + std::chrono::seconds(30);
+		}
+
+		std::list<Completion> waiters;
+
+		waiters.swap(waiters_);
+		refreshing_ = false;
+
+		lock.unlock();
+
+		for (auto &&w : waiters) {
+			try {
+				w(error);
+			} catch (...) {
+				LOG_ERROR("a token refresh completion has failed");
+			}
+		}
+
+		if (!error) {
+			try {
+				persist(root);
+			} catch (const std::exception &e) {
+				LOG_ERROR(e.what());
+			}
+		}
+
+		lock.lock();
+	}
+}
+
+} // namespace OneDrive
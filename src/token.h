@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef __TOKEN_H_INCLUDED__
+#define __TOKEN_H_INCLUDED__
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "curl.h"
+
+namespace Json {
+class Value;
+}
+
+namespace OneDrive {
+
+// Keeps the OAuth2 tokens in memory and refreshes the access token on a
+// background thread ahead of its expiry. Concurrent refresh requests are
+// folded into a single POST and token.json is rewritten off the request path.
+class CTokenManager
+{
+public:
+	// Invoked once a refresh asked for through renew() is over
+	typedef std::function<void(std::exception_ptr error)> Completion;
+
+	CTokenManager()
+	{
+	}
+
+	~CTokenManager()
+	{
+		stop();
+	}
+
+	CTokenManager(const CTokenManager &) = delete;
+	CTokenManager & operator=(const CTokenManager &) = delete;
+
+	// Loads the tokens saved by a previous run, or redeems the authorization
+	// code for new ones, and starts the refresher
+	void init();
+
+	void stop();
+
+	// The header to send along the requests. It is shared by all of them
+	// and only replaced when the token changes.
+	std::shared_ptr<const std::string> authorization();
+
+	// A request was rejected with the given header. done is invoked at once
+	// if the token has changed since, otherwise when the refresh is over.
+	void renew(const std::shared_ptr<const std::string> &rejected, Completion done);
+
+private:
+	static Json::Value parse(const std::string &data);
+
+	// Stores a token endpoint response and works out when to refresh
+	void apply(const Json::Value &root, std::chrono::system_clock::time_point issued);
+
+	std::string fetch(const std::list<std::pair<std::string, std::string>> &params);
+
+	// Saves a token endpoint response, which must carry the refresh token
+	// in use even when the server did not rotate it
+	void persist(const Json::Value &root);
+
+	void run();
+
+	CCurl httpClient_;
+
+	std::mutex                            mutex_;
+	std::condition_variable               cond_;
+	std::shared_ptr<const std::string>    authorization_;
+	std::string                           refreshToken_;
+	std::chrono::system_clock::time_point refreshAt_;
+	bool                                  refreshNow_{};
+	bool                                  refreshing_{};
+	std::list<Completion>                 waiters_;
+	bool                                  stop_{};
+	std::thread                           thread_;
+};
+
+} // namespace OneDrive
+
+#endif // __TOKEN_H_INCLUDED__
@@ -0,0 +1,365 @@
+// SPDX-License-Identifier: GPL-2.0
+
+// Exercises the retries, the backoff and the circuit breaker of CGraph
+// against a local stand-in server answering with scripted responses, and
+// the way its scheduler hands out the connections
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../src/appconfig.h"
+#include "../src/graph.h"
+#include "../src/log.h"
+#include "../src/scheduler.h"
+
+OneDrive::CAppConfig gConfig;
+OneDrive::CLog gLog;
+
+namespace {
+
+struct CResponse {
+	int         status;
+	std::string headers;
+	std::string body;
+};
+
+// Answers every request with the next scripted response, or with a 206 of
+// the default body once the script has run out. One request per connection.
+class CStandIn
+{
+public:
+	CStandIn()
+	{
+		fd_ = socket(AF_INET, SOCK_STREAM, 0);
+
+		struct sockaddr_in addr{};
+
+		addr.sin_family      = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		socklen_t len = sizeof(addr);
+
+		if (fd_ < 0 || bind(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 ||
+		    listen(fd_, 16) < 0 || getsockname(fd_, reinterpret_cast<struct sockaddr *>(&addr), &len) < 0)
+			throw std::runtime_error("failed to set up the stand-in server");
+
+		port_ = ntohs(addr.sin_port);
+
+		thread_ = std::thread([this]() { run(); });
+	}
+
+	~CStandIn()
+	{
+		stop_ = true;
+
+		thread_.join();
+
+		close(fd_);
+	}
+
+	std::string url() const
+	{
+		return "http://127.0.0.1:" + std::to_string(port_) + "/content";
+	}
+
+	void script(int status, const std::string &headers = std::string(), const std::string &body = std::string())
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		script_.push_back(CResponse{status, headers, body});
+	}
+
+	unsigned int requests() const
+	{
+		return requests_;
+	}
+
+	static const char defaultBody[];
+
+private:
+	int                       fd_;
+	unsigned short            port_;
+	std::atomic<bool>         stop_{false};
+	std::atomic<unsigned int> requests_{0};
+	std::mutex                mutex_;
+	std::deque<CResponse>     script_;
+	std::thread               thread_;
+
+	void run()
+	{
+		while (!stop_) {
+			struct pollfd pfd{fd_, POLLIN, 0};
+
+			if (poll(&pfd, 1, 50) <= 0)
+				continue;
+
+			int conn = accept(fd_, nullptr, nullptr);
+
+			if (conn < 0)
+				continue;
+
+			serve(conn);
+
+			close(conn);
+		}
+	}
+
+	void serve(int conn)
+	{
+		std::string request;
+		char buf[4096];
+
+		while (request.find("\r\n\r\n") == std::string::npos) {
+			ssize_t n = recv(conn, buf, sizeof(buf), 0);
+
+			if (n <= 0)
+				return;
+
+			request.append(buf, n);
+		}
+
+		requests_++;
+
+		CResponse response{206, std::string(), defaultBody};
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			if (!script_.empty()) {
+				response = script_.front();
+				script_.pop_front();
+			}
+		}
+
+		std::ostringstream out;
+
+		out << "HTTP/1.1 " << response.status << " Scripted\r\n"
+		    << "Content-Length: " << response.body.size() << "\r\n"
+		    << "Connection: close\r\n"
+		    << response.headers
+		    << "\r\n"
+		    << response.body;
+
+		std::string data = out.str();
+
+		for (size_t sent = 0; sent < data.size();) {
+			ssize_t n = send(conn, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+
+			if (n <= 0)
+				return;
+
+			sent += n;
+		}
+	}
+};
+
+const char CStandIn::defaultBody[] = "0123456789";
+
+int failures = 0;
+
+void check(bool condition, const std::string &what)
+{
+	std::cout << (condition ? "ok      " : "FAILED  ") << what << std::endl;
+
+	if (!condition)
+		failures++;
+}
+
+std::string readRange(OneDrive::CGraph &graph, CStandIn &server)
+{
+	char buf[sizeof(CStandIn::defaultBody) - 1];
+
+	size_t n = graph.request(server.url(), buf, sizeof(buf), 0);
+
+	return std::string(buf, n);
+}
+
+// A request answered with that status once the breaker is open; the status
+// must not leave the breaker stuck
+void testProbe(int status, const std::string &headers)
+{
+	CStandIn server;
+	OneDrive::CGraph graph;
+
+	// The breaker opens at the third failure, before the last retry
+	for (int i = 0; i < 3; i++)
+		server.script(500);
+
+	bool failed = false;
+
+	try {
+		readRange(graph, server);
+	} catch (const std::exception &) {
+		failed = true;
+	}
+
+	check(failed && server.requests() == 3, "the breaker opens after 3 failures, cutting the retries short");
+
+	unsigned int before = server.requests();
+	bool fastFailed = false;
+
+	try {
+		readRange(graph, server);
+	} catch (const std::exception &e) {
+		fastFailed = std::string(e.what()).find("failing fast") != std::string::npos;
+	}
+
+	check(fastFailed && server.requests() == before, "an open breaker fails requests without sending them");
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+
+	server.script(status, headers);
+
+	try {
+		readRange(graph, server);
+	} catch (const std::exception &) {
+	}
+
+	std::string data;
+
+	try {
+		data = readRange(graph, server);
+	} catch (const std::exception &e) {
+		data = e.what();
+	}
+
+	check(data == CStandIn::defaultBody, "a probe answered with " + std::to_string(status) + " closes the breaker");
+}
+
+// Takes every slot the bulk classes can get, then asks for a lookup
+void testScheduler(unsigned int connections)
+{
+	OneDrive::CSchedulerProfile profile;
+	OneDrive::CScheduler scheduler(profile, connections);
+	std::vector<std::unique_ptr<OneDrive::CScheduler::CSlot>> slots;
+
+	for (auto priority : {OneDrive::CScheduler::PRIORITY_READ, OneDrive::CScheduler::PRIORITY_STREAM,
+			      OneDrive::CScheduler::PRIORITY_BACKGROUND, OneDrive::CScheduler::PRIORITY_UPLOAD}) {
+		for (;;) {
+			std::unique_ptr<OneDrive::CScheduler::CSlot> slot(scheduler.tryAcquire(priority));
+
+			if (!slot)
+				break;
+
+			slots.push_back(std::move(slot));
+		}
+	}
+
+	bool admitted = !!scheduler.tryAcquire(OneDrive::CScheduler::PRIORITY_INTERACTIVE);
+
+	check(admitted && slots.size() < connections, "a lookup is admitted while the bulk classes are saturated with " +
+	      std::to_string(connections) + " connections");
+}
+
+} // anonymous namespace
+
+int main()
+{
+	char dir[] = "/tmp/onedrivefs-test-XXXXXX";
+
+	if (!mkdtemp(dir)) {
+		std::cerr << "mkdtemp() has failed" << std::endl;
+		return 1;
+	}
+
+	{
+		std::ofstream cfg(std::string(dir) + "/config.json");
+
+		cfg << "{\"authority_url\": \"http://127.0.0.1\", \"auth_endpoint\": \"/a\", \"token_endpoint\": \"/t\","
+		       " \"client_id\": \"test\", \"redirect_uri\": \"http://127.0.0.1/r\","
+		       " \"retry\": {\"max_retries\": 3, \"base_delay_ms\": 10, \"max_delay_ms\": 5000,"
+		       " \"breaker_threshold\": 3, \"breaker_open_time\": 1}}";
+	}
+
+	gConfig.setConfigDir(dir);
+	gConfig.readConfig();
+
+	{
+		CStandIn server;
+		OneDrive::CGraph graph;
+
+		server.script(503);
+		server.script(502);
+
+		check(readRange(graph, server) == CStandIn::defaultBody && server.requests() == 3,
+		      "server errors are retried");
+	}
+
+	{
+		CStandIn server;
+		OneDrive::CGraph graph;
+
+		server.script(429, "Retry-After: 1\r\n");
+
+		auto started = std::chrono::steady_clock::now();
+		std::string data = readRange(graph, server);
+		auto elapsed = std::chrono::steady_clock::now() - started;
+
+		check(data == CStandIn::defaultBody && elapsed >= std::chrono::milliseconds(900),
+		      "a throttled request is retried after Retry-After");
+	}
+
+	{
+		CStandIn server;
+		OneDrive::CGraph graph;
+
+		server.script(404);
+
+		bool notFound = false;
+
+		try {
+			readRange(graph, server);
+		} catch (const OneDrive::CHttpError &e) {
+			notFound = e.respCode() == 404;
+		}
+
+		check(notFound && server.requests() == 1, "a client error is not retried");
+	}
+
+	{
+		CStandIn server;
+		OneDrive::CGraph graph;
+		const std::string path = std::string(dir) + "/download";
+
+		server.script(500, std::string(), "<html>error page</html>");
+		server.script(200, std::string(), "the content");
+
+		{
+			std::ofstream file(path, std::ios::binary);
+
+			graph.download(server.url(), file);
+		}
+
+		std::ifstream file(path, std::ios::binary);
+		std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+		check(content == "the content", "a retried download keeps only the content");
+	}
+
+	testScheduler(16);
+	testScheduler(8);
+
+	testProbe(429, "Retry-After: 0\r\n");
+	testProbe(404, std::string());
+
+	std::system((std::string("rm -rf ") + dir).c_str());
+
+	return failures > 0 ? 1 : 0;
+}
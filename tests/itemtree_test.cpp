@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: GPL-2.0
+
+// Exercises how CItemTree keeps the names known to be missing from a folder
+// as its children are refreshed, moved and renamed
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../src/appconfig.h"
+#include "../src/itemtree.h"
+#include "../src/log.h"
+
+OneDrive::CAppConfig gConfig;
+OneDrive::CLog gLog;
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const std::string &what)
+{
+	std::cout << (condition ? "ok      " : "FAILED  ") << what << std::endl;
+
+	if (!condition)
+		failures++;
+}
+
+OneDrive::CDriveItem folder(const std::string &id, const std::string &name)
+{
+	return OneDrive::CDriveItem(id, name, "0", "", "", "", OneDrive::CDriveItem::DRIVE_ITEM_FOLDER);
+}
+
+OneDrive::CDriveItem file(const std::string &id, const std::string &name, const std::string &size)
+{
+	return OneDrive::CDriveItem(id, name, size, "", "", "", OneDrive::CDriveItem::DRIVE_ITEM_FILE);
+}
+
+bool knownMissing(OneDrive::CItemTree &tree, const std::string &name)
+{
+	OneDrive::CDriveItem driveItem;
+	bool missing;
+
+	tree.resolve(std::vector<std::string>(1, name), driveItem, missing);
+
+	return missing;
+}
+
+} // anonymous namespace
+
+int main()
+{
+	OneDrive::CItemTree tree(1024, 30, 300, 60);
+
+	tree.setRoot(folder("root", "root"));
+	tree.insert("root", file("a", "a.txt", "1"));
+	tree.insert("root", folder("d", "dir"));
+	tree.addMissing("root", "b.txt");
+
+	check(knownMissing(tree, "b.txt"), "a name the server reported missing is known missing");
+
+	tree.insert("root", file("a", "a.txt", "2"));
+	tree.update("root", file("a", "a.txt", "3"));
+
+	check(knownMissing(tree, "b.txt"), "refreshing a child in place keeps the missing names of its folder");
+
+	tree.insert("root", file("a", "c.txt", "3"));
+
+	check(!knownMissing(tree, "b.txt"), "renaming a child forgets the missing names of its folder");
+
+	tree.addMissing("root", "b.txt");
+	tree.insert("d", file("a", "c.txt", "3"));
+
+	check(!knownMissing(tree, "b.txt"), "moving a child away forgets the missing names of its folder");
+
+	return failures > 0 ? 1 : 0;
+}